@@ -110,6 +110,7 @@ extern char tmpline[];
 
 /* Exported from ftpcmd.y.  */
 extern off_t restart_point;
+extern off_t alloc_size;
 
 /* Distinguish passive address modes.  */
 #define PASSIVE_PASV 0
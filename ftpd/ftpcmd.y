@@ -110,6 +110,7 @@
 #endif
 
 off_t restart_point;
+off_t alloc_size;		/* Announced by ALLO for the next upload.  */
 
 static char cbuf[512];           /* Command Buffer.  */
 static char *fromname;
@@ -312,11 +313,13 @@ cmd
 		}
 	| ALLO SP NUMBER CRLF
 		{
-			reply (202, "ALLO command ignored.");
+			alloc_size = $3;
+			reply (200, "ALLO command successful.");
 		}
 	| ALLO SP NUMBER SP R SP NUMBER CRLF
 		{
-			reply (202, "ALLO command ignored.");
+			alloc_size = $3;
+			reply (200, "ALLO command successful.");
 		}
 	| RETR check_login SP pathname CRLF
 		{
@@ -1340,7 +1343,7 @@ static struct tab cmdtab[] = {
   { "STOR", STOR, STR1, 1,	"<sp> file-name" },
   { "STOU", STOU, STR1, 1,	"<sp> file-name" },
   { "APPE", APPE, STR1, 1,	"<sp> file-name" },
-  { "ALLO", ALLO, ARGS, 1,	"allocate storage (vacuously)" },
+  { "ALLO", ALLO, ARGS, 1,	"allocate storage" },
   { "REST", REST, ARGS, 1,	"<sp> offset (restart command)" },
   { "RNFR", RNFR, STR1, 1,	"<sp> file-name" },
   { "RNTO", RNTO, STR1, 1,	"<sp> file-name" },
@@ -86,11 +86,19 @@
 #include <string.h>
 #include <syslog.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 #ifdef HAVE_MMAP
 # include <sys/mman.h>
 #endif
+#if defined HAVE_SYS_SENDFILE_H && defined HAVE_SENDFILE
+# include <sys/sendfile.h>
+# define USE_SENDFILE 1
+#endif
+#if defined HAVE_SPLICE && defined SPLICE_F_MOVE
+# define USE_SPLICE 1
+#endif
 /* Include glob.h last, because it may define "const" which breaks
    system headers on some platforms. */
 #include <glob.h>
@@ -203,6 +211,8 @@ off_to_str (off_t off)
 #define SWAITMAX	90	/* wait at most 90 seconds */
 #define SWAITINT	5	/* interval between retries */
 
+#define ALLOMAX		((off_t) 1 << 30)	/* Most space ALLO reserves.  */
+
 static int swaitmax = SWAITMAX;
 static int swaitint = SWAITINT;
 
@@ -1057,7 +1067,10 @@ store (const char *name, const char *mode, int unique)
   FILE *fout, *din;
   struct stat st;
   int (*closefunc) (FILE *);
+  MAYBE_UNUSED off_t alloc = alloc_size;	/* For this upload only.  */
+  MAYBE_UNUSED off_t reserved = 0, reserved_at = 0;
 
+  alloc_size = 0;
   if (unique && stat (name, &st) == 0)
     {
       const char *name_unique = gunique (name);
@@ -1124,6 +1137,25 @@ store (const char *name, const char *mode, int unique)
 	  goto done;
 	}
     }
+#if defined HAVE_FALLOCATE && defined FALLOC_FL_KEEP_SIZE
+  /* Reserve the space announced by ALLO, up to ALLOMAX, so that the
+     file is laid out in few extents.  Its size is left alone, and
+     whatever is reserved beyond the data received is released once
+     done.  Guests reserve nothing, lest they fill the disk for free.  */
+  if (alloc > 0 && !cred.guest)
+    {
+      reserved = alloc < ALLOMAX ? alloc : ALLOMAX;
+      reserved_at = restart_point ? restart_point
+	: *mode == 'a' ? st.st_size : 0;
+      if (fallocate (fileno (fout), FALLOC_FL_KEEP_SIZE,
+		     reserved_at, reserved) < 0)
+	{
+	  if (debug)
+	    syslog (LOG_DEBUG, "fallocate: %m");
+	  reserved = 0;
+	}
+    }
+#endif
   din = dataconn (name, (off_t) - 1, "r");
   if (din == NULL)
     goto done;
@@ -1138,6 +1170,14 @@ store (const char *name, const char *mode, int unique)
   data = -1;
   pdata = -1;
 done:
+#if defined HAVE_FALLOCATE && defined FALLOC_FL_KEEP_SIZE
+  /* Release the reservation past the end of the file.  Truncating to
+     the same size does so, where punching a hole there may not.  */
+  if (reserved > 0 && fflush (fout) == 0 && fstat (fileno (fout), &st) == 0
+      && st.st_size < reserved_at + reserved
+      && ftruncate (fileno (fout), st.st_size) < 0 && debug)
+    syslog (LOG_DEBUG, "ftruncate: %m");
+#endif
   LOGBYTES (*mode == 'w' ? "put" : "append", name, byte_count);
   (*closefunc) (fout);
 }
@@ -1307,6 +1347,173 @@ dataconn (const char *name, off_t size, const char *mode)
 }
 
 #define IU_MMAP_SIZE 0x800000	/* 8 MByte */
+#define IU_SENDFILE_SIZE 0x800000	/* Largest single sendfile() call.  */
+#define IU_ASCII_SIZE 0x10000	/* Least block converted in ASCII mode.  */
+
+#ifdef IOV_MAX
+# define IU_ASCII_IOV IOV_MAX
+#else
+# define IU_ASCII_IOV 16	/* The least POSIX allows.  */
+#endif
+
+/* ASCII mode converts the data by blocks: line ends are found with
+   memchr, which C libraries vectorize, and the spans between them are
+   gathered here and written with writev.  */
+struct iobatch
+{
+  int fd;
+  int cnt;
+  struct iovec iov[IU_ASCII_IOV];
+};
+
+/* Write out the spans gathered in IOB.  Return -1 on error.  */
+static int
+iobatch_flush (struct iobatch *iob)
+{
+  struct iovec *iov = iob->iov;
+  int cnt = iob->cnt;
+  ssize_t n;
+
+  iob->cnt = 0;
+  while (cnt > 0)
+    {
+      n = writev (iob->fd, iov, cnt);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      for (; cnt > 0 && (size_t) n >= iov->iov_len; iov++, cnt--)
+	n -= iov->iov_len;
+      if (cnt > 0)
+	{
+	  iov->iov_base = (char *) iov->iov_base + n;
+	  iov->iov_len -= n;
+	}
+    }
+  return 0;
+}
+
+/* Add the LEN bytes at P to IOB, which is written out when full.  */
+static int
+iobatch_add (struct iobatch *iob, const char *p, size_t len)
+{
+  struct iovec *last = iob->iov + iob->cnt;
+
+  if (len == 0)
+    return 0;
+  if (iob->cnt > 0 && (const char *) last[-1].iov_base + last[-1].iov_len == p)
+    {
+      last[-1].iov_len += len;
+      return 0;
+    }
+  iob->iov[iob->cnt].iov_base = (char *) p;
+  iob->iov[iob->cnt].iov_len = len;
+  if (++iob->cnt == IU_ASCII_IOV)
+    return iobatch_flush (iob);
+  return 0;
+}
+
+/* Write the bytes from P to END to IOB with CR before each LF, as
+   ASCII mode sends them.  Return -1 on error.  */
+static int
+ascii_send (struct iobatch *iob, const char *p, const char *end)
+{
+  const char *nl;
+
+  while ((nl = memchr (p, '\n', end - p)) != NULL)
+    {
+      if (iobatch_add (iob, p, nl - p) < 0
+	  || iobatch_add (iob, "\r\n", 2) < 0)
+	return -1;
+      p = nl + 1;
+    }
+  if (iobatch_add (iob, p, end - p) < 0)
+    return -1;
+  return iobatch_flush (iob);
+}
+
+/* Write the bytes from P to END to IOB without the CR of each CR LF
+   and the NUL of each CR NUL, as ASCII mode stores them.  *CR is set
+   if the block ended with a CR whose fate the next one decides.  Add
+   the line feeds without CR to *BARE_LFS.  Return -1 on error.  */
+static int
+ascii_receive (struct iobatch *iob, const char *p, const char *end,
+	       int *cr, int *bare_lfs)
+{
+  const char *start = p, *q, *lf;
+
+  if (*cr && p < end)
+    {
+      *cr = 0;
+      if (*p == '\n')
+	p++;
+      else
+	{
+	  if (iobatch_add (iob, "\r", 1) < 0)
+	    return -1;
+	  if (*p == '\0')
+	    start = ++p;
+	}
+    }
+
+  while (p < end)
+    {
+      q = memchr (p, '\r', end - p);
+      if (q == NULL)
+	q = end;
+      for (; (lf = memchr (p, '\n', q - p)) != NULL; p = lf + 1)
+	(*bare_lfs)++;
+      if (q == end)
+	break;
+
+      if (q + 1 == end)
+	{
+	  if (iobatch_add (iob, start, q - start) < 0)
+	    return -1;
+	  start = end;
+	  *cr = 1;
+	  break;
+	}
+      else if (q[1] == '\n')
+	{
+	  if (iobatch_add (iob, start, q - start) < 0)
+	    return -1;
+	  start = q + 1;
+	  p = q + 2;
+	}
+      else if (q[1] == '\0')
+	{
+	  if (iobatch_add (iob, start, q + 1 - start) < 0)
+	    return -1;
+	  start = p = q + 2;
+	}
+      else
+	p = q + 1;
+    }
+  if (iobatch_add (iob, start, end - start) < 0)
+    return -1;
+  return iobatch_flush (iob);
+}
+
+/* The buffer a transfer copies through, kept here so that an aborted
+   transfer can free it.  */
+static char *xfer_buf;
+
+static char *
+xfer_buf_alloc (size_t size)
+{
+  xfer_buf = malloc (size);
+  return xfer_buf;
+}
+
+static void
+xfer_buf_free (void)
+{
+  free (xfer_buf);
+  xfer_buf = NULL;
+}
 
 /* Tranfer the contents of "instr" to "outstr" peer using the appropriate
    encapsulation of the data subject * to Mode, Structure, and Type.
@@ -1315,20 +1522,57 @@ dataconn (const char *name, off_t size, const char *mode)
 static void
 send_data (FILE *instr, FILE *outstr, off_t blksize)
 {
-  int c, cnt, filefd, netfd;
+  int cnt, filefd, netfd;
   char *buf = MAP_FAILED, *bp;
   off_t curpos;
   off_t len, filesize;
+  size_t n;
+  struct iobatch iob;
 
   transflag++;
   if (setjmp (urgcatch))
     {
+      xfer_buf_free ();
       transflag = 0;
       return;
     }
 
   netfd = fileno (outstr);
   filefd = fileno (instr);
+#ifdef USE_SENDFILE
+  /* Image files are handed to the kernel from the current position,
+     wherever REST left it, and never copied through user space.
+     Output of commands, whose size is unknown, is copied below, as
+     is any file the kernel cannot send.  */
+  if ((type == TYPE_I || type == TYPE_L) && file_size >= 0)
+    {
+      ssize_t sent;
+
+      if (debug)
+	syslog (LOG_DEBUG, "Reading file as image with sendfile.");
+      while ((sent = sendfile (netfd, filefd, NULL, IU_SENDFILE_SIZE)) != 0)
+	{
+	  if (sent > 0)
+	    byte_count += sent;
+	  else if (errno != EINTR)
+	    break;
+	}
+      if (sent == 0)
+	{
+	  transflag = 0;
+	  reply (226, "Transfer complete.");
+	  return;
+	}
+      if (byte_count > 0 || (errno != EINVAL && errno != ENOSYS))
+	{
+	  if (errno == EIO)
+	    goto file_err;
+	  goto data_err;
+	}
+      if (debug)
+	syslog (LOG_DEBUG, "sendfile: %m, copying instead.");
+    }
+#endif
 #ifdef HAVE_MMAP
   /* Last argument in mmap() must be page aligned,
    * at least for Solaris and Linux, so use mmap()
@@ -1351,51 +1595,46 @@ send_data (FILE *instr, FILE *outstr, off_t blksize)
     {
 
     case TYPE_A:
+      iob.fd = netfd;
+      iob.cnt = 0;
 #ifdef HAVE_MMAP
       if (file_size > 0 && curpos >= 0 && buf != MAP_FAILED)
 	{
 	  if (debug)
 	    syslog (LOG_DEBUG, "Reading file as ascii in mmap mode.");
-	  len = 0;
-	  while (len < filesize)
-	    {
-	      byte_count++;
-	      if (buf[len] == '\n')
-		{
-		  if (ferror (outstr))
-		    break;
-		  putc ('\r', outstr);
-		}
-	      putc (buf[len], outstr);
-	      len++;
-	    }
-	  fflush (outstr);
+	  cnt = ascii_send (&iob, buf, buf + filesize);
+	  if (cnt == 0)
+	    byte_count += filesize;
 	  transflag = 0;
 	  munmap (buf, filesize);
-	  if (ferror (outstr))
+	  if (cnt < 0)
 	    goto data_err;
 	  reply (226, "Transfer complete.");
 	  return;
 	}
 #endif
       if (debug)
-	syslog (LOG_DEBUG, "Reading file as ascii in byte mode.");
-      while ((c = getc (instr)) != EOF)
+	syslog (LOG_DEBUG, "Reading file as ascii in block mode.");
+
+      /* Read through stdio, which holds the data following REST.  */
+      if (blksize < IU_ASCII_SIZE)
+	blksize = IU_ASCII_SIZE;
+      buf = xfer_buf_alloc ((size_t) blksize);
+      if (buf == NULL)
 	{
-	  byte_count++;
-	  if (c == '\n')
-	    {
-	      if (ferror (outstr))
-		goto data_err;
-	      putc ('\r', outstr);
-	    }
-	  putc (c, outstr);
+	  transflag = 0;
+	  perror_reply (451, "Local resource failure: malloc");
+	  return;
 	}
-      fflush (outstr);
+      while ((n = fread (buf, 1, (size_t) blksize, instr)) > 0
+	     && ascii_send (&iob, buf, buf + n) == 0)
+	byte_count += n;
+
       transflag = 0;
+      xfer_buf_free ();
       if (ferror (instr))
 	goto file_err;
-      if (ferror (outstr))
+      if (n > 0)
 	goto data_err;
       reply (226, "Transfer complete.");
       return;
@@ -1436,7 +1675,7 @@ send_data (FILE *instr, FILE *outstr, off_t blksize)
 	    syslog (LOG_DEBUG, "Starting at position %jd.", curpos);
 	}
 
-      buf = malloc ((unsigned int) blksize);
+      buf = xfer_buf_alloc ((unsigned int) blksize);
       if (buf == NULL)
 	{
 	  transflag = 0;
@@ -1448,7 +1687,7 @@ send_data (FILE *instr, FILE *outstr, off_t blksize)
 	byte_count += cnt;
 
       transflag = 0;
-      free (buf);
+      xfer_buf_free ();
       if (cnt != 0)
 	{
 	  if (cnt < 0)
@@ -1473,6 +1712,109 @@ file_err:
   perror_reply (551, "Error on input file");
 }
 
+#ifdef USE_SPLICE
+# define IU_SPLICE_SIZE 0x100000	/* 1 MByte */
+
+/* The pipe through which receive_data splices, kept here so that an
+   aborted transfer can close it.  */
+static int splice_pipe[2] = { -1, -1 };
+
+static void
+splice_close (void)
+{
+  int save_errno = errno;
+
+  if (splice_pipe[0] >= 0)
+    {
+      close (splice_pipe[0]);
+      close (splice_pipe[1]);
+      splice_pipe[0] = splice_pipe[1] = -1;
+    }
+  errno = save_errno;
+}
+
+/* Move the data coming on NETFD to the file FILEFD through a pipe,
+   without copying them to user space.  Return 0 at the end of the
+   data, -1 on an error of the connection and -2 on one of the file.
+   Return 1 if the kernel cannot splice these descriptors, once what
+   was already taken from the connection has been written, so that
+   the caller may go on copying.  */
+static int
+splice_data (int netfd, int filefd)
+{
+  ssize_t in, out;
+  char buf[BUFSIZ];
+
+  /* Linux refuses to splice to a file opened for appending.  */
+  if (fcntl (filefd, F_GETFL) & O_APPEND)
+    return 1;
+  if (pipe (splice_pipe) < 0)
+    {
+      splice_pipe[0] = splice_pipe[1] = -1;
+      return 1;
+    }
+# ifdef F_SETPIPE_SZ
+  fcntl (splice_pipe[1], F_SETPIPE_SZ, IU_SPLICE_SIZE);
+# endif
+
+  for (;;)
+    {
+      in = splice (netfd, NULL, splice_pipe[1], NULL, IU_SPLICE_SIZE,
+		   SPLICE_F_MOVE);
+      if (in == 0)
+	{
+	  splice_close ();
+	  return 0;
+	}
+      if (in < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  splice_close ();
+	  return byte_count == 0 && errno == EINVAL ? 1 : -1;
+	}
+
+      while (in > 0)
+	{
+	  out = splice (splice_pipe[0], NULL, filefd, NULL, in,
+			SPLICE_F_MOVE);
+	  if (out > 0)
+	    {
+	      in -= out;
+	      byte_count += out;
+	    }
+	  else if (out < 0 && errno == EINTR)
+	    continue;
+	  else if (out < 0 && errno == EINVAL && byte_count == 0)
+	    {
+	      /* The file system takes no spliced data: empty the pipe
+	         by hand, and let the caller copy the rest.  */
+	      while (in > 0
+		     && (out = read (splice_pipe[0], buf,
+				     in < (ssize_t) sizeof (buf)
+				     ? in : (ssize_t) sizeof (buf))) > 0)
+		{
+		  if (write (filefd, buf, out) != out)
+		    {
+		      splice_close ();
+		      return -2;
+		    }
+		  in -= out;
+		  byte_count += out;
+		}
+	      splice_close ();
+	      return 1;
+	    }
+	  else
+	    {
+	      splice_close ();
+	      return -2;
+	    }
+	}
+    }
+}
+#endif /* USE_SPLICE */
+
 /* Transfer data from peer to "outstr" using the appropriate encapulation of
    the data subject to Mode, Structure, and Type.
 
@@ -1480,13 +1822,17 @@ file_err:
 static int
 receive_data (FILE *instr, FILE *outstr, off_t blksize)
 {
-  int c;
-  int cnt, bare_lfs = 0;
+  int cnt, cr = 0, bare_lfs = 0;
   char *buf;
+  struct iobatch iob;
 
   transflag++;
   if (setjmp (urgcatch))
     {
+#ifdef USE_SPLICE
+      splice_close ();
+#endif
+      xfer_buf_free ();
       transflag = 0;
       return -1;
     }
@@ -1494,7 +1840,21 @@ receive_data (FILE *instr, FILE *outstr, off_t blksize)
     {
     case TYPE_I:
     case TYPE_L:
-      buf = malloc ((unsigned int) blksize);
+#ifdef USE_SPLICE
+      switch (splice_data (fileno (instr), fileno (outstr)))
+	{
+	case 0:
+	  transflag = 0;
+	  return 0;
+
+	case -1:
+	  goto data_err;
+
+	case -2:
+	  goto file_err;
+	}
+#endif
+      buf = xfer_buf_alloc ((unsigned int) blksize);
       if (buf == NULL)
 	{
 	  transflag = 0;
@@ -1506,12 +1866,12 @@ receive_data (FILE *instr, FILE *outstr, off_t blksize)
 	{
 	  if (write (fileno (outstr), buf, cnt) != cnt)
 	    {
-	      free (buf);
+	      xfer_buf_free ();
 	      goto file_err;
 	    }
 	  byte_count += cnt;
 	}
-      free (buf);
+      xfer_buf_free ();
       if (cnt < 0)
 	goto data_err;
       transflag = 0;
@@ -1523,30 +1883,36 @@ receive_data (FILE *instr, FILE *outstr, off_t blksize)
       return -1;
 
     case TYPE_A:
-      while ((c = getc (instr)) != EOF)
+      /* Whatever stdio holds after REST goes first.  */
+      if (fflush (outstr) != 0)
+	goto file_err;
+      iob.fd = fileno (outstr);
+      iob.cnt = 0;
+      if (blksize < IU_ASCII_SIZE)
+	blksize = IU_ASCII_SIZE;
+      buf = xfer_buf_alloc ((size_t) blksize);
+      if (buf == NULL)
 	{
-	  byte_count++;
-	  if (c == '\n')
-	    bare_lfs++;
-	  while (c == '\r')
+	  transflag = 0;
+	  perror_reply (451, "Local resource failure: malloc");
+	  return -1;
+	}
+
+      while ((cnt = read (fileno (instr), buf, blksize)) > 0)
+	{
+	  if (ascii_receive (&iob, buf, buf + cnt, &cr, &bare_lfs) < 0)
 	    {
-	      if (ferror (outstr))
-		goto data_err;
-	      c = getc (instr);
-	      if (c != '\n')
-		{
-		  putc ('\r', outstr);
-		  if (c == '\0' || c == EOF)
-		    goto contin2;
-		}
+	      xfer_buf_free ();
+	      goto file_err;
 	    }
-	  putc (c, outstr);
-	contin2:;
+	  byte_count += cnt;
 	}
-      fflush (outstr);
-      if (ferror (instr))
+      xfer_buf_free ();
+      if (cnt < 0)
 	goto data_err;
-      if (ferror (outstr))
+      /* A CR ending the data is kept.  */
+      if (cr && (iobatch_add (&iob, "\r", 1) < 0
+		 || iobatch_flush (&iob) < 0))
 	goto file_err;
       transflag = 0;
       if (bare_lfs)
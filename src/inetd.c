@@ -70,10 +70,15 @@
  *
  *	service name			must be in /etc/services or must
  *					name a tcpmux service
- *	socket type			stream/dgram/raw/rdm/seqpacket
+ *	socket type			stream[.backlog]/dgram/raw/rdm/
+ *					seqpacket
  *	protocol			must be in /etc/protocols
- *	wait/nowait[.max]		single-threaded/multi-threaded
- *                                      [with an optional fork limit]
+ *	wait/nowait[.max[.children[.per-source]]]
+ *					single-threaded/multi-threaded
+ *                                      [with an optional fork limit, and
+ *                                      limits of running servers,
+ *                                      or the size of a pool of
+ *                                      wait servers]
  *	user[:group] or user[.group]	user (and group) to run daemon as
  *	server program			full path name
  *	server program arguments	arguments starting with argv[0]
@@ -105,6 +110,7 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #ifdef HAVE_SYS_RESOURCE_H
 # include <sys/resource.h>
@@ -113,6 +119,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -120,6 +127,7 @@
 #include <pwd.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -130,6 +138,11 @@
 #include <progname.h>
 #include <sys/select.h>
 #include <grp.h>
+#if defined HAVE_SYS_EPOLL_H && defined HAVE_SYS_SIGNALFD_H
+# include <sys/epoll.h>
+# include <sys/signalfd.h>
+# define USE_EPOLL 1
+#endif
 
 #include "libinetutils.h"
 #include "argcv.h"
@@ -143,20 +156,43 @@
 #define TOOMANY		1000	/* don't start more than TOOMANY */
 #define CNT_INTVL	60	/* servers in CNT_INTVL sec. */
 #define RETRYTIME	(60*10)	/* retry after bind or server fail */
+#define CREDTTL		(60*10)	/* look up users and groups again after */
+#define ACCEPTMAX	64	/* connections accepted in a row */
+#define ACCEPTPAUSE	1	/* seconds not accepting when out of fds */
+#define CONNMAX		256	/* connections a built-in serves at most */
+#define CONNIDLE	(60*5)	/* seconds before idle ones are closed */
 
 #ifndef SIGCHLD
 # define SIGCHLD	SIGCLD
 #endif
-#define SIGBLOCK	(sigmask(SIGCHLD)|sigmask(SIGHUP)|sigmask(SIGALRM))
+#define SIGBLOCK	(sigmask(SIGCHLD)|sigmask(SIGHUP)|sigmask(SIGALRM)|\
+			 sigmask(SIGUSR2))
+
+/* Servers are started with vfork where the child needs no more than
+   system calls, that is when supplementary groups can be looked up
+   beforehand.  */
+#if defined HAVE_WORKING_VFORK && defined HAVE_GETGROUPLIST
+# define SPAWN_VFORK 1
+#endif
 
 bool debug = false;
 int nsock, maxsock;
+#ifdef USE_EPOLL
+/* The listening sockets are watched with epoll, which puts no limit
+   on descriptor numbers and hands back the service ready.  The
+   signals inetd handles stay blocked, and are read from SIGFD.  */
+int epfd = -1;
+int sigfd = -1;
+# define EVENTS_MAX	64
+#else
 fd_set allsock;
+#endif
 int options;
 int timingout;
+volatile sig_atomic_t pool_short;	/* a pool lacks workers */
+unsigned long long pool_retry;	/* when to start workers again, or 0 */
+unsigned long long accept_resume;	/* when paused services resume */
 unsigned toomany = TOOMANY;
-char **Argv;
-char *LastArg;
 
 char **config_files;
 
@@ -164,6 +200,8 @@ static bool env_option = false;	/* Set environment variables */
 static bool resolve_option = false;	/* Resolve IP addresses */
 static bool pidfile_option = true;	/* Record the PID in a file */
 static const char *pid_file = PATH_INETDPID;
+static time_t cred_ttl = CREDTTL;
+static const char *stats_file = PATH_INETDSTATS;
 
 const char args_doc[] = "[CONF-FILE [CONF-DIR]]...";
 const char doc[] = "Internet super-server.";
@@ -172,7 +210,9 @@ const char doc[] = "Internet super-server.";
 enum
 {
   OPT_ENVIRON = 256,
-  OPT_RESOLVE
+  OPT_RESOLVE,
+  OPT_CREDTTL,
+  OPT_STATSFILE
 };
 
 const char *program_authors[] = {
@@ -184,6 +224,9 @@ const char *program_authors[] = {
 
 static struct argp_option argp_options[] = {
 #define GRP 0
+  {"credentials-ttl", OPT_CREDTTL, "SECONDS", 0,
+   "look up the users and groups of services again after SECONDS; "
+   "0 waits for a reload (default 600)", GRP + 1},
   {"debug", 'd', NULL, 0,
    "turn on debugging, run in foreground mode", GRP + 1},
   {"environment", OPT_ENVIRON, NULL, 0,
@@ -197,6 +240,9 @@ static struct argp_option argp_options[] = {
   {"resolve", OPT_RESOLVE, NULL, 0,
    "resolve IP addresses when setting environment variables "
    "(see --environment)", GRP + 1},
+  {"stats-file", OPT_STATSFILE, "FILE", 0,
+   "write the counters of services to FILE on SIGUSR2 "
+   "(default: " PATH_INETDSTATS ")", GRP + 1},
 #undef GRP
   {NULL, 0, NULL, 0, NULL, 0}
 };
@@ -237,6 +283,18 @@ parse_opt (int key, char *arg, struct argp_state *state MAYBE_UNUSED)
       resolve_option = true;
       break;
 
+    case OPT_CREDTTL:
+      number = strtol (arg, &p, 0);
+      if (number < 0 || *p)
+	syslog (LOG_ERR, "--credentials-ttl %s: bad value", arg);
+      else
+	cred_ttl = number;
+      break;
+
+    case OPT_STATSFILE:
+      stats_file = arg;
+      break;
+
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -248,6 +306,35 @@ static struct argp argp =
   { argp_options, parse_opt, args_doc, doc, NULL, NULL, NULL };
 
 
+/* The credentials servers run with, shared by the services with the
+   same user and group.  They are looked up once per configuration
+   load, and again every cred_ttl seconds by the event loop.  */
+struct cred
+{
+  char *cr_user;
+  char *cr_group;		/* or NULL */
+  uid_t cr_uid;
+  gid_t cr_gid;
+  gid_t *cr_groups;		/* supplementary groups of cr_user */
+  int cr_ngroups;
+  time_t cr_time;		/* when looked up, 0 to do it again */
+  unsigned cr_refcnt;
+  struct cred *cr_next;
+} *creds;
+
+#define SPAWNBUCKETS	20	/* powers of two microseconds */
+#define LIFEBUCKETS	20	/* powers of two milliseconds */
+
+/* Counters of a service, reported on SIGUSR2.  */
+struct stats
+{
+  unsigned long st_accepted;	/* connections accepted */
+  unsigned long st_spawned;	/* servers started */
+  unsigned long st_rejected;	/* connections closed unserved */
+  unsigned long st_spawntime[SPAWNBUCKETS];	/* from request to exec */
+  unsigned long st_lifetime[LIFEBUCKETS];	/* of servers reaped */
+};
+
 struct servtab
 {
   const char *se_file;
@@ -255,12 +342,21 @@ struct servtab
   char *se_node;		/* node name */
   char *se_service;		/* name of service */
   int se_socktype;		/* type of socket to use */
+  int se_backlog;		/* of stream sockets, 0 for SOMAXCONN */
   char *se_proto;		/* protocol used */
   pid_t se_wait;		/* single threaded server */
   unsigned se_max;		/* Maximum number of instances per CNT_INTVL */
+  unsigned se_maxchild;		/* Maximum number of servers running */
+  unsigned se_maxsource;	/* Maximum number of them per client */
+  unsigned se_children;		/* servers running */
+  unsigned se_workers;		/* of the pool of a wait service */
+  bool se_full;			/* not watched while se_maxchild run */
+  bool se_paused;		/* not watched while out of descriptors */
+  struct source **se_sources;	/* clients with servers running */
   short se_checked;		/* looked at during merge */
   char *se_user;		/* user name to run as */
   char *se_group;		/* group name to run as */
+  struct cred *se_cred;		/* se_user and se_group, resolved */
   struct biltin *se_bi;		/* if built-in, description */
   char *se_server;		/* server program */
   char **se_argv;		/* program arguments */
@@ -274,9 +370,28 @@ struct servtab
   unsigned se_refcnt;
   unsigned se_count;		/* number started since se_time */
   struct timeval se_time;	/* start of se_count */
+  struct stats se_stats;
   struct servtab *se_next;
+  struct servtab *se_hnext;	/* in servhash */
+  struct servtab *se_mnext;	/* in muxhash, if a tcpmux service */
 } *servtab;
 
+/* The services by address, name and protocol, and the tcpmux services
+   by name, ignoring case.  */
+#define SERV_HASH	1024
+#define MUX_HASH	256
+struct servtab *servhash[SERV_HASH];
+struct servtab *muxhash[MUX_HASH];
+
+/* The servers a wait service keeps running, 0 to start one when
+   a client comes.  */
+#define POOL(sep)	((sep)->se_wait && !(sep)->se_bi ? (sep)->se_maxchild : 0)
+
+/* The servers, or connections served within inetd, SEP may run.  */
+#define MAXCHILD(sep)	((sep)->se_maxchild ? (sep)->se_maxchild	\
+			 : (sep)->se_bi && (sep)->se_bi->bi_conn	\
+			 ? CONNMAX : 0)
+
 #define NORM_TYPE	0
 #define MUX_TYPE	1
 #define MUXPLUS_TYPE	2
@@ -286,17 +401,19 @@ struct servtab
 
 
 /* Built-in services */
+struct conn;
 void chargen_dg (int, struct servtab *);
-void chargen_stream (int, struct servtab *);
+int chargen_stream (struct conn *);
 void daytime_dg (int, struct servtab *);
 void daytime_stream (int, struct servtab *);
 void discard_dg (int, struct servtab *);
-void discard_stream (int, struct servtab *);
+int discard_stream (struct conn *);
 void echo_dg (int, struct servtab *);
-void echo_stream (int, struct servtab *);
+int echo_stream (struct conn *);
 void machtime_dg (int, struct servtab *);
 void machtime_stream (int, struct servtab *);
 void tcpmux (int s, struct servtab *sep);
+void conns_forget (struct servtab *sep);
 
 struct biltin
 {
@@ -305,24 +422,25 @@ struct biltin
   short bi_fork;		/* 1 if should fork before call */
   short bi_wait;		/* 1 if should wait for child */
   void (*bi_fn) (int s, struct servtab *);	/*function which performs it */
+  int (*bi_conn) (struct conn *);	/* or serves it within inetd */
 } biltins[] = {
   /* Echo received data */
-  {"echo", SOCK_STREAM, 1, 0, echo_stream},
-  {"echo", SOCK_DGRAM, 0, 0, echo_dg},
+  {"echo", SOCK_STREAM, 0, 0, NULL, echo_stream},
+  {"echo", SOCK_DGRAM, 0, 0, echo_dg, NULL},
   /* Internet /dev/null */
-  {"discard", SOCK_STREAM, 1, 0, discard_stream},
-  {"discard", SOCK_DGRAM, 0, 0, discard_dg},
+  {"discard", SOCK_STREAM, 0, 0, NULL, discard_stream},
+  {"discard", SOCK_DGRAM, 0, 0, discard_dg, NULL},
   /* Return 32 bit time since 1900 */
-  {"time", SOCK_STREAM, 0, 0, machtime_stream},
-  {"time", SOCK_DGRAM, 0, 0, machtime_dg},
+  {"time", SOCK_STREAM, 0, 0, machtime_stream, NULL},
+  {"time", SOCK_DGRAM, 0, 0, machtime_dg, NULL},
   /* Return human-readable time */
-  {"daytime", SOCK_STREAM, 0, 0, daytime_stream},
-  {"daytime", SOCK_DGRAM, 0, 0, daytime_dg},
+  {"daytime", SOCK_STREAM, 0, 0, daytime_stream, NULL},
+  {"daytime", SOCK_DGRAM, 0, 0, daytime_dg, NULL},
   /* Familiar character generator */
-  {"chargen", SOCK_STREAM, 1, 0, chargen_stream},
-  {"chargen", SOCK_DGRAM, 0, 0, chargen_dg},
-  {"tcpmux", SOCK_STREAM, 1, 0, tcpmux},
-  {NULL, 0, 0, 0, NULL}
+  {"chargen", SOCK_STREAM, 0, 0, NULL, chargen_stream},
+  {"chargen", SOCK_DGRAM, 0, 0, chargen_dg, NULL},
+  {"tcpmux", SOCK_STREAM, 1, 0, tcpmux, NULL},
+  {NULL, 0, 0, 0, NULL, NULL}
 };
 
 #define NUMINT	(sizeof(intab) / sizeof(struct inent))
@@ -379,13 +497,17 @@ signal_set_handler (int signo, void (*handler) (int))
 void
 signal_block (SIGSTATUS *old_status)
 {
-#ifdef HAVE_SIGACTION
+#if defined USE_EPOLL
+  /* Blocked all along, see events_init.  */
+  (void) old_status;
+#elif defined HAVE_SIGACTION
   sigset_t sigs;
 
   sigemptyset (&sigs);
   sigaddset (&sigs, SIGCHLD);
   sigaddset (&sigs, SIGHUP);
   sigaddset (&sigs, SIGALRM);
+  sigaddset (&sigs, SIGUSR2);
   sigprocmask (SIG_BLOCK, &sigs, old_status);
 #else
   long omask = sigblock (SIGBLOCK);
@@ -397,7 +519,9 @@ signal_block (SIGSTATUS *old_status)
 void
 signal_unblock (SIGSTATUS *status)
 {
-#ifdef HAVE_SIGACTION
+#if defined USE_EPOLL
+  (void) status;
+#elif defined HAVE_SIGACTION
   if (status)
     sigprocmask (SIG_SETMASK, status, 0);
   else
@@ -411,80 +535,547 @@ signal_unblock (SIGSTATUS *status)
 #endif
 }
 
+#ifdef USE_EPOLL
+/* Create the epoll instance, and have SIGCHLD, SIGHUP, SIGALRM and
+   SIGUSR2 delivered through SIGFD instead of to their handlers.  */
 void
-run_service (int ctrl, struct servtab *sep)
+events_init (void)
+{
+  struct epoll_event ev;
+  sigset_t sigs;
+
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd < 0)
+    {
+      syslog (LOG_ERR, "epoll_create1: %m");
+      exit (EXIT_FAILURE);
+    }
+
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGCHLD);
+  sigaddset (&sigs, SIGHUP);
+  sigaddset (&sigs, SIGALRM);
+  sigaddset (&sigs, SIGUSR2);
+  sigprocmask (SIG_BLOCK, &sigs, NULL);
+  sigfd = signalfd (-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigfd < 0)
+    {
+      syslog (LOG_ERR, "signalfd: %m");
+      exit (EXIT_FAILURE);
+    }
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;		/* Tells SIGFD from the services.  */
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, sigfd, &ev) < 0)
+    {
+      syslog (LOG_ERR, "epoll_ctl: %m");
+      exit (EXIT_FAILURE);
+    }
+}
+
+/* Give a forked child the signal mask it would have had from
+   signal_unblock, and drop the descriptors of the event loop.  */
+void
+events_child (void)
+{
+  sigset_t empty;
+
+  sigemptyset (&empty);
+  sigprocmask (SIG_SETMASK, &empty, NULL);
+  close (epfd);
+  close (sigfd);
+}
+#endif
+
+/* Start watching the socket of SEP.  */
+void
+listen_add (struct servtab *sep)
+{
+#ifdef USE_EPOLL
+  struct epoll_event ev;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = sep;
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, sep->se_fd, &ev) < 0)
+    {
+      syslog (LOG_ERR, "%s/%s: epoll_ctl: %m",
+	      sep->se_service, sep->se_proto);
+      return;
+    }
+#else
+  FD_SET (sep->se_fd, &allsock);
+#endif
+  nsock++;
+  if (sep->se_fd > maxsock)
+    maxsock = sep->se_fd;
+}
+
+/* Stop watching the socket of SEP, which stays open.  Children of
+   wait services hold a copy of it, so with epoll it must be removed
+   explicitly rather than by closing it.  */
+void
+listen_remove (struct servtab *sep)
+{
+#ifdef USE_EPOLL
+  struct epoll_event ev;
+
+  epoll_ctl (epfd, EPOLL_CTL_DEL, sep->se_fd, &ev);
+#else
+  FD_CLR (sep->se_fd, &allsock);
+#endif
+  nsock--;
+}
+
+/* What exec_server failed to do, and why.  */
+const char *volatile spawn_failed;
+volatile int spawn_errno;
+
+/* The environment of the worker pool_spawn starts, and its
+   LISTEN_PID variable.  */
+char **pool_env;
+char pool_pid[32] = "LISTEN_PID=";
+
+/* Make CTRL the standard input, output and error, take the
+   credentials of SEP and execute its server.  Return only on failure.
+   This may run in a child started with vfork, which shares the memory
+   of inetd until it executes the server: only system calls are made,
+   and the failure is left in spawn_failed and spawn_errno.  */
+void
+exec_server (int ctrl, struct servtab *sep)
 {
-  struct passwd *pwd;
-  struct group *grp = NULL;
   char buf[50];
 
-  if (sep->se_bi)
+  signal_set_handler (SIGCHLD, SIG_DFL);
+  signal_set_handler (SIGHUP, SIG_DFL);
+  signal_set_handler (SIGALRM, SIG_DFL);
+  signal_set_handler (SIGUSR2, SIG_DFL);
+#ifdef USE_EPOLL
+  events_child ();
+#else
+  signal_unblock (NULL);
+#endif
+
+  dup2 (ctrl, 0);
+  dup2 (ctrl, 1);
+  dup2 (ctrl, 2);
+  if (pool_env)
     {
-      (*sep->se_bi->bi_fn) (ctrl, sep);
+      /* A worker gets the socket as descriptor 3 as well, and its pid
+         in LISTEN_PID, written out without library calls.  */
+      char digits[16], *p = pool_pid + sizeof "LISTEN_PID=" - 1;
+      pid_t pid = getpid ();
+      int n = 0;
+
+      do
+	digits[n++] = '0' + pid % 10;
+      while ((pid /= 10) > 0);
+      while (n > 0)
+	*p++ = digits[--n];
+      *p = '\0';
+      dup2 (ctrl, 3);
+      fcntl (3, F_SETFD, 0);
     }
-  else
+#ifdef HAVE_CLOSE_RANGE
+  if (close_range (pool_env ? 4 : 3, ~0U, 0) < 0)
+#endif
     {
-      if (debug)
-	fprintf (stderr, "%d execl %s\n", (int) getpid (), sep->se_server);
-      dup2 (ctrl, 0);
-      close (ctrl);
-      dup2 (0, 1);
-      dup2 (0, 2);
-      pwd = getpwnam (sep->se_user);
-      if (pwd == NULL)
+      int sock;
+
+      for (sock = maxsock; sock > (pool_env ? 3 : 2); sock--)
+	close (sock);
+    }
+
+  if (sep->se_cred && sep->se_cred->cr_uid)
+    {
+      struct cred *cr = sep->se_cred;
+
+      if (setgid (cr->cr_gid) < 0)
 	{
-	  syslog (LOG_ERR, "%s/%s: %s: No such user",
-		  sep->se_service, sep->se_proto, sep->se_user);
-	  if (sep->se_socktype != SOCK_STREAM)
-	    recv (0, buf, sizeof buf, 0);
-	  _exit (EXIT_FAILURE);
+	  spawn_failed = "set gid";
+	  goto fail;
 	}
-      if (sep->se_group && *sep->se_group)
+#ifdef HAVE_GETGROUPLIST
+      if (setgroups (cr->cr_ngroups, cr->cr_groups) < 0)
 	{
-	  grp = getgrnam (sep->se_group);
-	  if (grp == NULL)
-	    {
-	      syslog (LOG_ERR, "%s/%s: %s: No such group",
-		      sep->se_service, sep->se_proto, sep->se_group);
-	      if (sep->se_socktype != SOCK_STREAM)
-		recv (0, buf, sizeof buf, 0);
-	      _exit (EXIT_FAILURE);
-	    }
+	  spawn_failed = "set groups";
+	  goto fail;
 	}
-      if (pwd->pw_uid)
-	{
-	  if (grp && grp->gr_gid)
-	    {
-	      if (setgid (grp->gr_gid) < 0)
-		{
-		  syslog (LOG_ERR, "%s: can't set gid %d: %m",
-			  sep->se_service, grp->gr_gid);
-		  _exit (EXIT_FAILURE);
-		}
-	    }
-	  else if (setgid (pwd->pw_gid) < 0)
-	    {
-	      syslog (LOG_ERR, "%s: can't set gid %d: %m",
-		      sep->se_service, pwd->pw_gid);
-	      _exit (EXIT_FAILURE);
-	    }
-#ifdef HAVE_INITGROUPS
-	  initgroups (pwd->pw_name,
-		      (grp && grp->gr_gid) ? grp->gr_gid : pwd->pw_gid);
+#elif defined HAVE_INITGROUPS
+      initgroups (cr->cr_user, cr->cr_gid);
 #endif
-	  if (setuid (pwd->pw_uid) < 0)
-	    {
-	      syslog (LOG_ERR, "%s: can't set uid %d: %m",
-		      sep->se_service, pwd->pw_uid);
-	      _exit (EXIT_FAILURE);
-	    }
+      if (setuid (cr->cr_uid) < 0)
+	{
+	  spawn_failed = "set uid";
+	  goto fail;
 	}
-      execv (sep->se_server, sep->se_argv);
-      if (sep->se_socktype != SOCK_STREAM)
-	recv (0, buf, sizeof buf, 0);
-      syslog (LOG_ERR, "cannot execute %s: %m", sep->se_server);
+    }
+  execve (sep->se_server, sep->se_argv, pool_env ? pool_env : environ);
+  spawn_failed = "execute";
+
+fail:
+  spawn_errno = errno;
+  if (sep->se_socktype != SOCK_STREAM)
+    recv (0, buf, sizeof buf, 0);
+}
+
+/* Log the failure of exec_server for SEP.  */
+void
+spawn_report (struct servtab *sep)
+{
+  errno = spawn_errno;
+  if (strcmp (spawn_failed, "execute") == 0)
+    syslog (LOG_ERR, "cannot execute %s: %m", sep->se_server);
+  else
+    syslog (LOG_ERR, "%s: can't %s: %m", sep->se_service, spawn_failed);
+  spawn_failed = NULL;
+}
+
+/* Start the server of SEP on CTRL, and return its pid as fork does,
+   without returning in the child.  */
+pid_t
+spawn_server (int ctrl, struct servtab *sep)
+{
+  pid_t pid;
+
+  if (debug)
+    fprintf (stderr, "execl %s\n", sep->se_server);
+  spawn_failed = NULL;
+#ifdef SPAWN_VFORK
+  pid = vfork ();
+#else
+  pid = fork ();
+#endif
+  if (pid == 0)
+    {
+      if (debug)
+	setsid ();
+      exec_server (ctrl, sep);
+#ifndef SPAWN_VFORK
+      spawn_report (sep);
+#endif
       _exit (EXIT_FAILURE);
     }
+  if (pid > 0 && spawn_failed)
+    spawn_report (sep);
+  return pid;
+}
+
+/* Run SEP on CTRL in the current process, a child for all but
+   built-in services.  */
+void
+run_service (int ctrl, struct servtab *sep)
+{
+  if (sep->se_bi)
+    {
+      (*sep->se_bi->bi_fn) (ctrl, sep);
+    }
+  else
+    {
+      if (debug)
+	fprintf (stderr, "%d execl %s\n", (int) getpid (), sep->se_server);
+      exec_server (ctrl, sep);
+      spawn_report (sep);
+      _exit (EXIT_FAILURE);
+    }
+}
+
+/* Hash the LEN bytes at P into H, as FNV-1a does.  */
+unsigned
+hash_bytes (unsigned h, const void *p, size_t len)
+{
+  const unsigned char *c = p;
+
+  while (len--)
+    h = (h ^ *c++) * 16777619U;
+  return h;
+}
+
+#define HASH_INIT	2166136261U
+
+/* Microseconds on a clock that does not jump.  */
+unsigned long long
+stats_clock (void)
+{
+#if defined CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+  return time (NULL) * 1000000ULL;
+}
+
+/* Count VALUE in the histogram HIST of N power of two buckets.  */
+void
+stats_hist (unsigned long *hist, int n, unsigned long long value)
+{
+  int i;
+
+  for (i = 0; i < n - 1 && value >= (1ULL << i); i++)
+    ;
+  hist[i]++;
+}
+
+/*
+ * Limits of running servers.  The servers started for nowait services
+ * with a limit are remembered by pid until reaped, together with the
+ * client they serve.  A service running as many servers as it may is
+ * no longer watched, so that new connections wait in its listen queue.
+ * A client running as many as it may has further connections closed.
+ *
+ * The workers of wait services with a pool are remembered the same
+ * way.  They share the socket of the service, which inetd does not
+ * watch, and are replaced as they exit.
+ */
+#define CHILD_HASH	256
+#define SOURCE_HASH	256
+
+/* A client address, with the servers running for it.  */
+struct source
+{
+  unsigned char so_addr[16];	/* IPv6, or IPv4 mapped to it */
+  unsigned so_count;
+  bool so_logged;		/* refusal reported */
+  struct source *so_next;
+};
+
+struct child
+{
+  pid_t ch_pid;
+  struct servtab *ch_sep;	/* NULL once the service is removed */
+  struct source *ch_source;	/* or NULL */
+  bool ch_worker;		/* of the pool of ch_sep */
+  unsigned long long ch_start;	/* stats_clock when started */
+  struct child *ch_next;
+};
+
+struct child *children[CHILD_HASH];
+
+/* Store in ADDR the address of client SA.  */
+void
+source_addr (struct sockaddr *sa, unsigned char *addr)
+{
+  memset (addr, 0, 16);
+#ifdef IPV6
+  if (sa->sa_family == AF_INET6)
+    memcpy (addr, &((struct sockaddr_in6 *) sa)->sin6_addr, 16);
+  else
+#endif
+    {
+      addr[10] = addr[11] = 0xff;
+      memcpy (addr + 12, &((struct sockaddr_in *) sa)->sin_addr, 4);
+    }
+}
+
+unsigned
+source_hash (const unsigned char *addr)
+{
+  return hash_bytes (HASH_INIT, addr, 16) % SOURCE_HASH;
+}
+
+/* Return the entry of client SA in the table of SEP, creating it if
+   CREATE.  */
+struct source *
+source_get (struct servtab *sep, struct sockaddr *sa, bool create)
+{
+  unsigned char addr[16];
+  unsigned h;
+  struct source *so;
+
+  source_addr (sa, addr);
+  h = source_hash (addr);
+  if (sep->se_sources)
+    for (so = sep->se_sources[h]; so; so = so->so_next)
+      if (memcmp (so->so_addr, addr, 16) == 0)
+	return so;
+  if (!create)
+    return NULL;
+
+  if (sep->se_sources == NULL)
+    sep->se_sources = calloc (SOURCE_HASH, sizeof (*sep->se_sources));
+  so = calloc (1, sizeof (*so));
+  if (sep->se_sources == NULL || so == NULL)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      exit (-1);
+    }
+  memcpy (so->so_addr, addr, 16);
+  so->so_next = sep->se_sources[h];
+  sep->se_sources[h] = so;
+  return so;
+}
+
+void
+source_put (struct servtab *sep, struct source *so)
+{
+  struct source **sop;
+
+  if (--so->so_count > 0)
+    return;
+  for (sop = &sep->se_sources[source_hash (so->so_addr)]; *sop != so;
+       sop = &(*sop)->so_next)
+    ;
+  *sop = so->so_next;
+  free (so);
+}
+
+/* Return true if CLIENT has as many servers of SEP running as it may,
+   which is logged once.  */
+bool
+source_full (struct servtab *sep, struct sockaddr *client)
+{
+  struct source *so = source_get (sep, client, false);
+  char buf[INET6_ADDRSTRLEN];
+
+  if (so == NULL || so->so_count < sep->se_maxsource)
+    return false;
+  if (!so->so_logged)
+    {
+      inet_ntop (AF_INET6, so->so_addr, buf, sizeof (buf));
+      syslog (LOG_WARNING,
+	      "%s/%s: %s has %u servers running, "
+	      "further connections refused",
+	      sep->se_service, sep->se_proto, buf, so->so_count);
+      so->so_logged = true;
+    }
+  return true;
+}
+
+/* Watch SEP again if it runs fewer servers than it may, and stop
+   watching it otherwise.  */
+void
+service_throttle (struct servtab *sep)
+{
+  unsigned max = MAXCHILD (sep);
+  bool full = max && sep->se_children >= max;
+
+  if (full == sep->se_full || sep->se_wait || sep->se_fd < 0)
+    return;
+  if (debug)
+    fprintf (stderr, "%s %s, %u servers running\n",
+	     full ? "suspended" : "resumed", sep->se_service,
+	     sep->se_children);
+  /* A paused service is watched again by listen_resume.  */
+  if (sep->se_paused)
+    ;
+  else if (full)
+    listen_remove (sep);
+  else
+    listen_add (sep);
+  sep->se_full = full;
+}
+
+/* Record that PID serves client SA of SEP, or is one of its WORKERs.  */
+void
+child_add (struct servtab *sep, pid_t pid, struct sockaddr *sa, bool worker)
+{
+  struct child *ch = malloc (sizeof (*ch));
+
+  if (ch == NULL)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      exit (-1);
+    }
+  ch->ch_pid = pid;
+  ch->ch_sep = sep;
+  ch->ch_source = NULL;
+  ch->ch_worker = worker;
+  ch->ch_start = stats_clock ();
+  if (sep->se_maxsource && sa)
+    {
+      ch->ch_source = source_get (sep, sa, true);
+      ch->ch_source->so_count++;
+    }
+  ch->ch_next = children[pid % CHILD_HASH];
+  children[pid % CHILD_HASH] = ch;
+  if (worker)
+    sep->se_workers++;
+  else
+    {
+      sep->se_children++;
+      service_throttle (sep);
+    }
+}
+
+/* Forget PID, which has exited with STATUS.  */
+void
+child_exit (pid_t pid, int status)
+{
+  struct child **chp, *ch;
+
+  for (chp = &children[pid % CHILD_HASH]; (ch = *chp); chp = &ch->ch_next)
+    if (ch->ch_pid == pid)
+      break;
+  if (ch == NULL)
+    return;
+  *chp = ch->ch_next;
+  if (ch->ch_sep)
+    stats_hist (ch->ch_sep->se_stats.st_lifetime, LIFEBUCKETS,
+		(stats_clock () - ch->ch_start) / 1000);
+  if (ch->ch_sep && ch->ch_worker)
+    {
+      if (status)
+	syslog (LOG_WARNING, "%s: exit status 0x%x",
+		ch->ch_sep->se_server, status);
+      ch->ch_sep->se_workers--;
+      pool_short = 1;
+    }
+  else if (ch->ch_sep)
+    {
+      if (ch->ch_source)
+	source_put (ch->ch_sep, ch->ch_source);
+      ch->ch_sep->se_children--;
+      service_throttle (ch->ch_sep);
+    }
+  free (ch);
+}
+
+/* Have SEP keep no more than KEEP workers, and tell the others to
+   terminate.  */
+void
+workers_stop (struct servtab *sep, unsigned keep)
+{
+  struct child *ch;
+  int i;
+
+  for (i = 0; i < CHILD_HASH && sep->se_workers > keep; i++)
+    for (ch = children[i]; ch && sep->se_workers > keep; ch = ch->ch_next)
+      if (ch->ch_sep == sep && ch->ch_worker)
+	{
+	  if (debug)
+	    fprintf (stderr, "stopping %d of %s\n", (int) ch->ch_pid,
+		     sep->se_service);
+	  kill (ch->ch_pid, SIGTERM);
+	  ch->ch_sep = NULL;
+	  sep->se_workers--;
+	}
+}
+
+/* Detach the servers of SEP, which is being removed.  */
+void
+children_forget (struct servtab *sep)
+{
+  struct child *ch;
+  struct source *so;
+  int i;
+
+  for (i = 0; i < CHILD_HASH; i++)
+    for (ch = children[i]; ch; ch = ch->ch_next)
+      if (ch->ch_sep == sep)
+	ch->ch_sep = NULL;
+  if (sep->se_sources)
+    {
+      for (i = 0; i < SOURCE_HASH; i++)
+	while ((so = sep->se_sources[i]))
+	  {
+	    sep->se_sources[i] = so->so_next;
+	    free (so);
+	  }
+      free (sep->se_sources);
+      sep->se_sources = NULL;
+    }
 }
 
 void
@@ -514,10 +1105,11 @@ reapchild (int signo MAYBE_UNUSED)
 	    if (debug)
 	      fprintf (stderr, "restored %s, fd %d\n",
 		       sep->se_service, sep->se_fd);
-	    FD_SET (sep->se_fd, &allsock);
-	    nsock++;
+	    if (sep->se_fd >= 0)
+	      listen_add (sep);
 	    sep->se_wait = 1;
 	  }
+      child_exit (pid, status);
     }
 }
 
@@ -563,14 +1155,15 @@ void
 print_service (const char *action, struct servtab *sep)
 {
   fprintf (stderr,
-	   "%s:%d: %s: %s:%s proto=%s, wait=%d, max=%u, "
+	   "%s:%d: %s: %s:%s proto=%s, wait=%d, max=%u.%u.%u, "
 	   "user=%s group=%s builtin=%s server=%s\n",
 	   sep->se_file, sep->se_line,
 	   action,
 	   ISMUX (sep) ? (ISMUXPLUS (sep) ? "tcpmuxplus" : "tcpmux")
 	   : (sep->se_node ? sep->se_node : "*"),
 	   sep->se_service, sep->se_proto,
-	   (int) sep->se_wait, sep->se_max,
+	   (int) sep->se_wait, sep->se_max, sep->se_maxchild,
+	   sep->se_maxsource,
 	   sep->se_user, sep->se_group,
 	   sep->se_bi ? sep->se_bi->bi_service : "no", sep->se_server);
 }
@@ -668,6 +1261,180 @@ tryagain:
   return 0;
 }
 
+/* Look up the credentials of CR.  Return NULL on success, else
+   "user" or "group", whichever is unknown.  */
+const char *
+cred_lookup (struct cred *cr)
+{
+  struct passwd *pwd;
+  struct group *grp = NULL;
+
+  pwd = getpwnam (cr->cr_user);
+  if (pwd == NULL)
+    return "user";
+  if (cr->cr_group)
+    {
+      grp = getgrnam (cr->cr_group);
+      if (grp == NULL)
+	return "group";
+    }
+
+  cr->cr_uid = pwd->pw_uid;
+  cr->cr_gid = (grp && grp->gr_gid) ? grp->gr_gid : pwd->pw_gid;
+  cr->cr_ngroups = 0;
+#ifdef HAVE_GETGROUPLIST
+  if (cr->cr_uid)
+    {
+      int n = 16;
+
+      for (;;)
+	{
+	  cr->cr_groups = realloc (cr->cr_groups, n * sizeof (gid_t));
+	  if (cr->cr_groups == NULL)
+	    {
+	      syslog (LOG_ERR, "Out of memory.");
+	      exit (-1);
+	    }
+	  cr->cr_ngroups = n;
+	  if (getgrouplist (cr->cr_user, cr->cr_gid, cr->cr_groups,
+			    &cr->cr_ngroups) >= 0)
+	    break;
+	  n = cr->cr_ngroups > n ? cr->cr_ngroups : 2 * n;
+	}
+    }
+#endif
+  cr->cr_time = time (NULL);
+  if (debug)
+    fprintf (stderr, "credentials of %s%s%s: uid %d, gid %d, %d groups\n",
+	     cr->cr_user, cr->cr_group ? ":" : "",
+	     cr->cr_group ? cr->cr_group : "", (int) cr->cr_uid,
+	     (int) cr->cr_gid, cr->cr_ngroups);
+  return NULL;
+}
+
+void
+cred_put (struct cred *cr)
+{
+  struct cred **crp;
+
+  if (cr == NULL || --cr->cr_refcnt > 0)
+    return;
+  for (crp = &creds; *crp != cr; crp = &(*crp)->cr_next)
+    ;
+  *crp = cr->cr_next;
+  free (cr->cr_user);
+  free (cr->cr_group);
+  free (cr->cr_groups);
+  free (cr);
+}
+
+/* Return a reference to the credentials of USER and GROUP, looking
+   them up unless done since the last reload.  Return NULL if one of
+   them is unknown, with *WHAT set to "user" or "group".  */
+struct cred *
+cred_get (const char *user, const char *group, const char **what)
+{
+  struct cred *cr;
+
+  if (group && *group == '\0')
+    group = NULL;
+  for (cr = creds; cr; cr = cr->cr_next)
+    if (strcmp (cr->cr_user, user) == 0
+	&& (group ? cr->cr_group && strcmp (cr->cr_group, group) == 0
+	    : cr->cr_group == NULL))
+      break;
+
+  if (cr == NULL)
+    {
+      cr = calloc (1, sizeof (*cr));
+      if (cr == NULL)
+	{
+	  syslog (LOG_ERR, "Out of memory.");
+	  exit (-1);
+	}
+      cr->cr_user = newstr (user);
+      cr->cr_group = group ? newstr (group) : NULL;
+      cr->cr_next = creds;
+      creds = cr;
+    }
+
+  if (cr->cr_time == 0)
+    {
+      *what = cred_lookup (cr);
+      if (*what)
+	{
+	  /* Drop it if nothing uses it.  */
+	  cr->cr_refcnt++;
+	  cred_put (cr);
+	  return NULL;
+	}
+    }
+  cr->cr_refcnt++;
+  return cr;
+}
+
+/* Have all credentials looked up again, on reload.  */
+void
+cred_expire (void)
+{
+  struct cred *cr;
+
+  for (cr = creds; cr; cr = cr->cr_next)
+    cr->cr_time = 0;
+}
+
+/* Look up again the credentials older than cred_ttl at NOW, and
+   return when the next ones are due, or 0 if none are.  This is done
+   from the event loop, so that starting a server never waits for
+   the lookups.  If one fails, say because the directory server is
+   unreachable, the old credentials are kept until the next try.  */
+time_t
+creds_refresh (time_t now)
+{
+  struct cred *cr;
+  const char *what;
+  time_t due = 0;
+
+  signal_block (NULL);
+  for (cr = creds; cr; cr = cr->cr_next)
+    {
+      if (now - cr->cr_time >= cred_ttl)
+	{
+	  what = cred_lookup (cr);
+	  if (what)
+	    {
+	      syslog (LOG_ERR,
+		      "%s: cannot look up %s %s, keeping its credentials",
+		      cr->cr_user, what,
+		      strcmp (what, "user") == 0 ? cr->cr_user
+		      : cr->cr_group);
+	      cr->cr_time = now;
+	    }
+	}
+      if (due == 0 || cr->cr_time + cred_ttl < due)
+	due = cr->cr_time + cred_ttl;
+    }
+  signal_unblock (NULL);
+  return due;
+}
+
+/* Make the socket of SEP non-blocking if inetd accepts connections
+   on it, so that it can take all those pending.  Servers which accept
+   them themselves get it blocking.  */
+void
+socket_nonblock (struct servtab *sep)
+{
+  int flags = fcntl (sep->se_fd, F_GETFL);
+
+  if (flags < 0 || sep->se_socktype != SOCK_STREAM)
+    return;
+  if (sep->se_wait)
+    flags &= ~O_NONBLOCK;
+  else
+    flags |= O_NONBLOCK;
+  fcntl (sep->se_fd, F_SETFL, flags);
+}
+
 void
 servent_setup (struct servtab *sep)
 {
@@ -675,11 +1442,19 @@ servent_setup (struct servtab *sep)
   if (sep->se_fd == -1 && setup (sep) == 0)
     {
       if (sep->se_socktype == SOCK_STREAM)
-	listen (sep->se_fd, 10);
-      FD_SET (sep->se_fd, &allsock);
-      nsock++;
-      if (sep->se_fd > maxsock)
-	maxsock = sep->se_fd;
+	{
+	  listen (sep->se_fd, sep->se_backlog ? sep->se_backlog : SOMAXCONN);
+	  socket_nonblock (sep);
+	}
+      if (POOL (sep))
+	{
+	  /* Not watched, but closed in servers all the same.  */
+	  if (sep->se_fd > maxsock)
+	    maxsock = sep->se_fd;
+	  pool_short = 1;
+	}
+      else
+	listen_add (sep);
       if (debug)
 	fprintf (stderr, "registered %s on %d\n", sep->se_server, sep->se_fd);
     }
@@ -693,7 +1468,7 @@ retry (int signo MAYBE_UNUSED)
   timingout = 0;
   for (sep = servtab; sep; sep = sep->se_next)
     if (sep->se_fd == -1 && !ISMUX (sep))
-      setup (sep);
+      servent_setup (sep);
 }
 
 /*
@@ -704,11 +1479,17 @@ close_sep (struct servtab *sep)
 {
   if (sep->se_fd >= 0)
     {
-      nsock--;
-      FD_CLR (sep->se_fd, &allsock);
+      /* Nor is a wait service with a running server or a pool, or a
+         service with all the servers it may have.  */
+      if (sep->se_wait <= 1 && !sep->se_full && !sep->se_paused
+	  && !POOL (sep))
+	listen_remove (sep);
       close (sep->se_fd);
       sep->se_fd = -1;
     }
+  workers_stop (sep, 0);
+  sep->se_full = false;
+  sep->se_paused = false;
   sep->se_count = 0;
   /*
    * Don't keep the pid of this running deamon: when reapchild()
@@ -718,32 +1499,175 @@ close_sep (struct servtab *sep)
     sep->se_wait = 1;
 }
 
+/* Count a server started for SEP.  If it started too many of them
+   lately, which means they fail, close the service until the next
+   retry and return true.  */
+bool
+service_looping (struct servtab *sep)
+{
+  struct timeval now;
+
+  if (sep->se_count++ == 0)
+    {
+      gettimeofday (&sep->se_time, NULL);
+      return false;
+    }
+  if (!((sep->se_max && sep->se_count > sep->se_max)
+	|| sep->se_count >= toomany))
+    return false;
+
+  gettimeofday (&now, NULL);
+  if (now.tv_sec - sep->se_time.tv_sec > CNT_INTVL)
+    {
+      sep->se_time = now;
+      sep->se_count = 1;
+      return false;
+    }
+  syslog (LOG_ERR, "%s/%s server failing (looping), service terminated",
+	  sep->se_service, sep->se_proto);
+  close_sep (sep);
+  if (!timingout)
+    {
+      timingout = 1;
+      alarm (RETRYTIME);
+    }
+  return true;
+}
+
+/* The bucket of SEP in servhash.  */
+unsigned
+serv_hash (struct servtab *sep)
+{
+  unsigned h = HASH_INIT;
+
+  h = hash_bytes (h, &sep->se_ctrladdr, sizeof (sep->se_ctrladdr));
+  h = hash_bytes (h, sep->se_service, strlen (sep->se_service));
+  h = hash_bytes (h, sep->se_proto, strlen (sep->se_proto));
+  return (h + ISMUX (sep)) % SERV_HASH;
+}
+
+/* The bucket of tcpmux service NAME in muxhash.  */
+unsigned
+mux_hash (const char *name)
+{
+  unsigned h = HASH_INIT;
+
+  for (; *name; name++)
+    {
+      unsigned char c = tolower ((unsigned char) *name);
+
+      h = hash_bytes (h, &c, 1);
+    }
+  return h % MUX_HASH;
+}
+
+/* Remove SEP from the hash tables.  */
+void
+serv_unhash (struct servtab *sep)
+{
+  struct servtab **sepp;
+
+  for (sepp = &servhash[serv_hash (sep)]; *sepp != sep;
+       sepp = &(*sepp)->se_hnext)
+    ;
+  *sepp = sep->se_hnext;
+  if (ISMUX (sep))
+    {
+      for (sepp = &muxhash[mux_hash (sep->se_service)]; *sepp != sep;
+	   sepp = &(*sepp)->se_mnext)
+	;
+      *sepp = sep->se_mnext;
+    }
+}
+
+bool
+str_same (const char *a, const char *b)
+{
+  return a == b || (a && b && strcmp (a, b) == 0);
+}
+
+/* Return true if CP, as read from the configuration, describes SEP as
+   it is, so that a reload can leave SEP alone.  */
+bool
+service_same (struct servtab *sep, struct servtab *cp)
+{
+  size_t i;
+
+  if (!sep->se_wait != !cp->se_wait
+      || sep->se_max != cp->se_max
+      || sep->se_maxchild != cp->se_maxchild
+      || sep->se_maxsource != cp->se_maxsource
+      || sep->se_backlog != cp->se_backlog
+      || sep->se_bi != cp->se_bi || sep->se_cred != cp->se_cred
+      || !str_same (sep->se_user, cp->se_user)
+      || !str_same (sep->se_group, cp->se_group)
+      || !str_same (sep->se_server, cp->se_server)
+      || sep->se_argc != cp->se_argc)
+    return false;
+  for (i = 0; i < sep->se_argc; i++)
+    if (!str_same (sep->se_argv[i], cp->se_argv[i]))
+      return false;
+  return true;
+}
+
 struct servtab *
 enter (struct servtab *cp)
 {
   struct servtab *sep;
   SIGSTATUS sigstatus;
   size_t i;
+  unsigned h = serv_hash (cp);
 
   /* Checking/Removing duplicates */
-  for (sep = servtab; sep; sep = sep->se_next)
+  for (sep = servhash[h]; sep; sep = sep->se_hnext)
     if (memcmp (&sep->se_ctrladdr, &cp->se_ctrladdr,
 		sizeof (sep->se_ctrladdr)) == 0
 	&& strcmp (sep->se_service, cp->se_service) == 0
 	&& strcmp (sep->se_proto, cp->se_proto) == 0
 	&& ISMUX (sep) == ISMUX (cp))
       break;
+  if (sep != 0 && service_same (sep, cp))
+    {
+      sep->se_checked = 1;
+      return sep;
+    }
   if (sep != 0)
     {
       signal_block (&sigstatus);
+      /* Switching to or from a pool takes a new socket, watched or
+         not.  */
+      if (!POOL (sep) != !POOL (cp) && sep->se_fd >= 0)
+	close_sep (sep);
+      /* A nowait service with all the servers it may have is not
+         watched, but as a wait service it must be, which
+         service_throttle no longer sees to.  */
+      if (sep->se_full && cp->se_wait && cp->se_bi == 0)
+	{
+	  if (!sep->se_paused)
+	    listen_add (sep);
+	  sep->se_full = false;
+	}
       /*
        * sep->se_wait may be holding the pid of a daemon
        * that we're waiting for.  If so, don't overwrite
        * it unless the config file explicitly says don't
        * wait.
        */
-      if (cp->se_bi == 0 && (sep->se_wait == 1 || cp->se_wait == 0))
+      if (cp->se_bi == 0 && (sep->se_wait <= 1 || cp->se_wait == 0))
 	sep->se_wait = cp->se_wait;
+      sep->se_max = cp->se_max;
+      sep->se_maxchild = cp->se_maxchild;
+      sep->se_maxsource = cp->se_maxsource;
+      if (sep->se_fd >= 0 && sep->se_socktype == SOCK_STREAM)
+	{
+	  if (sep->se_backlog != cp->se_backlog)
+	    listen (sep->se_fd, cp->se_backlog ? cp->se_backlog : SOMAXCONN);
+	  socket_nonblock (sep);
+	}
+      sep->se_backlog = cp->se_backlog;
+      service_throttle (sep);
+      workers_stop (sep, POOL (sep));
+      pool_short = 1;
 #define SWAP(a, b) { char *c = a; a = b; b = c; }
       if (cp->se_user)
 	SWAP (sep->se_user, cp->se_user);
@@ -756,6 +1680,10 @@ enter (struct servtab *cp)
       sep->se_argv = cp->se_argv;
       cp->se_argc = 0;
       cp->se_argv = NULL;
+      if (cp->se_cred)
+	cp->se_cred->cr_refcnt++;
+      cred_put (sep->se_cred);
+      sep->se_cred = cp->se_cred;
       sep->se_checked = 1;
       signal_unblock (&sigstatus);
       if (debug)
@@ -782,11 +1710,21 @@ enter (struct servtab *cp)
   dupmem ((void **) &sep->se_argv, sep->se_argc * sizeof (sep->se_argv[0]));
   for (i = 0; i < sep->se_argc; i++)
     dupstr (&sep->se_argv[i]);
+  if (sep->se_cred)
+    sep->se_cred->cr_refcnt++;
 
   sep->se_fd = -1;
   signal_block (&sigstatus);
   sep->se_next = servtab;
   servtab = sep;
+  sep->se_hnext = servhash[h];
+  servhash[h] = sep;
+  if (ISMUX (sep))
+    {
+      h = mux_hash (sep->se_service);
+      sep->se_mnext = muxhash[h];
+      muxhash[h] = sep;
+    }
   signal_unblock (&sigstatus);
   return sep;
 }
@@ -941,6 +1879,7 @@ freeconfig (struct servtab *cp)
   free (cp->se_group);
   free (cp->se_server);
   argcv_free (cp->se_argc, cp->se_argv);
+  cred_put (cp->se_cred);
 }
 
 #define INETD_SERVICE      0	/* service name */
@@ -1082,7 +2021,20 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
 	  sep->se_type = NORM_TYPE;
 	}
 
-      if (strcmp (argv[INETD_SOCKET], "stream") == 0)
+      if (strncmp (argv[INETD_SOCKET], "stream.", 7) == 0)
+	{
+	  char *q;
+
+	  sep->se_socktype = SOCK_STREAM;
+	  sep->se_backlog = strtoul (argv[INETD_SOCKET] + 7, &q, 10);
+	  if (*q || sep->se_backlog < 0)
+	    {
+	      syslog (LOG_WARNING, "%s:%lu: invalid backlog (%s)",
+		      file, (unsigned long) *line, argv[INETD_SOCKET] + 7);
+	      sep->se_backlog = 0;
+	    }
+	}
+      else if (strcmp (argv[INETD_SOCKET], "stream") == 0)
 	sep->se_socktype = SOCK_STREAM;
       else if (strcmp (argv[INETD_SOCKET], "dgram") == 0)
 	sep->se_socktype = SOCK_DGRAM;
@@ -1151,6 +2103,10 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
 	if (p)
 	  {
 	    sep->se_max = strtoul (p, &q, 10);
+	    if (*q == '.')
+	      sep->se_maxchild = strtoul (q + 1, &q, 10);
+	    if (*q == '.')
+	      sep->se_maxsource = strtoul (q + 1, &q, 10);
 	    if (*q)
 	      syslog (LOG_WARNING, "%s:%lu: invalid number (%s)",
 		      file, (unsigned long) *line, p);
@@ -1255,11 +2211,9 @@ nextconfig (const char *file)
 #ifndef IPV6
   struct servent *sp;
 #endif
-  struct servtab *sep, **sepp;
-  struct passwd *pwd;
-  struct group *grp;
+  struct servtab *sep;
+  const char *what;
   FILE *fconfig;
-  SIGSTATUS sigstatus;
 
   size_t line = 0;
 
@@ -1271,23 +2225,15 @@ nextconfig (const char *file)
     }
   while ((sep = getconfigent (fconfig, file, &line)))
     {
-      pwd = getpwnam (sep->se_user);
-      if (pwd == NULL)
+      cred_put (sep->se_cred);
+      sep->se_cred = cred_get (sep->se_user, sep->se_group, &what);
+      if (sep->se_cred == NULL)
 	{
-	  syslog (LOG_ERR, "%s/%s: No such user '%s', service ignored",
-		  sep->se_service, sep->se_proto, sep->se_user);
+	  syslog (LOG_ERR, "%s/%s: No such %s '%s', service ignored",
+		  sep->se_service, sep->se_proto, what,
+		  strcmp (what, "user") == 0 ? sep->se_user : sep->se_group);
 	  continue;
 	}
-      if (sep->se_group && *sep->se_group)
-	{
-	  grp = getgrnam (sep->se_group);
-	  if (grp == NULL)
-	    {
-	      syslog (LOG_ERR, "%s/%s: No such group '%s', service ignored",
-		      sep->se_service, sep->se_proto, sep->se_group);
-	      continue;
-	    }
-	}
       if (ISMUX (sep))
 	{
 	  sep->se_fd = -1;
@@ -1303,9 +2249,17 @@ nextconfig (const char *file)
 	freeconfig (sep);
     }
   endconfig (fconfig);
-  /*
-   * Purge anything not looked at above.
-   */
+}
+
+/*
+ * Purge anything not looked at while reading the configuration.
+ */
+void
+purgeconfig (void)
+{
+  struct servtab *sep, **sepp;
+  SIGSTATUS sigstatus;
+
   signal_block (&sigstatus);
   sepp = &servtab;
   while ((sep = *sepp))
@@ -1316,8 +2270,11 @@ nextconfig (const char *file)
 	  continue;
 	}
       *sepp = sep->se_next;
+      serv_unhash (sep);
       if (sep->se_fd >= 0)
 	close_sep (sep);
+      children_forget (sep);
+      conns_forget (sep);
       if (debug)
 	print_service ("FREE", sep);
       freeconfig (sep);
@@ -1401,6 +2358,7 @@ config (int signo)
 
   for (sep = servtab; sep; sep = sep->se_next)
     sep->se_checked = 0;
+  cred_expire ();
 
   for (i = 0; config_files[i]; i++)
     {
@@ -1450,70 +2408,318 @@ config (int signo)
 	}
     }
 
-  free (linebuf);
-  linebuf = NULL;
-  linebufsize = 0;
-
-  fix_tcpmux ();
+  free (linebuf);
+  linebuf = NULL;
+  linebufsize = 0;
+
+  fix_tcpmux ();
+  purgeconfig ();
+}
+
+/* Write the counters of all services to stats_file, replacing it at
+   once.  */
+void
+stats_dump (int signo MAYBE_UNUSED)
+{
+  struct servtab *sep;
+  char *tmp;
+  FILE *fp;
+  int i;
+
+  tmp = malloc (strlen (stats_file) + sizeof (".tmp"));
+  if (tmp == NULL)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      return;
+    }
+  sprintf (tmp, "%s.tmp", stats_file);
+
+  fp = fopen (tmp, "w");
+  if (fp == NULL)
+    {
+      syslog (LOG_ERR, "%s: %m", tmp);
+      free (tmp);
+      return;
+    }
+
+  fprintf (fp, "spawn-buckets-usec");
+  for (i = 0; i < SPAWNBUCKETS - 1; i++)
+    fprintf (fp, " <%lu", 1UL << i);
+  fprintf (fp, " more\nlifetime-buckets-msec");
+  for (i = 0; i < LIFEBUCKETS - 1; i++)
+    fprintf (fp, " <%lu", 1UL << i);
+  fprintf (fp, " more\n");
+
+  for (sep = servtab; sep; sep = sep->se_next)
+    {
+      struct stats *st = &sep->se_stats;
+
+      fprintf (fp, "service %s%s%s%s/%s accepted %lu spawned %lu"
+	       " rejected %lu children %u spawn",
+	       sep->se_node ? sep->se_node : "", sep->se_node ? ":" : "",
+	       ISMUX (sep) ? "tcpmux/" : "", sep->se_service, sep->se_proto,
+	       st->st_accepted, st->st_spawned, st->st_rejected,
+	       sep->se_children + sep->se_workers);
+      for (i = 0; i < SPAWNBUCKETS; i++)
+	fprintf (fp, " %lu", st->st_spawntime[i]);
+      fprintf (fp, " lifetime");
+      for (i = 0; i < LIFEBUCKETS; i++)
+	fprintf (fp, " %lu", st->st_lifetime[i]);
+      fputc ('\n', fp);
+    }
+
+  if (fclose (fp) != 0 || rename (tmp, stats_file) < 0)
+    syslog (LOG_ERR, "%s: %m", stats_file);
+  else if (debug)
+    fprintf (stderr, "Statistics written to %s.\n", stats_file);
+  free (tmp);
+}
+
+
+
+/*
+ * Internet services provided internally by inetd:
+ */
+#define BUFSIZE	8192
+
+/*
+ * The stream services echo, discard and chargen are served by inetd
+ * itself, without forking.  Each connection has its socket made
+ * non-blocking and is driven by the event loop: its function is
+ * called whenever the socket is ready, does what it can, and either
+ * records in co_events what to wait for next and returns zero, or
+ * returns -1 once the connection is over.  Connections count as
+ * servers of their service, and are closed after CONNIDLE seconds
+ * without traffic.
+ */
+#define CONN_READ	1
+#define CONN_WRITE	2
+#define CONN_ROUNDS	16	/* reads or writes per event, for fairness */
+
+struct conn
+{
+  int co_fd;
+  struct servtab *co_sep;	/* NULL once the service is removed */
+  struct source *co_source;	/* client, if se_maxsource is set */
+  unsigned long long co_accepted;	/* when accepted */
+  unsigned long long co_last;	/* when last served */
+  int co_events;		/* CONN_READ or CONN_WRITE awaited */
+  int co_watched;		/* events the loop is waiting for */
+  int (*co_fn) (struct conn *);
+  char *co_buf;			/* echo: data not yet sent back */
+  size_t co_start, co_end;
+  size_t co_pos;		/* chargen: offset in chargen_text */
+  struct conn *co_next;
+  struct conn **co_prevp;
+} *conns;
+
+#ifdef USE_EPOLL
+/* Connections are told from services in epoll data by the low bit,
+   which is clear in the address of a servtab.  */
+# define CONN_TAG(co)	((void *) ((uintptr_t) (co) | 1))
+# define CONN_UNTAG(p)	((uintptr_t) (p) & 1 \
+			 ? (struct conn *) ((uintptr_t) (p) & ~(uintptr_t) 1) \
+			 : NULL)
+#endif
+
+/* Have CO wait for EVENTS if the last call failed only for lack of
+   data or of buffer space, and return zero; else return -1.  */
+int
+conn_again (struct conn *co, int events)
+{
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    return -1;
+  co->co_events = events;
+  return 0;
+}
+
+void
+conn_close (struct conn *co)
+{
+  struct servtab *sep;
+#ifdef USE_EPOLL
+  struct epoll_event ev;
+
+  /* A forked child may still hold a copy of the socket.  */
+  if (co->co_watched)
+    epoll_ctl (epfd, EPOLL_CTL_DEL, co->co_fd, &ev);
+#endif
+  close (co->co_fd);
+  signal_block (NULL);
+  sep = co->co_sep;
+  if (sep)
+    {
+      stats_hist (sep->se_stats.st_lifetime, LIFEBUCKETS,
+		  (stats_clock () - co->co_accepted) / 1000);
+      if (co->co_source)
+	source_put (sep, co->co_source);
+      sep->se_children--;
+      service_throttle (sep);
+    }
+  *co->co_prevp = co->co_next;
+  if (co->co_next)
+    co->co_next->co_prevp = co->co_prevp;
+  signal_unblock (NULL);
+  free (co->co_buf);
+  free (co);
+}
+
+/* Serve CO, and wait for what it needs next.  */
+void
+conn_event (struct conn *co)
+{
+  co->co_last = stats_clock ();
+  if (co->co_fn (co) < 0)
+    {
+      if (debug)
+	fprintf (stderr, "closing connection %d\n", co->co_fd);
+      conn_close (co);
+      return;
+    }
+#ifdef USE_EPOLL
+  if (co->co_events != co->co_watched)
+    {
+      struct epoll_event ev;
+
+      memset (&ev, 0, sizeof (ev));
+      ev.events = ((co->co_events & CONN_READ ? EPOLLIN : 0)
+		   | (co->co_events & CONN_WRITE ? EPOLLOUT : 0));
+      ev.data.ptr = CONN_TAG (co);
+      if (epoll_ctl (epfd, co->co_watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		     co->co_fd, &ev) < 0)
+	{
+	  syslog (LOG_ERR, "epoll_ctl: %m");
+	  conn_close (co);
+	  return;
+	}
+    }
+#endif
+  co->co_watched = co->co_events;
+}
+
+/* Serve the connection on CTRL from CLIENT, which accept_client made
+   non-blocking, with the built-in of SEP.  The limits of SEP apply as
+   to forked servers.  */
+void
+conn_open (int ctrl, struct servtab *sep, struct sockaddr *client)
+{
+  struct conn *co;
+
+#ifndef USE_EPOLL
+  if (ctrl >= FD_SETSIZE)
+    {
+      syslog (LOG_WARNING, "too many connections to built-in services");
+      sep->se_stats.st_rejected++;
+      close (ctrl);
+      return;
+    }
+#endif
+  co = calloc (1, sizeof (*co));
+  if (co == NULL)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      close (ctrl);
+      return;
+    }
+
+  /* No rate limit: that is meant for servers failing in a loop, and
+     the connections of a service are bounded by its children already.  */
+  signal_block (NULL);
+  if (sep->se_maxsource && client && source_full (sep, client))
+    {
+      sep->se_stats.st_rejected++;
+      signal_unblock (NULL);
+      close (ctrl);
+      free (co);
+      return;
+    }
+  co->co_fd = ctrl;
+  co->co_fn = sep->se_bi->bi_conn;
+  co->co_sep = sep;
+  co->co_accepted = stats_clock ();
+  if (sep->se_maxsource && client)
+    {
+      co->co_source = source_get (sep, client, true);
+      co->co_source->so_count++;
+    }
+  sep->se_children++;
+  service_throttle (sep);
+  co->co_next = conns;
+  co->co_prevp = &conns;
+  if (conns)
+    conns->co_prevp = &co->co_next;
+  conns = co;
+  signal_unblock (NULL);
+
+  /* Most clients have something to read or room to write already.  */
+  conn_event (co);
 }
-
 
+/* Detach the connections of SEP, which is being removed.  */
+void
+conns_forget (struct servtab *sep)
+{
+  struct conn *co;
+
+  for (co = conns; co; co = co->co_next)
+    if (co->co_sep == sep)
+      {
+	co->co_sep = NULL;
+	co->co_source = NULL;
+      }
+}
 
+/* Close the connections idle for CONNIDLE seconds by NOW.  */
 void
-set_proc_title (char *a, int s)
+conns_expire (unsigned long long now)
 {
-  socklen_t size;
-  char *cp;
-#ifdef IPV6
-  struct sockaddr_storage saddr;
-#else
-  struct sockaddr_in saddr;
-#endif
-  char buf[80];
+  struct conn *co, *next;
 
-  cp = Argv[0];
-  size = sizeof saddr;
-  if (getpeername (s, (struct sockaddr *) &saddr, &size) == 0)
+  for (co = conns; co; co = next)
     {
-#ifdef IPV6
-      int err;
-      char buf2[80];
-
-      err = getnameinfo ((struct sockaddr *) &saddr, sizeof (saddr), buf2,
-			 sizeof (buf2), NULL, 0, NI_NUMERICHOST);
-      if (!err)
-	snprintf (buf, sizeof buf, "-%s [%s]", a, buf2);
-      else
-	snprintf (buf, sizeof buf, "-%s", a);
-#else
-      snprintf (buf, sizeof buf, "-%s [%s]", a, inet_ntoa (saddr.sin_addr));
-#endif
+      next = co->co_next;
+      if (now - co->co_last >= CONNIDLE * 1000000ULL)
+	{
+	  if (debug)
+	    fprintf (stderr, "closing idle connection %d\n", co->co_fd);
+	  conn_close (co);
+	}
     }
-  else
-    snprintf (buf, sizeof buf, "-%s", a);
-  strncpy (cp, buf, LastArg - cp);
-  cp += strlen (cp);
-  while (cp < LastArg)
-    *cp++ = ' ';
 }
 
-/*
- * Internet services provided internally by inetd:
- */
-#define BUFSIZE	8192
-
 /* Echo service -- echo data back */
-void
-echo_stream (int s, struct servtab *sep)
+int
+echo_stream (struct conn *co)
 {
-  char buffer[BUFSIZE];
-  int i;
+  ssize_t n;
+  int rounds;
 
-  set_proc_title (sep->se_service, s);
-  while ((i = read (s, buffer, sizeof buffer)) > 0
-	 && write (s, buffer, i) > 0)
-    ;
-  exit (EXIT_SUCCESS);
+  if (co->co_buf == NULL)
+    {
+      co->co_buf = malloc (BUFSIZE);
+      if (co->co_buf == NULL)
+	return -1;
+    }
+  for (rounds = 0; rounds < CONN_ROUNDS; rounds++)
+    {
+      if (co->co_start == co->co_end)
+	{
+	  co->co_start = co->co_end = 0;
+	  n = read (co->co_fd, co->co_buf, BUFSIZE);
+	  if (n == 0)
+	    return -1;
+	  if (n < 0)
+	    return conn_again (co, CONN_READ);
+	  co->co_end = n;
+	}
+      n = write (co->co_fd, co->co_buf + co->co_start,
+		 co->co_end - co->co_start);
+      if (n < 0)
+	return conn_again (co, CONN_WRITE);
+      co->co_start += n;
+    }
+  co->co_events = co->co_start == co->co_end ? CONN_READ : CONN_WRITE;
+  return 0;
 }
 
 /* Echo service -- echo data back */
@@ -1537,21 +2743,23 @@ echo_dg (int s, struct servtab *sep MAYBE_UNUSED)
 }
 
 /* Discard service -- ignore data */
-void
-discard_stream (int s, struct servtab *sep)
+int
+discard_stream (struct conn *co)
 {
-  int ret;
   char buffer[BUFSIZE];
+  ssize_t n;
+  int rounds;
 
-  set_proc_title (sep->se_service, s);
-  while (1)
+  for (rounds = 0; rounds < CONN_ROUNDS; rounds++)
     {
-      while ((ret = read (s, buffer, sizeof buffer)) > 0)
-	;
-      if (ret == 0 || errno != EINTR)
-	break;
+      n = read (co->co_fd, buffer, sizeof buffer);
+      if (n == 0)
+	return -1;
+      if (n < 0)
+	return conn_again (co, CONN_READ);
     }
-  exit (EXIT_SUCCESS);
+  co->co_events = CONN_READ;
+  return 0;
 }
 
 void
@@ -1563,7 +2771,6 @@ discard_dg (int s, struct servtab *sep MAYBE_UNUSED)
   read (s, buffer, sizeof buffer);
 }
 
-#include <ctype.h>
 #define LINESIZ 72
 char ring[128];
 char *endring;
@@ -1580,39 +2787,64 @@ initring (void)
       *endring++ = i;
 }
 
-/* Character generator */
+/* The output of chargen repeats itself after one line starting with
+   each character of the ring.  The whole period is laid out once, so
+   that a single writev sends many lines from any point in it.  */
+#define CHARGEN_IOV	8
+char *chargen_text;
+size_t chargen_size;
+
 void
-chargen_stream (int s, struct servtab *sep)
+initchargen (void)
 {
-  int len;
-  char *rs, text[LINESIZ + 2];
-
-  set_proc_title (sep->se_service, s);
+  size_t nring, i, j;
+  char *p;
 
   if (!endring)
+    initring ();
+  nring = endring - ring;
+  chargen_size = nring * (LINESIZ + 2);
+  p = chargen_text = malloc (chargen_size);
+  if (p == NULL)
     {
-      initring ();
-      rs = ring;
+      syslog (LOG_ERR, "Out of memory.");
+      exit (-1);
+    }
+  for (i = 0; i < nring; i++)
+    {
+      for (j = 0; j < LINESIZ; j++)
+	*p++ = ring[(i + j) % nring];
+      *p++ = '\r';
+      *p++ = '\n';
     }
+}
 
-  text[LINESIZ] = '\r';
-  text[LINESIZ + 1] = '\n';
-  for (rs = ring;;)
+/* Character generator */
+int
+chargen_stream (struct conn *co)
+{
+  struct iovec iov[CHARGEN_IOV];
+  ssize_t n;
+  int i, rounds;
+
+  if (!chargen_text)
+    initchargen ();
+  for (i = 1; i < CHARGEN_IOV; i++)
     {
-      len = endring - rs;
-      if (len >= LINESIZ)
-	memmove (text, rs, LINESIZ);
-      else
-	{
-	  memmove (text, rs, len);
-	  memmove (text + len, ring, LINESIZ - len);
-	}
-      if (++rs == endring)
-	rs = ring;
-      if (write (s, text, sizeof text) != sizeof text)
-	break;
+      iov[i].iov_base = chargen_text;
+      iov[i].iov_len = chargen_size;
     }
-  exit (EXIT_SUCCESS);
+  for (rounds = 0; rounds < CONN_ROUNDS; rounds++)
+    {
+      iov[0].iov_base = chargen_text + co->co_pos;
+      iov[0].iov_len = chargen_size - co->co_pos;
+      n = writev (co->co_fd, iov, CHARGEN_IOV);
+      if (n < 0)
+	return conn_again (co, CONN_WRITE);
+      co->co_pos = (co->co_pos + n) % chargen_size;
+    }
+  co->co_events = CONN_WRITE;
+  return 0;
 }
 
 /* Character generator */
@@ -1813,9 +3045,9 @@ tcpmux (int s, struct servtab *sep)
     }
 
   /* Try matching a service in inetd.conf with the request */
-  for (sep = servtab; sep; sep = sep->se_next)
+  for (sep = muxhash[mux_hash (service)]; sep; sep = sep->se_mnext)
     {
-      if (ISMUX (sep) && !strcasecmp (service, sep->se_service))
+      if (!strcasecmp (service, sep->se_service))
 	{
 	  if (ISMUXPLUS (sep))
 	    {
@@ -1916,22 +3148,362 @@ prepenv (int ctrl, struct sockaddr *sa_client, socklen_t sa_len)
 
 
 
+#ifdef USE_EPOLL
+/* Handle the signals queued on SIGFD.  */
+void
+events_signals (void)
+{
+  struct signalfd_siginfo si;
+  bool child = false, alrm = false, hup = false, usr2 = false;
+
+  while (read (sigfd, &si, sizeof (si)) == sizeof (si))
+    switch (si.ssi_signo)
+      {
+      case SIGCHLD:
+	child = true;
+	break;
+
+      case SIGALRM:
+	alrm = true;
+	break;
+
+      case SIGHUP:
+	hup = true;
+	break;
+
+      case SIGUSR2:
+	usr2 = true;
+	break;
+      }
+
+  if (child)
+    reapchild (SIGCHLD);
+  if (alrm)
+    retry (SIGALRM);
+  if (hup)
+    config (SIGHUP);
+  if (usr2)
+    stats_dump (SIGUSR2);
+}
+#endif
+
+/* Accept a connection on the socket of SEP, non-blocking if NONBLOCK,
+   and closed on exec.  */
 int
-main (int argc, char *argv[], char *envp[])
+accept_client (struct servtab *sep, struct sockaddr *sa, socklen_t *len,
+	       bool nonblock)
+{
+  int fd;
+
+#ifdef HAVE_ACCEPT4
+  fd = accept4 (sep->se_fd, sa, len,
+		SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0));
+#else
+  fd = accept (sep->se_fd, sa, len);
+  if (fd >= 0)
+    {
+      int flags = fcntl (fd, F_GETFL);
+
+      /* Some systems pass on the flags of the listening socket.  */
+      if (flags >= 0)
+	fcntl (fd, F_SETFL,
+	       nonblock ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+      fcntl (fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+  return fd;
+}
+
+/* Start a worker of SEP on its socket, and return false if none can
+   be started for now.  Workers follow the LISTEN_FDS convention of
+   socket activation, with their socket as standard input and output
+   too, as for wait services.  */
+bool
+pool_spawn (struct servtab *sep)
+{
+  unsigned long long start = stats_clock ();
+  char *fdnames;
+  size_t i, n;
+  pid_t pid;
+
+  if (service_looping (sep))
+    return false;
+
+  for (n = 0; environ[n]; n++)
+    ;
+  pool_env = malloc ((n + 4) * sizeof (*pool_env));
+  fdnames = malloc (sizeof "LISTEN_FDNAMES=" + strlen (sep->se_service));
+  if (pool_env == NULL || fdnames == NULL)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      exit (-1);
+    }
+  sprintf (fdnames, "LISTEN_FDNAMES=%s", sep->se_service);
+  for (i = n = 0; environ[i]; i++)
+    if (strncmp (environ[i], "LISTEN_", 7))
+      pool_env[n++] = environ[i];
+  pool_env[n++] = pool_pid;
+  pool_env[n++] = (char *) "LISTEN_FDS=1";
+  pool_env[n++] = fdnames;
+  pool_env[n] = NULL;
+
+  pid = spawn_server (sep->se_fd, sep);
+  free (pool_env);
+  pool_env = NULL;
+  free (fdnames);
+  if (pid < 0)
+    {
+      syslog (LOG_ERR, "fork: %m");
+      /* Try again in a while, rather than wait for a child to exit.  */
+      pool_short = 1;
+      pool_retry = stats_clock () + ACCEPTPAUSE * 1000000ULL;
+      return false;
+    }
+  sep->se_stats.st_spawned++;
+  stats_hist (sep->se_stats.st_spawntime, SPAWNBUCKETS,
+	      stats_clock () - start);
+  child_add (sep, pid, NULL, true);
+  return true;
+}
+
+/* Start the workers the pools lack.  */
+void
+pools_fill (void)
 {
-  int index;
   struct servtab *sep;
+
+  if (pool_retry)
+    {
+      if (stats_clock () < pool_retry)
+	return;
+      pool_retry = 0;
+    }
+  pool_short = 0;
+  for (sep = servtab; sep; sep = sep->se_next)
+    while (sep->se_fd >= 0 && sep->se_workers < POOL (sep)
+	   && pool_spawn (sep))
+      ;
+}
+
+/* Start the server of SEP for CTRL, a connection from CLIENT or the
+   socket of SEP itself, which was ready at START.  */
+void
+serve_client (struct servtab *sep, int ctrl, struct sockaddr *client,
+	      unsigned long long start)
+{
   int dofork;
   pid_t pid;
 
-  set_program_name (argv[0]);
+  if (sep->se_bi && sep->se_bi->bi_conn)
+    {
+      conn_open (ctrl, sep, client);
+      return;
+    }
+
+  signal_block (NULL);
+  pid = 0;
+  dofork = (sep->se_bi == 0 || sep->se_bi->bi_fork);
+  if (dofork && sep->se_maxsource && client && source_full (sep, client))
+    {
+      sep->se_stats.st_rejected++;
+      close (ctrl);
+      signal_unblock (NULL);
+      return;
+    }
+  if (dofork)
+    {
+      if (service_looping (sep))
+	{
+	  sep->se_stats.st_rejected++;
+	  if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+	    close (ctrl);
+	  signal_unblock (NULL);
+	  return;
+	}
+      if (sep->se_bi)
+	pid = fork ();
+      else
+	pid = spawn_server (ctrl, sep);
+    }
+  if (pid < 0)
+    {
+      syslog (LOG_ERR, "fork: %m");
+      sep->se_stats.st_rejected++;
+      if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+	close (ctrl);
+      signal_unblock (NULL);
+      sleep (1);
+      return;
+    }
+  if (pid)
+    {
+      sep->se_stats.st_spawned++;
+      stats_hist (sep->se_stats.st_spawntime, SPAWNBUCKETS,
+		  stats_clock () - start);
+      child_add (sep, pid, client, false);
+    }
+  if (pid && sep->se_wait)
+    {
+      sep->se_wait = pid;
+      if (sep->se_fd >= 0)
+	listen_remove (sep);
+    }
+  signal_unblock (NULL);
+  if (pid == 0)
+    {
+      if (debug && dofork)
+	setsid ();
+      if (dofork)
+	{
+	  int sock;
+#ifdef USE_EPOLL
+	  events_child ();
+#endif
+	  if (debug)
+	    fprintf (stderr, "+ Closing from %d\n", maxsock);
+	  for (sock = maxsock; sock > 2; sock--)
+	    if (sock != ctrl)
+	      close (sock);
+	}
+      run_service (ctrl, sep);
+    }
+  if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+    close (ctrl);
+}
+
+/* Stop watching SEP for ACCEPTPAUSE seconds, inetd being out of
+   descriptors: its pending connections would wake it up at once.  */
+void
+listen_pause (struct servtab *sep)
+{
+  syslog (LOG_WARNING, "accept (for %s): %m, paused", sep->se_service);
+  signal_block (NULL);
+  if (!sep->se_paused && !sep->se_full)
+    listen_remove (sep);
+  sep->se_paused = true;
+  accept_resume = stats_clock () + ACCEPTPAUSE * 1000000ULL;
+  signal_unblock (NULL);
+}
+
+/* Watch the paused services again.  */
+void
+listen_resume (void)
+{
+  struct servtab *sep;
+
+  signal_block (NULL);
+  accept_resume = 0;
+  for (sep = servtab; sep; sep = sep->se_next)
+    if (sep->se_paused)
+      {
+	sep->se_paused = false;
+	if (sep->se_fd >= 0 && !sep->se_full)
+	  listen_add (sep);
+      }
+  signal_unblock (NULL);
+}
+
+/* Take the connections, or the datagram, SEP is ready for.  Up to
+   ACCEPTMAX pending connections are accepted in a row, so that a
+   burst empties the listen queue without starving other services.  */
+void
+serve (struct servtab *sep)
+{
+  unsigned long long start;
+  int ctrl, i;
+
+  if (debug)
+    fprintf (stderr, "someone wants %s\n", sep->se_service);
+  if (sep->se_wait || sep->se_socktype != SOCK_STREAM)
+    {
+      serve_client (sep, sep->se_fd, NULL, stats_clock ());
+      return;
+    }
+
+  /* The service may be suspended while at it.  */
+  for (i = 0; i < ACCEPTMAX && sep->se_fd >= 0 && !sep->se_full; i++)
+    {
+#ifdef IPV6
+      struct sockaddr_storage sa_client;
+#else
+      struct sockaddr_in sa_client;
+#endif
+      socklen_t len = sizeof (sa_client);
+
+      ctrl = accept_client (sep, (struct sockaddr *) &sa_client, &len,
+			    sep->se_bi && sep->se_bi->bi_conn);
+      if (ctrl < 0)
+	{
+	  if (errno == ECONNABORTED)
+	    continue;
+	  if (errno == EMFILE || errno == ENFILE)
+	    {
+	      listen_pause (sep);
+	      break;
+	    }
+	  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	    syslog (LOG_WARNING, "accept (for %s): %m", sep->se_service);
+	  break;
+	}
+      start = stats_clock ();
+      sep->se_stats.st_accepted++;
+      if (debug)
+	fprintf (stderr, "accept, ctrl %d\n", ctrl);
+      if (env_option)
+	prepenv (ctrl, (struct sockaddr *) &sa_client, len);
+      serve_client (sep, ctrl, (struct sockaddr *) &sa_client, start);
+    }
+}
+
+/* Resume paused services, close idle connections and refresh
+   credentials when due.  Return how many milliseconds the event loop
+   may wait at most, or -1 to wait for ever.  Workers that failed to
+   start are left to pools_fill, but wake the loop when due.  */
+int
+timers_run (void)
+{
+  static unsigned long long expire;
+  static time_t creds_due;
+  unsigned long long now;
+  int wait = -1;
+
+  if (cred_ttl && creds)
+    {
+      time_t t = time (NULL);
 
-  Argv = argv;
-  if (envp == 0 || *envp == 0)
-    envp = argv;
-  while (*envp)
-    envp++;
-  LastArg = envp[-1] + strlen (envp[-1]);
+      if (t >= creds_due)
+	creds_due = creds_refresh (t);
+      if (creds_due > t)
+	wait = creds_due - t < 60 ? (creds_due - t) * 1000 : 60 * 1000;
+    }
+
+  if (pool_retry)
+    {
+      now = stats_clock ();
+      if (wait < 0 || pool_retry < now + wait * 1000ULL)
+	wait = pool_retry > now ? (pool_retry - now + 999) / 1000 : 0;
+    }
+
+  if (conns == NULL && accept_resume == 0)
+    return wait;
+  now = stats_clock ();
+  if (accept_resume && now >= accept_resume)
+    listen_resume ();
+  if (now >= expire)
+    {
+      conns_expire (now);
+      expire = now + 1000000;
+    }
+  return wait >= 0 && wait < 1000 ? wait : 1000;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int index;
+  struct servtab *sep;
+
+  set_program_name (argv[0]);
 
   /* Parse command line */
   iu_argp_init ("inetd", program_authors);
@@ -1982,10 +3554,14 @@ main (int argc, char *argv[], char *envp[])
 	syslog (LOG_CRIT, "can't open %s: %s\n", pid_file, strerror (errno));
     }
 
+#ifdef USE_EPOLL
+  events_init ();
+#endif
   signal_set_handler (SIGALRM, retry);
   config (0);
   signal_set_handler (SIGHUP, config);
   signal_set_handler (SIGCHLD, reapchild);
+  signal_set_handler (SIGUSR2, stats_dump);
   signal_set_handler (SIGPIPE, SIG_IGN);
 
   {
@@ -1998,135 +3574,111 @@ main (int argc, char *argv[], char *envp[])
     setenv ("inetd_dummy", dummy, 1);
   }
 
+#ifdef USE_EPOLL
   for (;;)
     {
-      int n, ctrl;
-      fd_set readable;
+      struct epoll_event events[EVENTS_MAX];
+      int i, n, signalled = 0;
 
-      if (nsock == 0)
+      if (pool_short)
+	pools_fill ();
+      n = epoll_wait (epfd, events, EVENTS_MAX, timers_run ());
+      if (n < 0)
+	{
+	  if (errno != EINTR)
+	    {
+	      syslog (LOG_WARNING, "epoll_wait: %m");
+	      sleep (1);
+	    }
+	  continue;
+	}
+      /* Signals come last, since a reconfiguration may free services
+         with events further on in EVENTS.  */
+      for (i = 0; i < n; i++)
+	{
+	  struct conn *co = CONN_UNTAG (events[i].data.ptr);
+
+	  sep = events[i].data.ptr;
+	  if (co)
+	    conn_event (co);
+	  else if (sep == NULL)
+	    signalled = 1;
+	  else if (sep->se_fd != -1)
+	    serve (sep);
+	}
+      if (signalled)
+	events_signals ();
+    }
+#else
+  for (;;)
+    {
+      int n, maxfd, wait;
+      fd_set readable, writable;
+      struct conn *co, *next;
+      struct timeval tv;
+
+      if (nsock == 0 && conns == NULL && !accept_resume)
 	{
 	  SIGSTATUS stat;
 	  sigstatus_empty (stat);
 
 	  signal_block (NULL);
-	  while (nsock == 0)
+	  while (nsock == 0 && conns == NULL && !accept_resume
+		 && !pool_short)
 	    inetd_pause (stat);
 	  signal_unblock (NULL);
 	}
+      if (pool_short)
+	{
+	  signal_block (NULL);
+	  pools_fill ();
+	  signal_unblock (NULL);
+	}
+      /* Before the sets are made, since it may close connections.  */
+      wait = timers_run ();
       readable = allsock;
-      n = select (maxsock + 1, &readable, NULL, NULL, NULL);
-      if (n <= 0)
+      FD_ZERO (&writable);
+      maxfd = maxsock;
+      for (co = conns; co; co = co->co_next)
+	{
+	  if (co->co_events & CONN_READ)
+	    FD_SET (co->co_fd, &readable);
+	  if (co->co_events & CONN_WRITE)
+	    FD_SET (co->co_fd, &writable);
+	  if (co->co_fd > maxfd)
+	    maxfd = co->co_fd;
+	}
+      tv.tv_sec = wait / 1000;
+      tv.tv_usec = wait % 1000 * 1000;
+      n = select (maxfd + 1, &readable, &writable, NULL,
+		  wait < 0 ? NULL : &tv);
+      if (n == 0)
+	continue;
+      if (n < 0)
 	{
-	  if (n < 0 && errno != EINTR)
+	  if (errno != EINTR)
 	    syslog (LOG_WARNING, "select: %m");
 	  sleep (1);
 	  continue;
 	}
+      for (co = conns; n && co; co = next)
+	{
+	  int ready = !!FD_ISSET (co->co_fd, &readable)
+	    + !!FD_ISSET (co->co_fd, &writable);
+
+	  next = co->co_next;
+	  if (ready)
+	    {
+	      n -= ready;
+	      conn_event (co);
+	    }
+	}
       for (sep = servtab; n && sep; sep = sep->se_next)
 	if (sep->se_fd != -1 && FD_ISSET (sep->se_fd, &readable))
 	  {
 	    n--;
-	    if (debug)
-	      fprintf (stderr, "someone wants %s\n", sep->se_service);
-	    if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
-	      {
-#ifdef IPV6
-		struct sockaddr_storage sa_client;
-#else
-		struct sockaddr_in sa_client;
-#endif
-		socklen_t len = sizeof (sa_client);
-
-		ctrl = accept (sep->se_fd, (struct sockaddr *) &sa_client,
-			       &len);
-		if (debug)
-		  fprintf (stderr, "accept, ctrl %d\n", ctrl);
-		if (ctrl < 0)
-		  {
-		    if (errno != EINTR)
-		      syslog (LOG_WARNING, "accept (for %s): %m",
-			      sep->se_service);
-		    continue;
-		  }
-		if (env_option)
-		  prepenv (ctrl, (struct sockaddr *) &sa_client, len);
-	      }
-	    else
-	      ctrl = sep->se_fd;
-
-	    signal_block (NULL);
-	    pid = 0;
-	    dofork = (sep->se_bi == 0 || sep->se_bi->bi_fork);
-	    if (dofork)
-	      {
-		if (sep->se_count++ == 0)
-		  gettimeofday (&sep->se_time, NULL);
-		else if ((sep->se_max && sep->se_count > sep->se_max)
-			 || sep->se_count >= toomany)
-		  {
-		    struct timeval now;
-
-		    gettimeofday (&now, NULL);
-		    if (now.tv_sec - sep->se_time.tv_sec > CNT_INTVL)
-		      {
-			sep->se_time = now;
-			sep->se_count = 1;
-		      }
-		    else
-		      {
-			syslog (LOG_ERR,
-				"%s/%s server failing (looping), service terminated",
-				sep->se_service, sep->se_proto);
-			close_sep (sep);
-			if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
-			  close (ctrl);
-			signal_unblock (NULL);
-			if (!timingout)
-			  {
-			    timingout = 1;
-			    alarm (RETRYTIME);
-			  }
-			continue;
-		      }
-		  }
-		pid = fork ();
-	      }
-	    if (pid < 0)
-	      {
-		syslog (LOG_ERR, "fork: %m");
-		if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
-		  close (ctrl);
-		signal_unblock (NULL);
-		sleep (1);
-		continue;
-	      }
-	    if (pid && sep->se_wait)
-	      {
-		sep->se_wait = pid;
-		if (sep->se_fd >= 0)
-		  {
-		    FD_CLR (sep->se_fd, &allsock);
-		    nsock--;
-		  }
-	      }
-	    signal_unblock (NULL);
-	    if (pid == 0)
-	      {
-		if (debug && dofork)
-		  setsid ();
-		if (dofork)
-		  {
-		    int sock;
-		    if (debug)
-		      fprintf (stderr, "+ Closing from %d\n", maxsock);
-		    for (sock = maxsock; sock > 2; sock--)
-		      if (sock != ctrl)
-			close (sock);
-		  }
-		run_service (ctrl, sep);
-	      }
-	    if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
-	      close (ctrl);
+	    serve (sep);
 	  }
     }
+#endif
 }
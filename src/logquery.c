@@ -0,0 +1,391 @@
+/*
+  Copyright (C) 2024 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'. */
+
+/* Print the messages of a syslogd log store which match a query.  */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <argp.h>
+#include <libinetutils.h>
+#include <progname.h>
+#include <error.h>
+#include <xalloc.h>
+#include <attribute.h>
+
+#define SYSLOG_NAMES
+#include <syslog.h>
+#ifndef HAVE_SYSLOG_INTERNAL
+# include "logprio.h"
+#endif
+
+#include "logstore.h"
+
+/* The query.  */
+static int64_t since = INT64_MIN;
+static int64_t until = INT64_MAX;
+static uint32_t facilities = UINT32_MAX;
+static uint32_t levels = UINT32_MAX;
+static const char *host;
+static const char *tag;
+static uint64_t hostbits, tagbits;
+
+/* A segment file mapped in memory.  */
+struct segfile
+{
+  const unsigned char *base;
+  size_t size;
+};
+
+/* Return nonzero if no record of BLK can match the query.  */
+static int
+block_excluded (const struct logstore_blk *blk)
+{
+  return blk->last < since || blk->first > until
+    || !(blk->facilities & facilities) || !(blk->levels & levels)
+    || (blk->hosts & hostbits) != hostbits
+    || (blk->tags & tagbits) != tagbits;
+}
+
+/* Return nonzero if REC matches the query.  */
+static int
+record_matches (const struct logstore_rec *rec)
+{
+  const char *text = (const char *) (rec + 1);
+
+  if (rec->time < since || rec->time > until
+      || !((1U << LOG_FAC (rec->pri)) & facilities)
+      || !((1U << LOG_PRI (rec->pri)) & levels))
+    return 0;
+  if (host && (strlen (host) != rec->hostlen
+	       || strncasecmp (host, text, rec->hostlen)))
+    return 0;
+  text += rec->hostlen;
+  if (tag && (strlen (tag) != rec->taglen
+	      || strncmp (tag, text, rec->taglen)))
+    return 0;
+  return 1;
+}
+
+/* Return the record at OFFSET in LOG, or NULL if it is torn or not
+   yet complete.  */
+static const struct logstore_rec *
+record_at (const struct segfile *log, uint64_t offset)
+{
+  const struct logstore_rec *rec;
+
+  if (offset % 8 || offset + sizeof (*rec) > log->size)
+    return NULL;
+  rec = (const struct logstore_rec *) (log->base + offset);
+  if (rec->size % 8 || rec->size > log->size - offset
+      || rec->size < LOGSTORE_RECSIZE (rec->hostlen, rec->textlen)
+      || rec->taglen > rec->textlen)
+    return NULL;
+  return rec;
+}
+
+static void
+record_print (const struct logstore_rec *rec)
+{
+  const char *text = (const char *) (rec + 1);
+  time_t t = rec->time;
+  char stamp[32];
+
+  strftime (stamp, sizeof (stamp), "%b %e %H:%M:%S", localtime (&t));
+  printf ("%s %.*s %.*s\n", stamp, (int) rec->hostlen, text,
+	  (int) rec->textlen, text + rec->hostlen);
+}
+
+/* Print the matching records among the COUNT ones from OFFSET in LOG,
+   and return the offset following them.  With COUNT -1, go on up to
+   the end of LOG.  */
+static uint64_t
+scan_records (const struct segfile *log, uint64_t offset, long count)
+{
+  const struct logstore_rec *rec;
+
+  for (; count != 0 && (rec = record_at (log, offset)); count--)
+    {
+      if (record_matches (rec))
+	record_print (rec);
+      offset += rec->size;
+    }
+  return offset;
+}
+
+/* Map DIR/NAME, which must begin with MAGIC, into SF.  Return zero if
+   it does not exist.  */
+static int
+segfile_map (const char *dir, const char *name, const char *magic,
+	     struct segfile *sf)
+{
+  struct stat st;
+  char *path;
+  int fd;
+
+  path = xmalloc (strlen (dir) + strlen (name) + 2);
+  sprintf (path, "%s/%s", dir, name);
+  fd = open (path, O_RDONLY);
+  if (fd < 0 && errno == ENOENT)
+    {
+      free (path);
+      return 0;
+    }
+  if (fd < 0 || fstat (fd, &st) < 0)
+    error (EXIT_FAILURE, errno, "%s", path);
+
+  sf->size = st.st_size;
+  if (sf->size < LOGSTORE_HDRSIZE)
+    error (EXIT_FAILURE, 0, "%s: not a log store segment", path);
+  sf->base = mmap (NULL, sf->size, PROT_READ, MAP_SHARED, fd, 0);
+  if (sf->base == MAP_FAILED)
+    error (EXIT_FAILURE, errno, "%s", path);
+  close (fd);
+
+  if (memcmp (sf->base, magic, 8))
+    error (EXIT_FAILURE, 0, "%s: not a log store segment", path);
+  free (path);
+  return 1;
+}
+
+/* Print the matching records of segment SEQ of the store DIR.  Only
+   the blocks whose summary allows a match are read.  */
+static void
+scan_segment (const char *dir, unsigned long seq)
+{
+  struct segfile log, idx;
+  const struct logstore_blk *blk, *end;
+  uint64_t offset = LOGSTORE_HDRSIZE;
+  char name[LOGSTORE_NAMESIZE];
+
+  sprintf (name, LOGSTORE_NAMEFMT, seq, "log");
+  if (!segfile_map (dir, name, LOGSTORE_LOGMAGIC, &log))
+    return;
+  sprintf (name, LOGSTORE_NAMEFMT, seq, "idx");
+  if (!segfile_map (dir, name, LOGSTORE_IDXMAGIC, &idx))
+    idx.base = NULL, idx.size = LOGSTORE_HDRSIZE;
+
+  if (idx.base)
+    {
+      blk = (const struct logstore_blk *) (idx.base + LOGSTORE_HDRSIZE);
+      end = blk + (idx.size - LOGSTORE_HDRSIZE) / sizeof (*blk);
+      for (; blk < end; blk++)
+	{
+	  if (!block_excluded (blk))
+	    scan_records (&log, blk->offset, blk->count);
+	  offset = blk->offset + blk->size;
+	}
+      munmap ((void *) idx.base, idx.size);
+    }
+
+  /* The records written since the last complete block.  */
+  scan_records (&log, offset, -1);
+  munmap ((void *) log.base, log.size);
+}
+
+static int
+compare_seq (const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *) a;
+  unsigned long y = *(const unsigned long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Print the matching records of the store DIR, oldest segment
+   first.  */
+static void
+scan_store (const char *dir)
+{
+  unsigned long *seqs = NULL;
+  size_t i, n = 0, alloc = 0;
+  struct dirent *dent;
+  DIR *dp;
+
+  dp = opendir (dir);
+  if (dp == NULL)
+    error (EXIT_FAILURE, errno, "%s", dir);
+  while ((dent = readdir (dp)) != NULL)
+    {
+      char *end;
+      unsigned long seq = strtoul (dent->d_name, &end, 10);
+
+      if (end != dent->d_name + 8 || strcmp (end, ".log"))
+	continue;
+      if (n == alloc)
+	seqs = x2nrealloc (seqs, &alloc, sizeof (*seqs));
+      seqs[n++] = seq;
+    }
+  closedir (dp);
+
+  qsort (seqs, n, sizeof (*seqs), compare_seq);
+  for (i = 0; i < n; i++)
+    scan_segment (dir, seqs[i]);
+  free (seqs);
+}
+
+/* Decode NAME, a number up to MAX or a name in CODETAB whose value,
+   shifted right by SHIFT bits, is no more than MAX.  */
+static int
+decode (const char *name, CODE *codetab, int shift, int max,
+	const char *what)
+{
+  CODE *cp;
+
+  if (isdigit (*name))
+    {
+      char *end;
+      unsigned long n = strtoul (name, &end, 10);
+
+      if (*end || n > (unsigned long) max)
+	error (EXIT_FAILURE, 0, "invalid %s number: %s", what, name);
+      return n;
+    }
+
+  for (cp = codetab; cp->c_name; cp++)
+    if (strcasecmp (name, cp->c_name) == 0
+	&& cp->c_val >= 0 && (cp->c_val >> shift) <= max)
+      return cp->c_val >> shift;
+
+  error (EXIT_FAILURE, 0, "unknown %s name: %s", what, name);
+  return -1;			/* to pacify gcc */
+}
+
+/* Decode a time given in seconds since the Epoch, or as a local date
+   and time.  */
+static int64_t
+parse_time (const char *arg)
+{
+  static const char *formats[] = {
+    "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M",
+    "%Y-%m-%d", NULL
+  };
+  const char **fmt;
+  struct tm tm;
+  char *end;
+  long long n;
+
+  n = strtoll (arg, &end, 10);
+  if (end != arg && *end == '\0')
+    return n;
+
+  for (fmt = formats; *fmt; fmt++)
+    {
+      memset (&tm, 0, sizeof (tm));
+      end = strptime (arg, *fmt, &tm);
+      if (end && *end == '\0')
+	{
+	  tm.tm_isdst = -1;
+	  return mktime (&tm);
+	}
+    }
+
+  error (EXIT_FAILURE, 0, "invalid time: %s", arg);
+  return 0;			/* to pacify gcc */
+}
+
+const char args_doc[] = "STORE";
+const char doc[] = "Print the messages of a syslogd log store which "
+  "match all of the given conditions.";
+
+static struct argp_option argp_options[] = {
+#define GRP 10
+  {"since", 's', "TIME", 0, "messages logged at TIME or later", GRP},
+  {"until", 'u', "TIME", 0, "messages logged at TIME or earlier", GRP},
+  {"priority", 'p', "LEVEL", 0,
+   "messages of level LEVEL or more severe", GRP},
+  {"facility", 'f', "FACILITY", 0,
+   "messages of FACILITY; may be given several times", GRP},
+  {"host", 'H', "HOST", 0, "messages from HOST", GRP},
+  {"tag", 't', "TAG", 0, "messages tagged with TAG", GRP},
+#undef GRP
+  {NULL, 0, NULL, 0, NULL, 0}
+};
+
+static error_t
+parse_opt (int key, char *arg, struct argp_state *state MAYBE_UNUSED)
+{
+  switch (key)
+    {
+    case 's':
+      since = parse_time (arg);
+      break;
+
+    case 'u':
+      until = parse_time (arg);
+      break;
+
+    case 'p':
+      levels = (2U << decode (arg, (CODE *) prioritynames, 0, LOG_PRIMASK,
+			      "priority")) - 1;
+      break;
+
+    case 'f':
+      if (facilities == UINT32_MAX)
+	facilities = 0;
+      facilities |= 1U << decode (arg, (CODE *) facilitynames, 3,
+				  LOG_NFACILITIES, "facility");
+      break;
+
+    case 'H':
+      host = arg;
+      hostbits = logstore_hash (arg, strlen (arg));
+      break;
+
+    case 't':
+      tag = arg;
+      tagbits = logstore_hash (arg, strlen (arg));
+      break;
+
+    default:
+      return ARGP_ERR_UNKNOWN;
+    }
+
+  return 0;
+}
+
+static struct argp argp =
+  { argp_options, parse_opt, args_doc, doc, NULL, NULL, NULL };
+
+int
+main (int argc, char *argv[])
+{
+  int index;
+
+  set_program_name (argv[0]);
+  iu_argp_init ("logquery", default_program_authors);
+  argp_parse (&argp, argc, argv, 0, &index, NULL);
+
+  if (argc - index != 1)
+    error (EXIT_FAILURE, 0, "exactly one store must be given");
+
+  scan_store (argv[index]);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,272 @@
+/*
+  Copyright (C) 2024 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'. */
+
+/* Print the messages kept by syslogd in a memory ring.  */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <argp.h>
+#include <libinetutils.h>
+#include <progname.h>
+#include <error.h>
+#include <xalloc.h>
+
+#include "logring.h"
+
+static int follow;
+static int lines = -1;
+
+/* The ring as mapped.  Its size is taken once, so that a writer that
+   makes the ring anew cannot lead us out of the mapping.  */
+static const char *ring_name;
+static uint32_t ring_size;
+static dev_t ring_dev;
+static ino_t ring_ino;
+
+/* Copy N bytes at POS in the data area of RING to BUF.  */
+static void
+ring_fetch (struct logring_hdr *ring, uint32_t pos, unsigned char *buf,
+	    size_t n)
+{
+  unsigned char *data = LOGRING_DATA (ring);
+  uint32_t mask = ring_size - 1;
+
+  while (n > 0)
+    {
+      size_t len = ring_size - (pos & mask);
+
+      if (len > n)
+	len = n;
+      memcpy (buf, data + (pos & mask), len);
+      buf += len;
+      pos += len;
+      n -= len;
+    }
+}
+
+/* Read the record at POS into BUF, and return its length.  Return -1
+   if the writer overtook POS meanwhile.  */
+static long
+ring_record (struct logring_hdr *ring, uint32_t pos, unsigned char *buf)
+{
+  uint32_t len;
+
+  ring_fetch (ring, pos, (unsigned char *) &len, sizeof (len));
+  if (LOGRING_RECSIZE (len) > ring_size)
+    len = 0;			/* Torn, and thus rejected below.  */
+  else
+    ring_fetch (ring, pos + 4, buf, len);
+
+  logring_barrier ();
+  if ((int32_t) (pos - ring->tail) < 0)
+    return -1;
+  return len;
+}
+
+/* Return the position of the LINES newest records at most.  */
+static uint32_t
+ring_start (struct logring_hdr *ring, unsigned char *buf)
+{
+  uint32_t pos, head, tail;
+  long count = 0, len;
+
+  tail = ring->tail;
+  if (lines < 0)
+    return tail;
+
+  logring_barrier ();
+  head = ring->head;
+  for (pos = tail; (int32_t) (head - pos) > 0; pos += LOGRING_RECSIZE (len))
+    {
+      len = ring_record (ring, pos, buf);
+      if (len < 0)
+	return ring_start (ring, buf);
+      count++;
+    }
+
+  for (pos = tail; count > lines; count--)
+    {
+      len = ring_record (ring, pos, buf);
+      if (len < 0)
+	return ring_start (ring, buf);
+      pos += LOGRING_RECSIZE (len);
+    }
+  return pos;
+}
+
+/* Map the ring at RING_NAME, and note its size and identity.  */
+static struct logring_hdr *
+ring_map (void)
+{
+  struct logring_hdr *ring;
+  struct stat st;
+  int fd;
+
+  fd = open (ring_name, O_RDONLY);
+  if (fd < 0 || fstat (fd, &st) < 0)
+    error (EXIT_FAILURE, errno, "%s", ring_name);
+  if (st.st_size <= LOGRING_HDRSIZE
+      || st.st_size > (off_t) LOGRING_HDRSIZE + LOGRING_MAXSIZE)
+    error (EXIT_FAILURE, 0, "%s: not a memory ring", ring_name);
+
+  ring = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (ring == MAP_FAILED)
+    error (EXIT_FAILURE, errno, "%s", ring_name);
+  close (fd);
+
+  ring_size = st.st_size - LOGRING_HDRSIZE;
+  ring_dev = st.st_dev;
+  ring_ino = st.st_ino;
+  if (memcmp (ring->magic, LOGRING_MAGIC, sizeof (ring->magic))
+      || ring->size != ring_size || (ring_size & (ring_size - 1)))
+    error (EXIT_FAILURE, 0, "%s: not a memory ring", ring_name);
+  return ring;
+}
+
+/* Return nonzero if RING is no longer the one mapped, for syslogd
+   made a ring of another size and renamed it over RING_NAME.  */
+static int
+ring_changed (struct logring_hdr *ring)
+{
+  struct stat st;
+
+  if (memcmp (ring->magic, LOGRING_MAGIC, sizeof (ring->magic))
+      || ring->size != ring_size)
+    return 1;
+  return stat (ring_name, &st) == 0
+    && (st.st_dev != ring_dev || st.st_ino != ring_ino);
+}
+
+static void
+ring_print (struct logring_hdr *ring)
+{
+  unsigned char *buf = xmalloc (ring_size);
+  uint32_t pos, head;
+  long len;
+
+  pos = ring_start (ring, buf);
+  for (;;)
+    {
+      head = ring->head;
+      logring_barrier ();
+
+      /* The ring was created anew under our feet.  */
+      if ((int32_t) (head - pos) < 0)
+	pos = ring->tail;
+
+      /* Should the writer lap us, the tail we resume from may lie
+	 beyond HEAD; what follows is left to the next round.  */
+      while ((int32_t) (head - pos) > 0)
+	{
+	  len = ring_record (ring, pos, buf);
+	  if (len < 0)
+	    {
+	      pos = ring->tail;
+	      continue;
+	    }
+	  fwrite (buf, 1, len, stdout);
+	  pos += LOGRING_RECSIZE (len);
+	}
+
+      if (!follow)
+	break;
+      fflush (stdout);
+      {
+	struct timespec ts = { 0, 200 * 1000 * 1000 };
+	nanosleep (&ts, NULL);
+      }
+
+      /* Whatever the old ring still held was printed above; go on
+	 with the new one from its start.  */
+      if (ring_changed (ring))
+	{
+	  munmap (ring, LOGRING_HDRSIZE + ring_size);
+	  ring = ring_map ();
+	  buf = xrealloc (buf, ring_size);
+	  pos = ring->tail;
+	}
+    }
+
+  free (buf);
+}
+
+const char args_doc[] = "RING";
+const char doc[] = "Print the messages kept by syslogd in a memory ring.";
+
+static struct argp_option argp_options[] = {
+#define GRP 10
+  {"follow", 'f', NULL, 0, "wait for new messages and print them too", GRP},
+  {"lines", 'n', "N", 0, "print only the N newest messages", GRP},
+#undef GRP
+  {NULL, 0, NULL, 0, NULL, 0}
+};
+
+static error_t
+parse_opt (int key, char *arg, struct argp_state *state)
+{
+  char *end;
+
+  switch (key)
+    {
+    case 'f':
+      follow = 1;
+      break;
+
+    case 'n':
+      lines = strtol (arg, &end, 10);
+      if (*end || lines < 0)
+	argp_error (state, "invalid number of lines: %s", arg);
+      break;
+
+    default:
+      return ARGP_ERR_UNKNOWN;
+    }
+
+  return 0;
+}
+
+static struct argp argp =
+  { argp_options, parse_opt, args_doc, doc, NULL, NULL, NULL };
+
+int
+main (int argc, char *argv[])
+{
+  int index;
+
+  set_program_name (argv[0]);
+  iu_argp_init ("logread", default_program_authors);
+  argp_parse (&argp, argc, argv, 0, &index, NULL);
+
+  if (argc - index != 1)
+    error (EXIT_FAILURE, 0, "exactly one ring must be given");
+
+  ring_name = argv[index];
+  ring_print (ring_map ());
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,70 @@
+/*
+  Copyright (C) 2024 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'.
+ */
+
+/*
+  Layout of the memory ring written by syslogd and read by logread.
+
+  The ring is a file, preferably on tmpfs, mapped by both programs.
+  A header of LOGRING_HDRSIZE bytes precedes the data area, whose
+  size is a power of two.  Records are stored back to back in the
+  data area, each being a 32-bit length followed by that many bytes
+  of text, padded to a multiple of four so that the length never
+  wraps around the end of the area.
+
+  HEAD and TAIL count bytes since the ring was created, modulo 2^32.
+  The single writer first advances TAIL past the records it is going
+  to overwrite, then stores the new record, and finally advances
+  HEAD, with a memory barrier between each step.  A reader copies a
+  record and then checks that TAIL did not move past it meanwhile;
+  otherwise it discards the copy and resumes at TAIL.  No locking is
+  involved, and a reader can never stall the writer.
+ */
+
+#ifndef _IU_LOGRING_H
+# define _IU_LOGRING_H	1
+
+# include <stdint.h>
+
+# define LOGRING_MAGIC	"IUlogrg1"
+# define LOGRING_HDRSIZE 4096
+# define LOGRING_MINSIZE 4096
+# define LOGRING_MAXSIZE (1U << 30)
+
+struct logring_hdr
+{
+  char magic[8];
+  uint32_t size;		/* Size of the data area.  */
+  uint32_t pad;
+  volatile uint32_t head;	/* End of the newest record.  */
+  volatile uint32_t tail;	/* Start of the oldest record.  */
+};
+
+/* Space taken by a record holding LEN bytes of text.  */
+# define LOGRING_RECSIZE(len)	(4 + (((len) + 3) & ~3U))
+
+/* Address of the data area of the ring mapped at HDR.  */
+# define LOGRING_DATA(hdr)	((unsigned char *) (hdr) + LOGRING_HDRSIZE)
+
+# ifdef __GNUC__
+#  define logring_barrier()	__sync_synchronize ()
+# else
+#  define logring_barrier()
+# endif
+
+#endif /* !_IU_LOGRING_H */
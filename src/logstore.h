@@ -0,0 +1,107 @@
+/*
+  Copyright (C) 2024 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'.
+ */
+
+/*
+  Layout of the log store written by syslogd and read by logquery.
+
+  A store is a directory of segments, numbered from one upwards.
+  Segment N consists of two files, both only ever appended to: the
+  records in `N.log', and their index in `N.idx', N having eight
+  decimal digits.  Each file starts with a header of LOGSTORE_HDRSIZE
+  bytes.  syslogd begins a new segment whenever it opens the store,
+  and when the current one grows past its size limit.
+
+  A record is a struct logstore_rec followed by the name of the host,
+  and by the text of the message, whose first TAGLEN bytes are the
+  program tag.  Records are padded to a multiple of eight bytes.
+
+  Records are grouped in blocks of at most LOGSTORE_BLOCK records or
+  LOGSTORE_BLOCKBYTES bytes.  Once a block is complete, a struct
+  logstore_blk describing it is appended to the index: the range of
+  its times, and bitmaps of the facilities, levels, hosts and tags
+  found in it.  Hosts and tags are hashed to two bits each of a
+  64-bit word, so a clear bit rules a block out, while a set bit
+  calls for a look at its records.  A query thus reads only the index
+  and those blocks which may match.  Records written after the last
+  complete block have no index entry yet, and are read in full.
+ */
+
+#ifndef _IU_LOGSTORE_H
+# define _IU_LOGSTORE_H	1
+
+# include <stddef.h>
+# include <stdint.h>
+
+# define LOGSTORE_LOGMAGIC	"IUlogst1"
+# define LOGSTORE_IDXMAGIC	"IUlogix1"
+# define LOGSTORE_HDRSIZE	64
+# define LOGSTORE_BLOCK		256
+# define LOGSTORE_BLOCKBYTES	(64 * 1024)
+
+/* Name of segment N, in a buffer of LOGSTORE_NAMESIZE bytes.  */
+# define LOGSTORE_NAMEFMT	"%08lu.%s"
+# define LOGSTORE_NAMESIZE	16
+
+struct logstore_rec
+{
+  uint32_t size;		/* Of the whole record, with padding.  */
+  uint32_t textlen;
+  int64_t time;			/* Seconds since the Epoch.  */
+  uint16_t pri;			/* Facility and level.  */
+  uint8_t hostlen;
+  uint8_t taglen;
+  uint32_t pad;
+};
+
+struct logstore_blk
+{
+  int64_t first;		/* Earliest time of a record.  */
+  int64_t last;			/* Latest time of a record.  */
+  uint64_t offset;		/* Of the first record in the segment.  */
+  uint32_t count;		/* Records in the block.  */
+  uint32_t facilities;		/* Bit LOG_FAC (pri) of each record.  */
+  uint32_t levels;		/* Bit LOG_PRI (pri) of each record.  */
+  uint32_t size;		/* Bytes taken by the records.  */
+  uint64_t hosts;		/* logstore_hash of each host.  */
+  uint64_t tags;		/* logstore_hash of each tag.  */
+};
+
+/* Space taken by a record of HOSTLEN and TEXTLEN bytes.  */
+# define LOGSTORE_RECSIZE(hostlen, textlen) \
+  ((sizeof (struct logstore_rec) + (hostlen) + (textlen) + 7) & ~(size_t) 7)
+
+/* The two bits of the LEN bytes at S in the bitmaps of hosts and
+   tags.  Case is ignored, as for host names.  */
+static inline uint64_t
+logstore_hash (const char *s, size_t len)
+{
+  uint32_t h = 2166136261U;	/* FNV-1a.  */
+
+  while (len--)
+    {
+      unsigned char c = *s++;
+
+      if (c >= 'A' && c <= 'Z')
+	c += 'a' - 'A';
+      h = (h ^ c) * 16777619U;
+    }
+  return ((uint64_t) 1 << (h & 63)) | ((uint64_t) 1 << ((h >> 6) & 63));
+}
+
+#endif /* !_IU_LOGSTORE_H */
@@ -75,7 +75,6 @@
 #define DEFUPRI		(LOG_USER|LOG_NOTICE)
 #define DEFSPRI		(LOG_KERN|LOG_CRIT)
 #define TIMERINTVL	30	/* Interval for checking flush, mark.  */
-#define TTYMSGTIME      10	/* Time out passed to ttymsg.  */
 
 #include <sys/param.h>
 #include <sys/ioctl.h>
@@ -101,6 +100,7 @@
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
@@ -135,6 +135,41 @@
 #include <progname.h>
 #include <libinetutils.h>
 #include <readutmp.h>		/* May define UTMP_NAME_FUNCTION.  */
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+/* Internet sockets may be served by several receiver threads.  */
+#if defined HAVE_PTHREAD_H && defined SO_REUSEPORT
+# define RECEIVER_THREADS 1
+#endif
+
+/* Logins are followed by a watch on utmp.  */
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+/* Recent messages may be kept in a memory mapped ring.  */
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+# include "logring.h"
+# define MEMORY_RINGS 1
+#endif
+
+/* Messages may be stored with an index, for logquery.  */
+#include "logstore.h"
+
+/* Log files may be compressed on the fly, by a thread of their own.  */
+#if defined HAVE_PTHREAD_H && (defined HAVE_LIBZ || defined HAVE_LIBZSTD)
+# define COMPRESSED_FILES 1
+# ifdef HAVE_LIBZ
+#  include <zlib.h>
+# endif
+# ifdef HAVE_LIBZSTD
+#  include <zstd.h>
+# endif
+#endif
 #include "attribute.h"
 #include "xalloc.h"
 
@@ -151,10 +186,16 @@ char *selector;			/* Program origin to select.  */
 const char *ConfFile = PATH_LOGCONF;	/* Default Configuration file.  */
 const char *ConfDir = PATH_LOGCONFD;	/* Default Configuration directory.  */
 const char *PidFile = PATH_LOGPID;	/* Default path to tuck pid.  */
+const char *StatsFile = PATH_LOGSTATS;	/* Default path for statistics.  */
+#ifdef PATH_KMSG
+const char *KmsgFile = PATH_LOGKMSG;	/* Last kernel record read.  */
+#endif
 char ctty[] = PATH_CONSOLE;	/* Default console to send message info.  */
 
 static int dbg_output;		/* If true, print debug output in debug mode.  */
 static int restart;		/* If 1, indicates SIGHUP was dropped.  */
+static int stats_requested;	/* If 1, indicates SIGUSR2 was dropped.  */
+static int ages_due;		/* If 1, file ages are due for a check.  */
 
 /* Unix socket family to listen.  */
 struct funix
@@ -174,6 +215,76 @@ size_t nfunix;			/* Number of unix sockets in the funix array.  */
 #define ADDDATE		0x004	/* Add a date to the message.  */
 #define MARK		0x008	/* This message is a mark.  */
 
+/* A message decoded once on reception.  All pointers refer into
+   TEXT, which is NUL terminated, so the slices need not be.  */
+
+struct msgdesc
+{
+  int pri;			/* Facility and priority.  */
+  const char *text;		/* The complete message.  */
+  size_t textlen;
+  const char *timestamp;	/* Leading time stamp, or NULL.  */
+  const char *body;		/* Text following any time stamp.  */
+  size_t bodylen;
+  const char *tag;		/* Program name at the start of BODY.  */
+  size_t taglen;
+};
+
+/* Counters of one kind of input.  */
+struct input_stats
+{
+  unsigned long received;	/* Messages.  */
+  unsigned long long bytes;
+  unsigned long truncated;	/* Messages cut at MAXLINE.  */
+  unsigned long errors;		/* Failed receptions, bad priorities.  */
+  unsigned long lost;		/* Messages dropped before reception.  */
+};
+
+/* Kinds of input.  */
+#define IN_KLOG		0
+#define IN_UNIX		1
+#define IN_INET		2
+#define IN_MAX		3
+
+#define CACHELINE	64
+
+/* The input counters of one thread, padded to whole cache lines and
+   aligned on them, so that threads do not write into a common line.  */
+union input_counters
+{
+  struct input_stats in[IN_MAX];
+  char pad[(IN_MAX * sizeof (struct input_stats) + CACHELINE - 1)
+	   / CACHELINE * CACHELINE];
+}
+#ifdef __GNUC__
+__attribute__ ((aligned (CACHELINE)))
+#endif
+  ;
+
+#define LATBUCKETS	16
+
+/* Counters of one destination.  Bucket I of LATENCY counts writes
+   which took less than 2^I microseconds, and at least half as long.
+   The last bucket takes all slower writes.  */
+struct output_stats
+{
+  unsigned long written;	/* Messages.  */
+  unsigned long long bytes;
+  unsigned long dropped;	/* Messages lost to errors or suspension.  */
+  unsigned long suspended;	/* Seconds spent suspended.  */
+  unsigned long latency[LATBUCKETS];
+};
+
+/* Rotation policy of a regular file, and the state it depends on.  */
+struct rotation
+{
+  off_t limit;			/* Size to rotate at, or 0.  */
+  time_t maxage;		/* Age to rotate at, or 0.  */
+  int keep;			/* Number of rotated files kept.  */
+  off_t size;			/* Bytes written to the file.  */
+  time_t begun;			/* When the file was begun.  */
+};
+
 /* This structure represents the files that will have log copies
    printed.  */
 
@@ -209,6 +320,15 @@ struct filed
   int f_prevcount;		/* Repetition cnt of prevline.  */
   size_t f_repeatcount;		/* Number of "repeated" msgs.  */
   int f_flags;			/* Additional flags see below.  */
+  int f_codec;			/* Compression method, see below.  */
+  struct zfile *f_zf;		/* Compressor of F_ZFILE.  */
+  size_t f_ringsize;		/* Requested size of F_RING.  */
+  struct logring_hdr *f_ring;	/* Mapping of F_RING.  */
+  size_t f_storesize;		/* Segment size of F_STORE.  */
+  struct logstore *f_store;	/* Writer of F_STORE.  */
+  struct rotation f_rot;	/* Of F_FILE and F_ZFILE.  */
+  struct rotation *f_rotp;	/* In use, shared by entries of a file.  */
+  struct output_stats f_stats;	/* Counters for statistics.  */
 };
 
 struct filed *Files;		/* Linked list of files to log to.  */
@@ -225,6 +345,9 @@ struct filed consfile;		/* Console `file'.  */
 #define F_FORW_SUSP	7	/* Suspended host forwarding.  */
 #define F_FORW_UNKN	8	/* Unknown host forwarding.  */
 #define F_PIPE		9	/* Named pipe.  */
+#define F_ZFILE		10	/* Compressed regular file.  */
+#define F_RING		11	/* Memory ring.  */
+#define F_STORE		12	/* Indexed log store.  */
 
 const char *TypeNames[] = {
   "UNUSED",
@@ -236,11 +359,48 @@ const char *TypeNames[] = {
   "WALL",
   "FORW(SUSPENDED)",
   "FORW(UNKNOWN)",
-  "PIPE"
+  "PIPE",
+  "ZFILE",
+  "RING",
+  "STORE"
 };
 
 /* Flags in filed.f_flags.  */
 #define OMIT_SYNC	0x001	/* Omit fsync after printing.  */
+#define ADOPTED		0x002	/* Descriptor handed to a new entry.  */
+
+/* Values for filed.f_codec.  */
+#define ZCODEC_NONE	0
+#define ZCODEC_GZIP	1
+#define ZCODEC_ZSTD	2
+
+#ifdef COMPRESSED_FILES
+static struct zfile *zfile_open (int fd, int codec);
+static int zfile_write (struct zfile *zf, struct iovec *iov, int iovcnt);
+static void zfile_close (struct zfile *zf);
+static size_t zfile_pending (struct zfile *zf);
+#endif
+
+#ifdef MEMORY_RINGS
+# define RINGSIZE	(1024 * 1024)	/* Default size of memory rings.  */
+
+static struct logring_hdr *ring_open (int fd, size_t size);
+static void ring_write (struct logring_hdr *ring, struct iovec *iov,
+			int iovcnt);
+static void ring_close (struct logring_hdr *ring);
+#endif
+
+#define STORESIZE	(64 * 1024 * 1024)	/* Default segment size.  */
+
+static struct logstore *store_open (const char *dir, size_t size);
+static int store_write (struct logstore *st, int pri, const char *host,
+			const char *text, size_t len);
+static void store_close (struct logstore *st);
+
+#define ROTATEKEEP	5	/* Default number of rotated files.  */
+
+static void rotate_file (struct filed *f);
+static void rotate_aged (void);
 
 /* Constants for the F_FORW_UNKN retry feature.  */
 #define INET_SUSPEND_TIME 180	/* Number of seconds between attempts.  */
@@ -265,6 +425,8 @@ extern int waitdaemon (int nochdir, int noclose, int maxwait);
 
 void cfline (const char *, struct filed *);
 const char *cvthname (struct sockaddr *, socklen_t);
+static const char *cvthname_r (struct sockaddr *, socklen_t,
+			       char[INET6_ADDRSTRLEN], char[NI_MAXHOST]);
 int decode (const char *, CODE *);
 void die (int);
 void doexit (int);
@@ -276,17 +438,27 @@ static int load_confdir (const char *, struct filed **);
 void init (int);
 void logerror (const char *);
 void logmsg (int, const char *, const char *, int);
-void printline (const char *, const char *);
+void logmsg_desc (const struct msgdesc *, const char *, int);
+int printline (const char *, const char *, size_t);
+static int parse_line (const char *, size_t, char *, struct msgdesc *);
 void printsys (const char *);
-void wallmsg (struct filed *, struct iovec *);
+#ifdef PATH_KMSG
+static void kmsg_start (void);
+static int kmsg_read (int);
+#endif
+int wallmsg (struct filed *, struct iovec *);
+static int utty_init (void);
+static void utty_notified (void);
+static void utty_flush (void);
 char **crunch_list (char **oldlist, char *list);
 char *textpri (int pri);
 void dbg_toggle (int);
 static void dbg_printf (const char *, ...);
 void trigger_restart (int);
+void trigger_stats (int);
 static void add_funix (const char *path);
 static int create_unix_socket (const char *path);
-static void create_inet_socket (int af, int fd46[2]);
+static void create_inet_socket (int af, int fd46[2], int reuseport);
 
 char *LocalHostName;		/* Our hostname.  */
 char *LocalDomain;		/* Our local domain name.  */
@@ -307,6 +479,8 @@ int finet[2] = { -1, -1 };	/* Internet datagram socket fd.  */
 #define IU_FD_IP4	0	/* Indices for the address families.  */
 #define IU_FD_IP6	1
 int fklog = -1;			/* Kernel log device fd.  */
+int KlogRecords;		/* Fklog is PATH_KMSG, read by record.  */
+int utty_notify = -1;		/* Notification of utmp changes.  */
 char *LogPortText = NULL;	/* Service/port for INET connections.  */
 char *LogForwardPort = NULL;	/* Target port for message forwarding.  */
 int Initialized;		/* True when we are initialized. */
@@ -328,6 +502,43 @@ int force_sync;			/* GNU/Linux behaviour to sync on every line.
 				   This off by default. Set to 1 to enable.  */
 int set_local_time = 0;		/* Record local time, not message time.  */
 
+/* Per-source rate limiting.  */
+unsigned long RateLimit;	/* Messages per second, or 0 for none.  */
+unsigned long RateBurst;	/* Messages allowed in a burst.  */
+
+static void rate_init (void);
+static int rate_allow_inet (struct sockaddr *);
+static int rate_allow_unix (pid_t, uid_t);
+static void rate_report (void);
+
+/* Input counters of the main thread.  */
+static union input_counters MainInput;
+
+/* Outcomes of an output, for its counters.  */
+#define OUT_NONE	0	/* Nothing was due.  */
+#define OUT_WRITTEN	1
+#define OUT_DROPPED	2
+
+static unsigned long long stats_clock (void);
+static void input_count (struct input_stats *, size_t);
+static void output_count (struct output_stats *, int, struct iovec *,
+			  unsigned long long);
+static void stats_dump (void);
+
+#ifdef RECEIVER_THREADS
+int InetThreads;		/* Number of receiver threads per family.  */
+
+/* Union of all priority masks in the configuration.  Receiver threads
+   read it without locking, to discard unwanted messages early.  A stale
+   value merely delays the effect of a reload.  */
+volatile unsigned char SelectMask[LOG_NFACILITIES + 1];
+
+static int rxwake[2] = { -1, -1 };	/* Wakes up the main loop.  */
+
+static void start_receivers (int fd46[2]);
+static void drain_receivers (void);
+#endif
+
 const char args_doc[] = "";
 const char doc[] = "Log system messages.";
 
@@ -337,7 +548,11 @@ enum
   OPT_NO_FORWARD = 256,
   OPT_NO_KLOG,
   OPT_NO_UNIXAF,
-  OPT_IPANY
+  OPT_IPANY,
+  OPT_INET_THREADS,
+  OPT_RATE_LIMIT,
+  OPT_STATS_FILE,
+  OPT_KMSG_FILE
 };
 
 static struct argp_option argp_options[] = {
@@ -361,12 +576,20 @@ static struct argp_option argp_options[] = {
    GRP + 1},
   {"bind", 'b', "ADDR", 0, "bind listener to this address/name", GRP + 1},
   {"bind-port", 'B', "PORT", 0, "bind listener to this port", GRP + 1},
+#ifdef RECEIVER_THREADS
+  {"inet-threads", OPT_INET_THREADS, "NUM", 0, "receive remote messages "
+   "with NUM threads per address family (default 0, the main thread)",
+   GRP + 1},
+#endif
   {"mark", 'm', "INTVL", 0, "specify timestamp interval in minutes"
    " (0 for no timestamping)", GRP + 1},
   {"no-detach", 'n', NULL, 0, "do not enter daemon mode", GRP + 1},
   {"no-forward", OPT_NO_FORWARD, NULL, 0, "do not forward any messages "
    "(overrides --hop)", GRP + 1},
-#ifdef PATH_KLOG
+#if defined PATH_KMSG
+  {"no-klog", OPT_NO_KLOG, NULL, 0, "do not listen to kernel log device "
+   PATH_KMSG, GRP + 1},
+#elif defined PATH_KLOG
   {"no-klog", OPT_NO_KLOG, NULL, 0, "do not listen to kernel log device "
    PATH_KLOG, GRP + 1},
 #endif
@@ -374,6 +597,12 @@ static struct argp_option argp_options[] = {
    "sockets (overrides -a and -p)", GRP + 1},
   {"pidfile", 'P', "FILE", 0, "override pidfile (default: "
    PATH_LOGPID ")", GRP + 1},
+  {"stats-file", OPT_STATS_FILE, "FILE", 0, "write statistics to FILE "
+   "on SIGUSR2 (default: " PATH_LOGSTATS ")", GRP + 1},
+#ifdef PATH_KMSG
+  {"kmsg-file", OPT_KMSG_FILE, "FILE", 0, "note the last kernel message "
+   "read in FILE (default: " PATH_LOGKMSG ")", GRP + 1},
+#endif
   {"rcfile", 'f', "FILE", 0, "override configuration file (default: "
    PATH_LOGCONF ")",
    GRP + 1},
@@ -384,6 +613,9 @@ static struct argp_option argp_options[] = {
   {"sync", 'S', NULL, 0, "force a file sync on every line", GRP + 1},
   {"local-time", 'T', NULL, 0, "set local time on received messages",
    GRP + 1},
+  {"rate-limit", OPT_RATE_LIMIT, "RATE[,BURST]", 0, "accept at most RATE "
+   "messages per second from each source, and BURST in excess (default "
+   "RATE)", GRP + 1},
 #undef GRP
   {NULL, 0, NULL, 0, NULL, 0}
 };
@@ -441,6 +673,15 @@ parse_opt (int key, char *arg, struct argp_state *state)
       BindPort = arg;
       break;
 
+#ifdef RECEIVER_THREADS
+    case OPT_INET_THREADS:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 0)
+	argp_error (state, "invalid value (`%s' near `%s')", arg, endptr);
+      InetThreads = v;
+      break;
+#endif
+
     case 'm':
       v = strtol (arg, &endptr, 10);
       if (*endptr)
@@ -468,6 +709,16 @@ parse_opt (int key, char *arg, struct argp_state *state)
       PidFile = arg;
       break;
 
+    case OPT_STATS_FILE:
+      StatsFile = arg;
+      break;
+
+#ifdef PATH_KMSG
+    case OPT_KMSG_FILE:
+      KmsgFile = arg;
+      break;
+#endif
+
     case 'f':
       ConfFile = arg;
       break;
@@ -489,6 +740,15 @@ parse_opt (int key, char *arg, struct argp_state *state)
       set_local_time = 1;
       break;
 
+    case OPT_RATE_LIMIT:
+      RateLimit = strtoul (arg, &endptr, 10);
+      RateBurst = RateLimit;
+      if (*endptr == ',')
+	RateBurst = strtoul (endptr + 1, &endptr, 10);
+      if (*endptr || RateLimit == 0 || RateBurst == 0)
+	argp_error (state, "invalid value (`%s' near `%s')", arg, endptr);
+      break;
+
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -527,6 +787,10 @@ main (int argc, char *argv[])
   /* Check desired port, if in demand at all.  */
   find_inet_port (BindPort);
 
+  /* Before any receiver thread may look at it.  */
+  if (RateLimit)
+    rate_init ();
+
   /* Daemonise, if not, set the buffering for line buffer.  */
   if (!NoDetach)
     {
@@ -614,17 +878,38 @@ main (int argc, char *argv[])
 
   alarm (TIMERINTVL);
 
-  /* We add  3 = 1(klog) + 2(inet,inet6), even if they may stay unused.  */
-  fdarray = (struct pollfd *) malloc ((nfunix + 3) * sizeof (*fdarray));
+  /* We add  4 = 1(klog) + 1(utmp) + 2(inet,inet6), even if they may
+     stay unused.  */
+  fdarray = (struct pollfd *) malloc ((nfunix + 4) * sizeof (*fdarray));
   if (fdarray == NULL)
     error (EXIT_FAILURE, errno, "can't allocate fd table");
 
   /* read configuration file */
   init (0);
 
+#ifdef PATH_KMSG
+  /* Prefer the structured kernel log, which hands out whole records.
+     It is read until empty at each wakeup, and must not block.  */
+  if (!NoKLog)
+    {
+      fklog = open (PATH_KMSG, O_RDONLY | O_NONBLOCK, 0);
+      if (fklog >= 0)
+	{
+	  kmsg_start ();
+	  KlogRecords = 1;
+	  fdarray[nfds].fd = fklog;
+	  fdarray[nfds].events = POLLIN | POLLPRI;
+	  nfds++;
+	  dbg_printf ("Klog open %s\n", PATH_KMSG);
+	}
+      else
+	dbg_printf ("Can't open %s: %s\n", PATH_KMSG, strerror (errno));
+    }
+#endif
+
 #ifdef PATH_KLOG
   /* Initialize kernel logging and add to the list.  */
-  if (!NoKLog)
+  if (!NoKLog && fklog < 0)
     {
       fklog = open (PATH_KLOG, O_RDONLY, 0);
       if (fklog >= 0)
@@ -639,6 +924,14 @@ main (int argc, char *argv[])
     }
 #endif
 
+  /* Follow the logins, for messages to users.  */
+  if (utty_init () >= 0)
+    {
+      fdarray[nfds].fd = utty_notify;
+      fdarray[nfds].events = POLLIN;
+      nfds++;
+    }
+
   /* Initialize unix sockets.  */
   if (!NoUnixAF)
     {
@@ -661,7 +954,21 @@ main (int argc, char *argv[])
   /* Initialize inet socket and add it to the list.  */
   if (AcceptRemote)
     {
-      create_inet_socket (usefamily, finet);
+#ifdef RECEIVER_THREADS
+      create_inet_socket (usefamily, finet, InetThreads > 0);
+      if (InetThreads > 0
+	  && (finet[IU_FD_IP4] >= 0 || finet[IU_FD_IP6] >= 0))
+	{
+	  /* The threads serve the sockets, the main loop their output.  */
+	  start_receivers (finet);
+	  fdarray[nfds].fd = rxwake[0];
+	  fdarray[nfds].events = POLLIN;
+	  nfds++;
+	}
+      else
+#else
+      create_inet_socket (usefamily, finet, 0);
+#endif
       if (finet[IU_FD_IP4] >= 0)
 	{
 	  /* IPv4 socket is present.  */
@@ -696,8 +1003,11 @@ main (int argc, char *argv[])
   /* `sa' has been cleared already.  */
   sa.sa_handler = trigger_restart;
   (void) sigaction (SIGHUP, &sa, NULL);
+  sa.sa_handler = trigger_stats;
+  (void) sigaction (SIGUSR2, &sa, NULL);
 #else /* !HAVE_SIGACTION */
   signal (SIGHUP, trigger_restart);
+  signal (SIGUSR2, trigger_stats);
 #endif
 
   if (NoDetach)
@@ -715,8 +1025,9 @@ main (int argc, char *argv[])
 
   for (;;)
     {
-      int nready;
+      int nready, pollerr;
       nready = poll (fdarray, nfds, -1);
+      pollerr = errno;		/* The work below may change errno.  */
       if (nready == 0)		/* ??  noop */
 	continue;
 
@@ -729,8 +1040,26 @@ main (int argc, char *argv[])
 	  continue;
 	}
 
+      if (stats_requested)
+	{
+	  stats_requested = 0;
+	  stats_dump ();
+	}
+
+      if (ages_due)
+	{
+	  ages_due = 0;
+	  rotate_aged ();
+	}
+
+      if (RateLimit)
+	rate_report ();
+
+      utty_flush ();
+
       if (nready < 0)
 	{
+	  errno = pollerr;
 	  if (errno != EINTR)
 	    logerror ("poll");
 	  continue;
@@ -745,6 +1074,13 @@ main (int argc, char *argv[])
 	    socklen_t len;
 	    if (fdarray[i].fd == -1)
 	      continue;
+#ifdef PATH_KMSG
+	    else if (fdarray[i].fd == fklog && KlogRecords)
+	      {
+		if (kmsg_read (fklog) < 0)
+		  fdarray[i].fd = fklog = -1;
+	      }
+#endif
 	    else if (fdarray[i].fd == fklog)
 	      {
 		result = read (fdarray[i].fd, &kline[kline_len],
@@ -753,9 +1089,11 @@ main (int argc, char *argv[])
 		if (result > 0)
 		  {
 		    kline_len += result;
+		    MainInput.in[IN_KLOG].bytes += result;
 		  }
 		else if (result < 0 && errno != EINTR)
 		  {
+		    MainInput.in[IN_KLOG].errors++;
 		    logerror ("klog");
 		    fdarray[i].fd = fklog = -1;
 		  }
@@ -805,6 +1143,7 @@ main (int argc, char *argv[])
 			 * overfills our buffer.  The best we can do is
 			 * log it in pieces.
 			 */
+			MainInput.in[IN_KLOG].truncated++;
 			printsys (kline);
 
 			/* Clone priority signal if present
@@ -823,38 +1162,91 @@ main (int argc, char *argv[])
 		      }
 		  }
 	      }
+#ifdef RECEIVER_THREADS
+	    else if (fdarray[i].fd == rxwake[0])
+	      drain_receivers ();
+#endif
+	    else if (fdarray[i].fd == utty_notify)
+	      utty_notified ();
 	    else if (fdarray[i].fd == finet[IU_FD_IP4]
 		     || fdarray[i].fd == finet[IU_FD_IP6])
 	      {
 		struct sockaddr_storage frominet;
 		/*dbg_printf ("inet message\n"); */
 		len = sizeof (frominet);
-		memset (line, '\0', sizeof (line));
 		result = recvfrom (fdarray[i].fd, line, MAXLINE, 0,
 				   (struct sockaddr *) &frominet, &len);
 		if (result > 0)
+		  input_count (&MainInput.in[IN_INET], result);
+		if (result > 0
+		    && (!RateLimit
+			|| rate_allow_inet ((struct sockaddr *) &frominet)))
 		  {
-		    line[result] = '\0';
-		    printline (cvthname ((struct sockaddr *) &frominet, len),
-			       line);
+		    if (printline (cvthname ((struct sockaddr *) &frominet,
+					     len), line, result))
+		      MainInput.in[IN_INET].errors++;
 		  }
 		else if (result < 0 && errno != EINTR)
-		  logerror ("recvfrom inet");
+		  {
+		    MainInput.in[IN_INET].errors++;
+		    logerror ("recvfrom inet");
+		  }
 	      }
 	    else
 	      {
 		struct sockaddr_un fromunix;
+		pid_t pid = 0;
+		uid_t uid = 0;
 		/*dbg_printf ("unix message\n"); */
 		len = sizeof (fromunix);
-		result = recvfrom (fdarray[i].fd, line, MAXLINE, 0,
-				   (struct sockaddr *) &fromunix, &len);
+#ifdef SCM_CREDENTIALS
+		if (RateLimit)
+		  {
+		    union
+		    {
+		      struct cmsghdr cm;
+		      char buf[CMSG_SPACE (sizeof (struct ucred))];
+		    } control;
+		    struct cmsghdr *cmsg;
+		    struct msghdr mh;
+		    struct iovec iov;
+
+		    iov.iov_base = line;
+		    iov.iov_len = MAXLINE;
+		    memset (&mh, 0, sizeof (mh));
+		    mh.msg_iov = &iov;
+		    mh.msg_iovlen = 1;
+		    mh.msg_control = &control;
+		    mh.msg_controllen = sizeof (control);
+		    result = recvmsg (fdarray[i].fd, &mh, 0);
+		    for (cmsg = CMSG_FIRSTHDR (&mh); result > 0 && cmsg;
+			 cmsg = CMSG_NXTHDR (&mh, cmsg))
+		      if (cmsg->cmsg_level == SOL_SOCKET
+			  && cmsg->cmsg_type == SCM_CREDENTIALS)
+			{
+			  struct ucred cred;
+
+			  memcpy (&cred, CMSG_DATA (cmsg), sizeof (cred));
+			  pid = cred.pid;
+			  uid = cred.uid;
+			}
+		  }
+		else
+#endif /* SCM_CREDENTIALS */
+		  result = recvfrom (fdarray[i].fd, line, MAXLINE, 0,
+				     (struct sockaddr *) &fromunix, &len);
 		if (result > 0)
+		  input_count (&MainInput.in[IN_UNIX], result);
+		if (result > 0 && (!RateLimit || rate_allow_unix (pid, uid)))
 		  {
-		    line[result] = '\0';
-		    printline (LocalHostName, line);
+		    if (printline (LocalHostName, line, result))
+		      MainInput.in[IN_UNIX].errors++;
 		  }
 		else if (result < 0 && errno != EINTR)
-		  logerror ("recvfrom unix");
+		  {
+		    MainInput.in[IN_UNIX].errors++;
+		    logerror ("recvfrom unix");
+		  }
 	      }
 	  }
 	else if (fdarray[i].revents & POLLNVAL)
@@ -908,6 +1300,16 @@ create_unix_socket (const char *path)
   sunx.sun_family = AF_UNIX;
   strncpy (sunx.sun_path, path, sizeof (sunx.sun_path) - 1);
   fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+#ifdef SO_PASSCRED
+  if (fd >= 0 && RateLimit)
+    {
+      int yes = 1;
+
+      /* Have the sender's credentials accompany each message.  */
+      if (setsockopt (fd, SOL_SOCKET, SO_PASSCRED, &yes, sizeof (yes)) < 0)
+	logerror ("failed to set SO_PASSCRED");
+    }
+#endif
   if (fd < 0 || bind (fd, (struct sockaddr *) &sunx, SUN_LEN (&sunx)) < 0
       || chmod (path, 0666) < 0)
     {
@@ -920,8 +1322,10 @@ create_unix_socket (const char *path)
   return fd;
 }
 
+/* Open the datagram sockets for inet reception.  With REUSEPORT set,
+   further sockets may later be bound to the same address.  */
 static void
-create_inet_socket (int af, int fd46[2])
+create_inet_socket (int af, int fd46[2], int reuseport)
 {
   int err, fd = -1;
   struct addrinfo hints, *rp, *ai;
@@ -959,6 +1363,15 @@ create_inet_socket (int af, int fd46[2])
       if (err < 0)
 	logerror ("failed to set SO_REUSEADDR");
 
+#ifdef SO_REUSEPORT
+      if (reuseport
+	  && setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &yes,
+			 sizeof (yes)) < 0)
+	logerror ("failed to set SO_REUSEPORT");
+#else
+      (void) reuseport;
+#endif
+
       if (ai->ai_family == AF_INET6)
 	{
 	  /* Avoid dual stacked sockets.  Better to use distinct sockets.  */
@@ -988,157 +1401,1654 @@ create_inet_socket (int af, int fd46[2])
   return;
 }
 
-char **
-crunch_list (char **oldlist, char *list)
-{
-  int count, i;
-  char *p, *q;
+#ifdef RECEIVER_THREADS
+/* A receiver thread hands its messages to the main thread through a
+   ring of RX_QUEUE_LEN slots.  The lock of the ring only guards the
+   two positions; slots are filled and emptied outside of it, so the
+   threads never contend on a common lock.  A thread finding its ring
+   full waits, leaving further messages in the socket buffer.  */
 
-  p = list;
+#define RX_QUEUE_LEN	256
 
-  /* Strip off trailing delimiters.  */
-  while (p[strlen (p) - 1] == LIST_DELIMITER)
-    {
-      p[strlen (p) - 1] = '\0';
-    }
-  /* Cut off leading delimiters.  */
-  while (p[0] == LIST_DELIMITER)
-    {
-      p++;
-    }
+struct rxslot
+{
+  struct msgdesc md;
+  const char *from;		/* Points into ADDR or NAME.  */
+  char addr[INET6_ADDRSTRLEN];
+  char name[NI_MAXHOST];
+  char line[MAXLINE + 1];
+};
 
-  /* Bailout early the string is empty.  */
-  if (*p == '\0')
-    return oldlist;
+struct receiver
+{
+  pthread_t thread;
+  int fd;			/* Socket served by this thread.  */
+  pthread_mutex_t lock;
+  pthread_cond_t space;		/* Signalled when slots are freed.  */
+  size_t head;			/* Next slot to consume.  */
+  size_t tail;			/* Next slot to fill.  */
+  struct rxslot slot[RX_QUEUE_LEN];
+  union input_counters stats;	/* Written by the thread alone.  */
+};
 
-  /* Count delimiters to calculate elements.  */
-  for (count = 1, i = 0; p[i]; i++)
-    if (p[i] == LIST_DELIMITER)
-      count++;
+static struct receiver **receivers;
+static size_t nreceivers;
 
-  /* Count how many we add in the old list.  */
-  for (i = 0; oldlist && oldlist[i]; i++)
-    ;
+static void *
+receive_inet (void *arg)
+{
+  struct receiver *rx = arg;
+  char buf[MAXLINE + 1];
 
-  /* allocate enough space */
-  oldlist = (char **) realloc (oldlist, (i + count + 1) * sizeof (*oldlist));
-  if (oldlist == NULL)
-    error (EXIT_FAILURE, errno, "can't allocate memory");
+  for (;;)
+    {
+      struct sockaddr_storage frominet;
+      struct rxslot *slot;
+      socklen_t len;
+      ssize_t result;
+      size_t tail;
+      int wake;
+
+      len = sizeof (frominet);
+      result = recvfrom (rx->fd, buf, MAXLINE, 0,
+			 (struct sockaddr *) &frominet, &len);
+      if (result < 0)
+	{
+	  struct timespec ts = { 0, 100 * 1000 * 1000 };
 
-  /*
-     We now can assume that the first and last
-     characters are different from any delimiters,
-     so we don't have to care about it anymore.  */
+	  if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+	    continue;
+	  rx->stats.in[IN_INET].errors++;
+	  dbg_printf ("recvfrom inet: %s\n", strerror (errno));
+	  /* The socket is gone.  */
+	  if (errno == EBADF || errno == ENOTSOCK)
+	    break;
+	  /* Lest a lasting error, say ENOMEM, keep the thread spinning.  */
+	  nanosleep (&ts, NULL);
+	  continue;
+	}
+      if (result == 0)
+	continue;
+      input_count (&rx->stats.in[IN_INET], result);
 
-  /* Start from where we left last time.  */
-  for (count = i; (q = strchr (p, LIST_DELIMITER)) != NULL;
-       count++, p = q, p++)
-    {
-      oldlist[count] = (char *) malloc ((q - p + 1) * sizeof (char));
-      if (oldlist[count] == NULL)
-	error (EXIT_FAILURE, errno, "can't allocate memory");
+      if (RateLimit
+	  && !rate_allow_inet ((struct sockaddr *) &frominet))
+	continue;
 
-      strncpy (oldlist[count], p, q - p);
-      oldlist[count][q - p] = '\0';
-    }
+      pthread_mutex_lock (&rx->lock);
+      while (rx->tail - rx->head == RX_QUEUE_LEN)
+	pthread_cond_wait (&rx->space, &rx->lock);
+      tail = rx->tail;
+      pthread_mutex_unlock (&rx->lock);
 
-  /* take the last one */
-  oldlist[count] = (char *) xmalloc ((strlen (p) + 1) * sizeof (char));
-  if (oldlist[count] == NULL)
-    error (EXIT_FAILURE, errno, "can't allocate memory");
+      slot = &rx->slot[tail % RX_QUEUE_LEN];
+      if (parse_line (buf, result, slot->line, &slot->md))
+	rx->stats.in[IN_INET].errors++;
 
-  strcpy (oldlist[count], p);
+      /* Skip messages that no selector would accept.  */
+      if (!(SelectMask[LOG_FAC (slot->md.pri)]
+	    & LOG_MASK (LOG_PRI (slot->md.pri))))
+	continue;
 
-  oldlist[++count] = NULL;	/* terminate the array with a NULL */
+      slot->from = cvthname_r ((struct sockaddr *) &frominet, len,
+			       slot->addr, slot->name);
 
-  if (Debug)
-    {
-      for (count = 0; oldlist[count]; count++)
-	printf ("#%d: %s\n", count, oldlist[count]);
+      pthread_mutex_lock (&rx->lock);
+      wake = (rx->head == tail);
+      rx->tail = tail + 1;
+      pthread_mutex_unlock (&rx->lock);
+
+      if (wake)
+	(void) write (rxwake[1], "", 1);
     }
-  return oldlist;
+
+  return NULL;
 }
 
-/* Take a raw input line, decode the message, and print the message on
-   the appropriate log files.  */
-void
-printline (const char *hname, const char *msg)
+static void
+add_receiver (int fd)
 {
-  int c, pri;
-  const char *p;
-  char *q, line[MAXLINE + 1];
+  struct receiver *rx;
+  sigset_t sigs, osigs;
+  int err;
 
-  /* test for special codes */
-  pri = DEFUPRI;
-  p = msg;
-  if (*p == '<')
-    {
-      pri = 0;
-      while (isdigit (*++p))
-	pri = 10 * pri + (*p - '0');
-      if (*p == '>')
-	++p;
-    }
+  /* Aligned for the sake of the counters within.  */
+#ifdef HAVE_POSIX_MEMALIGN
+  if (posix_memalign ((void **) &rx, CACHELINE, sizeof (*rx)))
+    rx = NULL;
+  else
+    memset (rx, 0, sizeof (*rx));
+#else
+  rx = calloc (1, sizeof (*rx));
+#endif
+  receivers = realloc (receivers, (nreceivers + 1) * sizeof (*receivers));
+  if (rx == NULL || receivers == NULL)
+    error (EXIT_FAILURE, errno, "cannot allocate receiver thread");
+
+  rx->fd = fd;
+  pthread_mutex_init (&rx->lock, NULL);
+  pthread_cond_init (&rx->space, NULL);
+
+  /* Signals are to be handled by the main thread alone.  */
+  sigfillset (&sigs);
+  pthread_sigmask (SIG_BLOCK, &sigs, &osigs);
+  err = pthread_create (&rx->thread, NULL, receive_inet, rx);
+  pthread_sigmask (SIG_SETMASK, &osigs, NULL);
+  if (err)
+    error (EXIT_FAILURE, err, "cannot create receiver thread");
 
-  /* This overrides large positive and overflowing negative values.  */
-  if (pri & ~(LOG_FACMASK | LOG_PRIMASK))
-    pri = DEFUPRI;
+  receivers[nreceivers++] = rx;
+}
 
-  /* Avoid undefined facilities.  */
-  if (LOG_FAC (pri) > LOG_NFACILITIES)
-    pri = DEFUPRI;
+/* Serve the sockets FD46, and InetThreads - 1 further sockets per
+   address family bound alongside them, each with a thread of its own.
+   FD46 stay in place for forwarding.  */
+static void
+start_receivers (int fd46[2])
+{
+  int i, fd[2];
 
-  /* Do not allow users to log kernel messages.  */
-  if (LOG_FAC (pri) == (LOG_KERN >> 3))
-    pri = LOG_MAKEPRI (LOG_USER, LOG_PRI (pri));
+  if (pipe (rxwake) < 0)
+    error (EXIT_FAILURE, errno, "cannot create pipe");
+  fcntl (rxwake[0], F_SETFL, O_NONBLOCK);
+  fcntl (rxwake[1], F_SETFL, O_NONBLOCK);
 
-  q = line;
-  while ((c = *p++) != '\0' && q < &line[sizeof (line) - 1])
-    if (iscntrl (c))
-      if (c == '\n')
-	*q++ = ' ';
-      else if (c == '\t')
-	*q++ = '\t';
-      else if (c >= 0177)
-	*q++ = c;
-      else
+  for (i = 0; i < InetThreads; i++)
+    {
+      if (i == 0)
 	{
-	  *q++ = '^';
-	  *q++ = c ^ 0100;
+	  fd[IU_FD_IP4] = fd46[IU_FD_IP4];
+	  fd[IU_FD_IP6] = fd46[IU_FD_IP6];
 	}
-    else
-      *q++ = c;
-  *q = '\0';
+      else
+	create_inet_socket (usefamily, fd, 1);
 
-  /* This for the default behaviour on GNU/Linux syslogd who
-     sync on every line.  */
-  if (force_sync)
-    logmsg (pri, line, hname, SYNC_FILE);
-  else
-    logmsg (pri, line, hname, 0);
+      if (fd[IU_FD_IP4] >= 0)
+	add_receiver (fd[IU_FD_IP4]);
+      if (fd[IU_FD_IP6] >= 0)
+	add_receiver (fd[IU_FD_IP6]);
+    }
+
+  dbg_printf ("Started %zu inet receiver threads.\n", nreceivers);
 }
 
-/* Take a raw input line from /dev/klog, split and format similar to
-   syslog().  */
-void
-printsys (const char *msg)
+/* Log everything the receiver threads have queued.  */
+static void
+drain_receivers (void)
 {
-  int c, pri, flags;
-  char *lp, *q, line[MAXLINE + 1];
-  const char *p;
+  char buf[64];
+  size_t i;
 
-  strcpy (line, "vmunix: ");
-  lp = line + strlen (line);
-  for (p = msg; *p != '\0';)
+  while (read (rxwake[0], buf, sizeof (buf)) > 0)
+    ;
+
+  for (i = 0; i < nreceivers; i++)
     {
-      flags = SYNC_FILE | ADDDATE;	/* Fsync after write.  */
-      pri = DEFSPRI;
-      if (*p == '<')
+      struct receiver *rx = receivers[i];
+      size_t head, tail;
+
+      for (;;)
 	{
-	  pri = 0;
-	  while (isdigit (*++p))
-	    pri = 10 * pri + (*p - '0');
-	  if (*p == '>')
+	  pthread_mutex_lock (&rx->lock);
+	  head = rx->head;
+	  tail = rx->tail;
+	  pthread_mutex_unlock (&rx->lock);
+
+	  if (head == tail)
+	    break;
+
+	  for (; head != tail; head++)
+	    {
+	      struct rxslot *slot = &rx->slot[head % RX_QUEUE_LEN];
+
+	      logmsg_desc (&slot->md, slot->from,
+			   force_sync ? SYNC_FILE : 0);
+	    }
+
+	  pthread_mutex_lock (&rx->lock);
+	  rx->head = tail;
+	  pthread_cond_signal (&rx->space);
+	  pthread_mutex_unlock (&rx->lock);
+	}
+    }
+}
+#endif /* RECEIVER_THREADS */
+
+/* Per-source rate limiting.  Every source owns a token bucket, which
+   is refilled with RateLimit tokens per second up to RateBurst tokens,
+   and each message spends one token.  Sources are internet addresses,
+   or for unix sockets the process and user identity of the sender.
+   The buckets are spread over RL_SHARDS independently locked hash
+   tables, so that receiver threads rarely meet.  Each table tracks at
+   most RL_MAX_SOURCES sources; the remainder share one bucket.  */
+
+#define RL_SHARDS	16
+#define RL_CHAINS	64
+#define RL_MAX_SOURCES	1024
+#define RL_KEYLEN	20
+#define RL_TOKEN	1000	/* One message, in thousandths.  */
+
+struct ratesrc
+{
+  struct ratesrc *next;
+  unsigned char key[RL_KEYLEN];
+  unsigned long long tokens;	/* Thousandths of messages.  */
+  unsigned long long stamp;	/* Time of last refill, in ms.  */
+  unsigned long suppressed;	/* Messages dropped since last report.  */
+  char label[INET6_ADDRSTRLEN + 32];	/* Printable source.  */
+};
+
+struct rateshard
+{
+#ifdef RECEIVER_THREADS
+  pthread_mutex_t lock;
+#endif
+  size_t count;
+  struct ratesrc *chain[RL_CHAINS];
+  struct ratesrc other;		/* Shared by sources beyond the limit.  */
+};
+
+static struct rateshard *rate_shards;
+
+#ifdef RECEIVER_THREADS
+# define RL_LOCK(sh)	pthread_mutex_lock (&(sh)->lock)
+# define RL_UNLOCK(sh)	pthread_mutex_unlock (&(sh)->lock)
+#else
+# define RL_LOCK(sh)	((void) 0)
+# define RL_UNLOCK(sh)	((void) 0)
+#endif
+
+/* Milliseconds on a clock that does not jump.  */
+static unsigned long long
+rate_clock (void)
+{
+#if defined CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+#endif
+  return time (NULL) * 1000ULL;
+}
+
+static void
+rate_init (void)
+{
+  size_t i;
+
+  rate_shards = calloc (RL_SHARDS, sizeof (*rate_shards));
+  if (rate_shards == NULL)
+    error (EXIT_FAILURE, errno, "cannot allocate rate limit table");
+
+  for (i = 0; i < RL_SHARDS; i++)
+    {
+#ifdef RECEIVER_THREADS
+      pthread_mutex_init (&rate_shards[i].lock, NULL);
+#endif
+      rate_shards[i].other.tokens = RateBurst * RL_TOKEN;
+      rate_shards[i].other.stamp = rate_clock ();
+      strcpy (rate_shards[i].other.label, "other sources");
+    }
+}
+
+/* Describe the source identified by KEY in LABEL, of SIZE bytes.  */
+static void
+rate_label (const unsigned char key[RL_KEYLEN], char *label, size_t size)
+{
+  pid_t pid;
+  uid_t uid;
+
+  switch (key[0])
+    {
+    case AF_INET:
+    case AF_INET6:
+      if (!inet_ntop (key[0], key + 4, label, size))
+	snprintf (label, size, "???");
+      break;
+
+    default:
+      memcpy (&pid, key + 4, sizeof (pid));
+      memcpy (&uid, key + 12, sizeof (uid));
+      if (pid)
+	snprintf (label, size, "pid %lu (uid %lu)",
+		  (unsigned long) pid, (unsigned long) uid);
+      else
+	snprintf (label, size, "local sockets");
+    }
+}
+
+/* Charge one message to the source identified by KEY.  Return zero
+   if the message is to be suppressed.  */
+static int
+rate_allow (const unsigned char key[RL_KEYLEN])
+{
+  struct rateshard *sh;
+  struct ratesrc *src;
+  unsigned long long now_ms, h = 14695981039346656037ULL;
+  size_t i, chain;
+  int allow;
+
+  /* FNV-1a.  */
+  for (i = 0; i < RL_KEYLEN; i++)
+    h = (h ^ key[i]) * 1099511628211ULL;
+
+  sh = &rate_shards[h % RL_SHARDS];
+  chain = (h / RL_SHARDS) % RL_CHAINS;
+  now_ms = rate_clock ();
+
+  RL_LOCK (sh);
+  for (src = sh->chain[chain]; src; src = src->next)
+    if (!memcmp (src->key, key, RL_KEYLEN))
+      break;
+
+  if (src == NULL)
+    {
+      if (sh->count < RL_MAX_SOURCES
+	  && (src = calloc (1, sizeof (*src))) != NULL)
+	{
+	  memcpy (src->key, key, RL_KEYLEN);
+	  rate_label (key, src->label, sizeof (src->label));
+	  src->tokens = RateBurst * RL_TOKEN;
+	  src->stamp = now_ms;
+	  src->next = sh->chain[chain];
+	  sh->chain[chain] = src;
+	  sh->count++;
+	}
+      else
+	src = &sh->other;
+    }
+
+  src->tokens += (now_ms - src->stamp) * RateLimit;
+  if (src->tokens > RateBurst * RL_TOKEN)
+    src->tokens = RateBurst * RL_TOKEN;
+  src->stamp = now_ms;
+
+  allow = (src->tokens >= RL_TOKEN);
+  if (allow)
+    src->tokens -= RL_TOKEN;
+  else
+    src->suppressed++;
+  RL_UNLOCK (sh);
+
+  return allow;
+}
+
+static int
+rate_allow_inet (struct sockaddr *sa)
+{
+  unsigned char key[RL_KEYLEN];
+
+  /* The source port is disregarded.  */
+  memset (key, 0, sizeof (key));
+  key[0] = sa->sa_family;
+  if (sa->sa_family == AF_INET)
+    memcpy (key + 4, &((struct sockaddr_in *) sa)->sin_addr, 4);
+  else if (sa->sa_family == AF_INET6)
+    memcpy (key + 4, &((struct sockaddr_in6 *) sa)->sin6_addr, 16);
+
+  return rate_allow (key);
+}
+
+static int
+rate_allow_unix (pid_t pid, uid_t uid)
+{
+  unsigned char key[RL_KEYLEN];
+
+  memset (key, 0, sizeof (key));
+  key[0] = AF_UNIX;
+  memcpy (key + 4, &pid, sizeof (pid));
+  memcpy (key + 12, &uid, sizeof (uid));
+
+  return rate_allow (key);
+}
+
+/* A count of suppressed messages, taken out of a shard so that it is
+   logged without holding the lock.  */
+struct ratesum
+{
+  unsigned long suppressed;
+  char label[sizeof (((struct ratesrc *) 0)->label)];
+};
+
+/* Move the count of messages suppressed from SRC to SUMS[*N].  */
+static void
+rate_summary (struct ratesrc *src, struct ratesum *sums, size_t *n)
+{
+  if (!src->suppressed || sums == NULL)
+    return;
+
+  sums[*n].suppressed = src->suppressed;
+  memcpy (sums[*n].label, src->label, sizeof (sums[*n].label));
+  src->suppressed = 0;
+  (*n)++;
+}
+
+/* Log, at most every TIMERINTVL seconds, how many messages have been
+   suppressed from each source, and forget idle sources.  */
+static void
+rate_report (void)
+{
+  static time_t last;
+  unsigned long long now_ms;
+  struct ratesum *sums;
+  char buf[128];
+  time_t t;
+  size_t i, j, n;
+
+  t = time (NULL);
+  if (rate_shards == NULL || t - last < TIMERINTVL)
+    return;
+  last = t;
+  now_ms = rate_clock ();
+
+  for (i = 0; i < RL_SHARDS; i++)
+    {
+      struct rateshard *sh = &rate_shards[i];
+
+      /* Should memory be short, the counts are reported next time.  */
+      n = 0;
+      RL_LOCK (sh);
+      sums = malloc ((sh->count + 1) * sizeof (*sums));
+      rate_summary (&sh->other, sums, &n);
+      for (j = 0; j < RL_CHAINS; j++)
+	{
+	  struct ratesrc *src, **srcp = &sh->chain[j];
+
+	  while ((src = *srcp) != NULL)
+	    {
+	      rate_summary (src, sums, &n);
+
+	      /* A source that has been quiet long enough to refill
+	         its bucket is as good as new.  */
+	      if ((now_ms - src->stamp) * RateLimit >= RateBurst * RL_TOKEN)
+		{
+		  *srcp = src->next;
+		  free (src);
+		  sh->count--;
+		}
+	      else
+		srcp = &src->next;
+	    }
+	}
+      RL_UNLOCK (sh);
+
+      for (j = 0; j < n; j++)
+	{
+	  snprintf (buf, sizeof (buf),
+		    "syslogd: %lu messages suppressed from %s",
+		    sums[j].suppressed, sums[j].label);
+	  logmsg (LOG_SYSLOG | LOG_WARNING, buf, LocalHostName, ADDDATE);
+	}
+      free (sums);
+    }
+}
+
+#ifdef COMPRESSED_FILES
+/* Compressed log files.  The main thread appends formatted lines to
+   the input buffer of a struct zfile, and a thread of its own runs
+   the compressor and writes the result.  The stream is flushed every
+   ZFLUSHINTVL seconds, so that the file may be followed with, say,
+   `zcat -f' and survives a crash up to the last flush.  Closing
+   completes the stream; a file reopened later receives another one,
+   which both gzip and zstd accept as a continuation.  */
+
+#define ZFLUSHINTVL	5		/* Seconds between flushes.  */
+#define ZCHUNK		(64 * 1024)	/* Input that wakes the thread.  */
+#define ZMAXPENDING	(16 * ZCHUNK)	/* Input the thread may lag by.  */
+
+enum zmode
+{
+  ZMODE_CONTINUE,
+  ZMODE_FLUSH,
+  ZMODE_FINISH
+};
+
+struct zfile
+{
+  int fd;
+  int codec;
+#ifdef HAVE_LIBZ
+  z_stream zs;
+#endif
+#ifdef HAVE_LIBZSTD
+  ZSTD_CStream *zcs;
+#endif
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;		/* Signalled when input is due.  */
+  pthread_cond_t drained;	/* Signalled when input was taken.  */
+  char *in;			/* Input, guarded by LOCK.  */
+  size_t inlen, insize;
+  char *work;			/* Input being compressed.  */
+  size_t worksize;
+  int stop;			/* Set to finish the stream.  */
+  int err;			/* Errno of a failed write.  */
+  char out[ZCHUNK];
+};
+
+/* Write LEN bytes of compressed output.  */
+static int
+zfile_output (struct zfile *zf, const char *buf, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t n = write (zf->fd, buf, len);
+
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      buf += n;
+      len -= n;
+    }
+  return 0;
+}
+
+/* Feed LEN bytes at BUF to the compressor.  */
+static int
+zfile_compress (struct zfile *zf, const char *buf, size_t len,
+		enum zmode mode)
+{
+#ifdef HAVE_LIBZ
+  if (zf->codec == ZCODEC_GZIP)
+    {
+      int flush = (mode == ZMODE_FINISH) ? Z_FINISH
+	: (mode == ZMODE_FLUSH) ? Z_FULL_FLUSH : Z_NO_FLUSH;
+
+      zf->zs.next_in = (Bytef *) buf;
+      zf->zs.avail_in = len;
+      do
+	{
+	  int ret;
+
+	  zf->zs.next_out = (Bytef *) zf->out;
+	  zf->zs.avail_out = sizeof (zf->out);
+	  ret = deflate (&zf->zs, flush);
+	  if (ret == Z_STREAM_ERROR)
+	    {
+	      errno = EIO;
+	      return -1;
+	    }
+	  if (zfile_output (zf, zf->out, sizeof (zf->out) - zf->zs.avail_out))
+	    return -1;
+	}
+      while (zf->zs.avail_out == 0);
+      return 0;
+    }
+#endif
+#ifdef HAVE_LIBZSTD
+  if (zf->codec == ZCODEC_ZSTD)
+    {
+      ZSTD_EndDirective end = (mode == ZMODE_FINISH) ? ZSTD_e_end
+	: (mode == ZMODE_FLUSH) ? ZSTD_e_flush : ZSTD_e_continue;
+      ZSTD_inBuffer input = { buf, len, 0 };
+      size_t remaining;
+
+      do
+	{
+	  ZSTD_outBuffer output = { zf->out, sizeof (zf->out), 0 };
+
+	  remaining = ZSTD_compressStream2 (zf->zcs, &output, &input, end);
+	  if (ZSTD_isError (remaining))
+	    {
+	      errno = EIO;
+	      return -1;
+	    }
+	  if (zfile_output (zf, zf->out, output.pos))
+	    return -1;
+	}
+      while (end == ZSTD_e_continue ? input.pos < input.size
+	     : remaining != 0);
+      return 0;
+    }
+#endif
+  errno = EINVAL;
+  return -1;
+}
+
+static void *
+zfile_run (void *arg)
+{
+  struct zfile *zf = arg;
+  time_t flushed = time (NULL);
+  int dirty = 0;
+
+  pthread_mutex_lock (&zf->lock);
+  for (;;)
+    {
+      struct timespec ts;
+      enum zmode mode;
+      size_t len, size;
+      char *tmp;
+      int stop;
+
+      if (!zf->stop && zf->inlen < ZCHUNK)
+	{
+	  ts.tv_sec = (dirty ? flushed : time (NULL)) + ZFLUSHINTVL;
+	  ts.tv_nsec = 0;
+	  pthread_cond_timedwait (&zf->wakeup, &zf->lock, &ts);
+	}
+
+      /* Take the input, leaving an empty buffer behind.  */
+      tmp = zf->work;
+      zf->work = zf->in;
+      zf->in = tmp;
+      size = zf->worksize;
+      zf->worksize = zf->insize;
+      zf->insize = size;
+      len = zf->inlen;
+      zf->inlen = 0;
+      stop = zf->stop;
+      pthread_cond_signal (&zf->drained);
+      pthread_mutex_unlock (&zf->lock);
+
+      if (stop)
+	mode = ZMODE_FINISH;
+      else if ((dirty || len) && time (NULL) - flushed >= ZFLUSHINTVL)
+	mode = ZMODE_FLUSH;
+      else
+	mode = ZMODE_CONTINUE;
+
+      if ((len || mode != ZMODE_CONTINUE)
+	  && zfile_compress (zf, zf->work, len, mode) < 0)
+	{
+	  pthread_mutex_lock (&zf->lock);
+	  zf->err = errno;
+	  pthread_cond_signal (&zf->drained);
+	  break;
+	}
+
+      dirty = (mode == ZMODE_CONTINUE) ? (dirty || len) : 0;
+      if (mode != ZMODE_CONTINUE)
+	flushed = time (NULL);
+
+      pthread_mutex_lock (&zf->lock);
+      if (stop)
+	break;
+    }
+  pthread_mutex_unlock (&zf->lock);
+
+  return NULL;
+}
+
+static void
+zfile_release (struct zfile *zf)
+{
+#ifdef HAVE_LIBZ
+  if (zf->codec == ZCODEC_GZIP)
+    deflateEnd (&zf->zs);
+#endif
+#ifdef HAVE_LIBZSTD
+  if (zf->codec == ZCODEC_ZSTD)
+    ZSTD_freeCStream (zf->zcs);
+#endif
+  pthread_mutex_destroy (&zf->lock);
+  pthread_cond_destroy (&zf->wakeup);
+  pthread_cond_destroy (&zf->drained);
+  free (zf->in);
+  free (zf->work);
+  free (zf);
+}
+
+/* Start compressing to FD with CODEC.  FD is not closed on failure.  */
+static struct zfile *
+zfile_open (int fd, int codec)
+{
+  struct zfile *zf;
+  sigset_t sigs, osigs;
+  int err;
+
+  zf = calloc (1, sizeof (*zf));
+  if (zf == NULL)
+    return NULL;
+  zf->fd = fd;
+  zf->codec = codec;
+
+#ifdef HAVE_LIBZ
+  if (codec == ZCODEC_GZIP
+      && deflateInit2 (&zf->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		       15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      free (zf);
+      errno = ENOMEM;
+      return NULL;
+    }
+#endif
+#ifdef HAVE_LIBZSTD
+  if (codec == ZCODEC_ZSTD && (zf->zcs = ZSTD_createCStream ()) == NULL)
+    {
+      free (zf);
+      errno = ENOMEM;
+      return NULL;
+    }
+#endif
+
+  pthread_mutex_init (&zf->lock, NULL);
+  pthread_cond_init (&zf->wakeup, NULL);
+  pthread_cond_init (&zf->drained, NULL);
+
+  sigfillset (&sigs);
+  pthread_sigmask (SIG_BLOCK, &sigs, &osigs);
+  err = pthread_create (&zf->thread, NULL, zfile_run, zf);
+  pthread_sigmask (SIG_SETMASK, &osigs, NULL);
+  if (err)
+    {
+      zfile_release (zf);
+      errno = err;
+      return NULL;
+    }
+
+  return zf;
+}
+
+/* Queue the line in IOV for compression.  Should the thread lag
+   behind, wait for it rather than lose the line.  */
+static int
+zfile_write (struct zfile *zf, struct iovec *iov, int iovcnt)
+{
+  size_t len = 0;
+  int i, err;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+
+  pthread_mutex_lock (&zf->lock);
+  while (zf->err == 0 && zf->inlen > 0 && zf->inlen + len > ZMAXPENDING)
+    {
+      pthread_cond_signal (&zf->wakeup);
+      pthread_cond_wait (&zf->drained, &zf->lock);
+    }
+  err = zf->err;
+  if (err == 0)
+    {
+      if (zf->inlen + len > zf->insize)
+	{
+	  size_t size = zf->insize ? zf->insize : ZCHUNK;
+	  char *p;
+
+	  while (size < zf->inlen + len)
+	    size *= 2;
+	  p = realloc (zf->in, size);
+	  if (p == NULL)
+	    {
+	      pthread_mutex_unlock (&zf->lock);
+	      return -1;
+	    }
+	  zf->in = p;
+	  zf->insize = size;
+	}
+      for (i = 0; i < iovcnt; i++)
+	{
+	  memcpy (zf->in + zf->inlen, iov[i].iov_base, iov[i].iov_len);
+	  zf->inlen += iov[i].iov_len;
+	}
+      if (zf->inlen >= ZCHUNK)
+	pthread_cond_signal (&zf->wakeup);
+    }
+  pthread_mutex_unlock (&zf->lock);
+
+  if (err)
+    {
+      errno = err;
+      return -1;
+    }
+  return 0;
+}
+
+/* Return the number of bytes waiting for compression.  */
+static size_t
+zfile_pending (struct zfile *zf)
+{
+  size_t len;
+
+  pthread_mutex_lock (&zf->lock);
+  len = zf->inlen;
+  pthread_mutex_unlock (&zf->lock);
+  return len;
+}
+
+/* Complete the stream, and release ZF together with its file.  */
+static void
+zfile_close (struct zfile *zf)
+{
+  pthread_mutex_lock (&zf->lock);
+  zf->stop = 1;
+  pthread_cond_signal (&zf->wakeup);
+  pthread_mutex_unlock (&zf->lock);
+  pthread_join (zf->thread, NULL);
+
+  close (zf->fd);
+  zfile_release (zf);
+}
+#endif /* COMPRESSED_FILES */
+
+#ifdef MEMORY_RINGS
+/* Memory rings, see logring.h for the layout.  The ring is mapped
+   shared, so that records are visible to readers as soon as they are
+   stored, without any system call on the way.  */
+
+/* Return SIZE rounded up to the power of two used for a data area.  */
+static uint32_t
+ring_datasize (size_t size)
+{
+  uint32_t n;
+
+  for (n = LOGRING_MINSIZE; n < size && n < LOGRING_MAXSIZE; n *= 2)
+    ;
+  return n;
+}
+
+/* Map the ring in FD, with a data area of SIZE bytes rounded up to a
+   power of two.  Records of a former ring of the same size are kept,
+   should its header be consistent.  */
+static struct logring_hdr *
+ring_open (int fd, size_t size)
+{
+  struct logring_hdr *ring;
+  struct stat st;
+  uint32_t n = ring_datasize (size);
+
+  if (fstat (fd, &st) < 0)
+    return NULL;
+  if (st.st_size != (off_t) LOGRING_HDRSIZE + n
+      && ftruncate (fd, (off_t) LOGRING_HDRSIZE + n) < 0)
+    return NULL;
+
+  ring = mmap (NULL, LOGRING_HDRSIZE + n, PROT_READ | PROT_WRITE,
+	       MAP_SHARED, fd, 0);
+  if (ring == MAP_FAILED)
+    return NULL;
+
+  if (memcmp (ring->magic, LOGRING_MAGIC, sizeof (ring->magic))
+      || ring->size != n || ring->head - ring->tail > n
+      || (ring->head & 3) || (ring->tail & 3))
+    {
+      dbg_printf ("initializing ring of %lu bytes\n", (unsigned long) n);
+      memset (ring->magic, 0, sizeof (ring->magic));
+      logring_barrier ();
+      ring->size = n;
+      ring->head = ring->tail = 0;
+      logring_barrier ();
+      memcpy (ring->magic, LOGRING_MAGIC, sizeof (ring->magic));
+    }
+
+  return ring;
+}
+
+/* Store N bytes at P in the data area of RING, starting at POS.  */
+static uint32_t
+ring_store (struct logring_hdr *ring, uint32_t pos, const void *p, size_t n)
+{
+  unsigned char *data = LOGRING_DATA (ring);
+  uint32_t mask = ring->size - 1;
+  size_t len;
+
+  while (n > 0)
+    {
+      len = ring->size - (pos & mask);
+      if (len > n)
+	len = n;
+      memcpy (data + (pos & mask), p, len);
+      p = (const char *) p + len;
+      pos += len;
+      n -= len;
+    }
+  return pos;
+}
+
+/* Append the line in IOV to RING as a single record, discarding the
+   oldest records to make room.  */
+static void
+ring_write (struct logring_hdr *ring, struct iovec *iov, int iovcnt)
+{
+  unsigned char *data = LOGRING_DATA (ring);
+  uint32_t mask = ring->size - 1;
+  uint32_t head = ring->head, tail = ring->tail, len = 0, pos;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  if (LOGRING_RECSIZE (len) > ring->size)
+    len = ring->size - 4;
+
+  /* Readers must learn that a record is gone before it is touched.  */
+  if (head + LOGRING_RECSIZE (len) - tail > ring->size)
+    {
+      do
+	{
+	  uint32_t oldlen;
+
+	  memcpy (&oldlen, data + (tail & mask), sizeof (oldlen));
+	  tail += LOGRING_RECSIZE (oldlen);
+	}
+      while (head + LOGRING_RECSIZE (len) - tail > ring->size);
+      ring->tail = tail;
+      logring_barrier ();
+    }
+
+  memcpy (data + (head & mask), &len, sizeof (len));
+  pos = head + 4;
+  for (i = 0; i < iovcnt && pos - head - 4 < len; i++)
+    {
+      size_t n = iov[i].iov_len;
+
+      if (n > len - (pos - head - 4))
+	n = len - (pos - head - 4);
+      pos = ring_store (ring, pos, iov[i].iov_base, n);
+    }
+
+  logring_barrier ();
+  ring->head = head + LOGRING_RECSIZE (len);
+}
+
+static void
+ring_close (struct logring_hdr *ring)
+{
+  munmap (ring, LOGRING_HDRSIZE + ring->size);
+}
+
+/* Open the ring at PATH, with a data area of SIZE bytes, and store its
+   mapping in *RINGP.  A ring of another size is not truncated in
+   place, from under readers that have it mapped, but made aside and
+   renamed over PATH.  Return its descriptor, or -1 with errno set.  */
+static int
+ring_file_open (const char *path, size_t size, struct logring_hdr **ringp)
+{
+  struct stat st;
+  char *tmp;
+  int fd, e;
+
+  fd = open (path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return -1;
+  if (fstat (fd, &st) == 0
+      && (st.st_size == 0
+	  || st.st_size == (off_t) LOGRING_HDRSIZE + ring_datasize (size)))
+    {
+      *ringp = ring_open (fd, size);
+      if (*ringp != NULL)
+	return fd;
+    }
+  e = errno;
+  close (fd);
+  errno = e;
+
+  tmp = malloc (strlen (path) + sizeof (".XXXXXX"));
+  if (tmp == NULL)
+    return -1;
+  sprintf (tmp, "%s.XXXXXX", path);
+  fd = mkstemp (tmp);
+  if (fd >= 0)
+    {
+      fchmod (fd, 0644);
+      *ringp = ring_open (fd, size);
+      if (*ringp == NULL || rename (tmp, path) < 0)
+	{
+	  e = errno;
+	  if (*ringp != NULL)
+	    ring_close (*ringp);
+	  close (fd);
+	  unlink (tmp);
+	  fd = -1;
+	  errno = e;
+	}
+    }
+  free (tmp);
+  return fd;
+}
+#endif /* MEMORY_RINGS */
+
+/* Log stores, see logstore.h for the layout.  Records go to the
+   segment with a single writev(2) each, as lines go to a plain file.
+   The summary of the current block is kept in memory, and costs one
+   more write to the index once the block is complete.  */
+
+struct logstore
+{
+  char *dir;
+  int fd;			/* Records of the current segment.  */
+  int idx;			/* Index of the current segment.  */
+  unsigned long seq;		/* Number of the current segment.  */
+  uint64_t size;		/* Bytes in the current segment.  */
+  uint64_t limit;		/* Size at which a new segment begins.  */
+  struct logstore_blk blk;	/* Summary of the current block.  */
+};
+
+/* Open segment file SUFFIX of ST afresh, with its header, and return
+   its descriptor.  */
+static int
+store_create (struct logstore *st, const char *suffix, const char *magic)
+{
+  char hdr[LOGSTORE_HDRSIZE];
+  char *path;
+  int fd;
+
+  path = malloc (strlen (st->dir) + 1 + LOGSTORE_NAMESIZE);
+  if (path == NULL)
+    return -1;
+  sprintf (path, "%s/" LOGSTORE_NAMEFMT, st->dir, st->seq, suffix);
+  fd = open (path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0644);
+  free (path);
+  if (fd < 0)
+    return -1;
+
+  memset (hdr, 0, sizeof (hdr));
+  memcpy (hdr, magic, 8);
+  if (write (fd, hdr, sizeof (hdr)) != sizeof (hdr))
+    {
+      int e = errno;
+
+      close (fd);
+      errno = e ? e : ENOSPC;
+      return -1;
+    }
+  return fd;
+}
+
+/* Put the descriptor NEWFD in place of *FD, keeping its number when
+   there is one, so that the owner of the store may rely on it.  */
+static void
+store_replace (int *fd, int newfd)
+{
+  if (*fd < 0)
+    *fd = newfd;
+  else
+    {
+      dup2 (newfd, *fd);
+      close (newfd);
+    }
+}
+
+/* Begin the segment after the current one of ST.  */
+static int
+store_segment (struct logstore *st)
+{
+  int fd, idx;
+
+  st->seq++;
+  fd = store_create (st, "log", LOGSTORE_LOGMAGIC);
+  if (fd < 0)
+    return -1;
+  idx = store_create (st, "idx", LOGSTORE_IDXMAGIC);
+  if (idx < 0)
+    {
+      int e = errno;
+
+      close (fd);
+      errno = e;
+      return -1;
+    }
+
+  store_replace (&st->fd, fd);
+  store_replace (&st->idx, idx);
+  st->size = LOGSTORE_HDRSIZE;
+  st->blk.count = 0;
+  dbg_printf ("store %s: segment %lu\n", st->dir, st->seq);
+  return 0;
+}
+
+/* Append the summary of the current block of ST to the index.  */
+static int
+store_flush (struct logstore *st)
+{
+  if (st->blk.count == 0)
+    return 0;
+  if (write (st->idx, &st->blk, sizeof (st->blk)) != sizeof (st->blk))
+    {
+      if (errno == 0)
+	errno = ENOSPC;
+      return -1;
+    }
+  st->blk.count = 0;
+  return 0;
+}
+
+/* Open the store in the directory DIR, beginning a new segment after
+   those already present.  Segments grow to about SIZE bytes.  */
+static struct logstore *
+store_open (const char *dir, size_t size)
+{
+  struct logstore *st;
+  struct dirent *dent;
+  DIR *dp;
+
+  dp = opendir (dir);
+  if (dp == NULL)
+    return NULL;
+
+  st = calloc (1, sizeof (*st));
+  if (st == NULL || (st->dir = strdup (dir)) == NULL)
+    {
+      free (st);
+      closedir (dp);
+      errno = ENOMEM;
+      return NULL;
+    }
+  st->fd = st->idx = -1;
+  st->limit = size;
+
+  while ((dent = readdir (dp)) != NULL)
+    {
+      char *end;
+      unsigned long n = strtoul (dent->d_name, &end, 10);
+
+      if (end == dent->d_name + 8 && !strcmp (end, ".log") && n > st->seq)
+	st->seq = n;
+    }
+  closedir (dp);
+
+  if (store_segment (st) < 0)
+    {
+      int e = errno;
+
+      free (st->dir);
+      free (st);
+      errno = e;
+      return NULL;
+    }
+  return st;
+}
+
+/* Append a record of priority PRI for the message TEXT of LEN bytes
+   from HOST to ST.  */
+static int
+store_write (struct logstore *st, int pri, const char *host,
+	     const char *text, size_t len)
+{
+  static const char zeros[8];
+  struct logstore_blk *blk = &st->blk;
+  struct logstore_rec rec;
+  struct iovec iov[4];
+  const char *p, *end;
+  size_t hostlen;
+  ssize_t n;
+
+  hostlen = strlen (host);
+  if (hostlen > UINT8_MAX)
+    hostlen = UINT8_MAX;
+
+  /* The program tag ends as it does for selectors.  */
+  for (p = text, end = text + (len < UINT8_MAX ? len : UINT8_MAX);
+       p < end && *p != ':' && *p != '[' && *p != ' '; p++)
+    ;
+
+  memset (&rec, 0, sizeof (rec));
+  rec.size = LOGSTORE_RECSIZE (hostlen, len);
+  rec.textlen = len;
+  rec.time = now;
+  rec.pri = pri;
+  rec.hostlen = hostlen;
+  rec.taglen = p - text;
+
+  if (st->size + rec.size > st->limit && st->size > LOGSTORE_HDRSIZE
+      && (store_flush (st) < 0 || store_segment (st) < 0))
+    return -1;
+
+  iov[0].iov_base = &rec;
+  iov[0].iov_len = sizeof (rec);
+  iov[1].iov_base = (char *) host;
+  iov[1].iov_len = hostlen;
+  iov[2].iov_base = (char *) text;
+  iov[2].iov_len = len;
+  iov[3].iov_base = (char *) zeros;
+  iov[3].iov_len = rec.size - sizeof (rec) - hostlen - len;
+
+  n = writev (st->fd, iov, 4);
+  if (n != (ssize_t) rec.size)
+    {
+      if (n >= 0)
+	errno = ENOSPC;		/* Readers stop at the torn record.  */
+      return -1;
+    }
+
+  if (blk->count == 0)
+    {
+      memset (blk, 0, sizeof (*blk));
+      blk->offset = st->size;
+      blk->first = blk->last = rec.time;
+    }
+  else if (rec.time < blk->first)
+    blk->first = rec.time;
+  else if (rec.time > blk->last)
+    blk->last = rec.time;
+  blk->count++;
+  blk->size += rec.size;
+  blk->facilities |= 1U << LOG_FAC (pri);
+  blk->levels |= 1U << LOG_PRI (pri);
+  blk->hosts |= logstore_hash (host, hostlen);
+  blk->tags |= logstore_hash (text, rec.taglen);
+  st->size += rec.size;
+
+  if (blk->count == LOGSTORE_BLOCK
+      || st->size - blk->offset >= LOGSTORE_BLOCKBYTES)
+    return store_flush (st);
+  return 0;
+}
+
+/* Index the last block of ST and close it.  */
+static void
+store_close (struct logstore *st)
+{
+  store_flush (st);
+  close (st->fd);
+  close (st->idx);
+  free (st->dir);
+  free (st);
+}
+
+/* Name of the rotated file N of F.  The suffix of a compressed file
+   stays last, as in `messages.1.gz'.  */
+static char *
+rotated_name (const struct filed *f, int n)
+{
+  const char *name = f->f_un.f_fname, *suffix = "";
+  size_t len = strlen (name);
+  char *p;
+
+  if (f->f_codec != ZCODEC_NONE)
+    {
+      const char *dot = strrchr (name, '.');
+
+      if (dot && dot > strrchr (name, '/')
+	  && (!strcmp (dot, ".gz") || !strcmp (dot, ".zst")))
+	{
+	  suffix = dot;
+	  len = dot - name;
+	}
+    }
+
+  p = xmalloc (len + strlen (suffix) + 16);
+  sprintf (p, "%.*s.%d%s", (int) len, name, n, suffix);
+  return p;
+}
+
+/* Return when the file of F, with status ST, was begun: when the
+   newest rotated file was last written to, or lacking one, when the
+   file itself last changed.  */
+static time_t
+rotation_begun (const struct filed *f, const struct stat *st)
+{
+  struct stat rst;
+  time_t t = st->st_ctime;
+  char *name;
+
+  if (f->f_rot.keep > 0)
+    {
+      name = rotated_name (f, 1);
+      if (stat (name, &rst) == 0)
+	t = rst.st_mtime;
+      free (name);
+    }
+  return t;
+}
+
+/* Rotate the file of F: rename it, shifting the files rotated before,
+   and open it anew, for every entry writing to it.  No message is
+   lost, since all output is done by the main thread.  Should the new
+   file fail to open, writing goes on to the renamed one.  */
+static void
+rotate_file (struct filed *f)
+{
+  struct filed *g;
+  char *from, *to;
+  int i, fd, err;
+
+  dbg_printf ("rotating %s\n", f->f_un.f_fname);
+
+  /* Messages about failures come back here, and must not recurse.  */
+  f->f_rotp->size = 0;
+  f->f_rotp->begun = now;
+
+  for (i = f->f_rotp->keep; i > 1; i--)
+    {
+      from = rotated_name (f, i - 1);
+      to = rotated_name (f, i);
+      if (rename (from, to) < 0 && errno != ENOENT)
+	logerror (from);
+      free (from);
+      free (to);
+    }
+
+  if (f->f_rotp->keep > 0)
+    {
+      to = rotated_name (f, 1);
+      err = rename (f->f_un.f_fname, to);
+      free (to);
+    }
+  else
+    err = unlink (f->f_un.f_fname);
+  if (err < 0)
+    {
+      logerror (f->f_un.f_fname);
+      return;
+    }
+
+  fd = open (f->f_un.f_fname, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd < 0)
+    {
+      logerror (f->f_un.f_fname);
+      return;
+    }
+
+#ifdef COMPRESSED_FILES
+  if (f->f_type == F_ZFILE)
+    {
+      struct zfile *zf = zfile_open (fd, f->f_codec);
+
+      if (zf == NULL)
+	{
+	  logerror (f->f_un.f_fname);
+	  close (fd);
+	  return;
+	}
+      zfile_close (f->f_zf);	/* Completes the rotated file.  */
+      f->f_zf = zf;
+      f->f_file = fd;
+      return;
+    }
+#endif
+
+  /* Keep the numbers of the descriptors, which the entries own.  */
+  for (g = Files; g; g = g->f_next)
+    if (g->f_rotp == f->f_rotp && g->f_type == F_FILE)
+      dup2 (fd, g->f_file);
+  close (fd);
+}
+
+/* Rotate the files which have grown older than their policy allows.
+   Files with nothing written to them are left alone.  */
+static void
+rotate_aged (void)
+{
+  struct filed *f;
+#ifdef HAVE_SIGACTION
+  sigset_t sigs, osigs;
+
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGHUP);
+  sigaddset (&sigs, SIGALRM);
+  sigprocmask (SIG_BLOCK, &sigs, &osigs);
+#else
+  int omask = sigblock (sigmask (SIGHUP) | sigmask (SIGALRM));
+#endif
+
+  now = time (NULL);
+  for (f = Files; f; f = f->f_next)
+    if ((f->f_type == F_FILE || f->f_type == F_ZFILE)
+	&& f->f_rotp == &f->f_rot
+	&& f->f_rot.maxage && f->f_rot.size > 0
+	&& now - f->f_rot.begun >= f->f_rot.maxage)
+      rotate_file (f);
+
+#ifdef HAVE_SIGACTION
+  sigprocmask (SIG_SETMASK, &osigs, 0);
+#else
+  sigsetmask (omask);
+#endif
+}
+
+char **
+crunch_list (char **oldlist, char *list)
+{
+  int count, i;
+  char *p, *q;
+
+  p = list;
+
+  /* Strip off trailing delimiters.  */
+  while (p[strlen (p) - 1] == LIST_DELIMITER)
+    {
+      p[strlen (p) - 1] = '\0';
+    }
+  /* Cut off leading delimiters.  */
+  while (p[0] == LIST_DELIMITER)
+    {
+      p++;
+    }
+
+  /* Bailout early the string is empty.  */
+  if (*p == '\0')
+    return oldlist;
+
+  /* Count delimiters to calculate elements.  */
+  for (count = 1, i = 0; p[i]; i++)
+    if (p[i] == LIST_DELIMITER)
+      count++;
+
+  /* Count how many we add in the old list.  */
+  for (i = 0; oldlist && oldlist[i]; i++)
+    ;
+
+  /* allocate enough space */
+  oldlist = (char **) realloc (oldlist, (i + count + 1) * sizeof (*oldlist));
+  if (oldlist == NULL)
+    error (EXIT_FAILURE, errno, "can't allocate memory");
+
+  /*
+     We now can assume that the first and last
+     characters are different from any delimiters,
+     so we don't have to care about it anymore.  */
+
+  /* Start from where we left last time.  */
+  for (count = i; (q = strchr (p, LIST_DELIMITER)) != NULL;
+       count++, p = q, p++)
+    {
+      oldlist[count] = (char *) malloc ((q - p + 1) * sizeof (char));
+      if (oldlist[count] == NULL)
+	error (EXIT_FAILURE, errno, "can't allocate memory");
+
+      strncpy (oldlist[count], p, q - p);
+      oldlist[count][q - p] = '\0';
+    }
+
+  /* take the last one */
+  oldlist[count] = (char *) xmalloc ((strlen (p) + 1) * sizeof (char));
+  if (oldlist[count] == NULL)
+    error (EXIT_FAILURE, errno, "can't allocate memory");
+
+  strcpy (oldlist[count], p);
+
+  oldlist[++count] = NULL;	/* terminate the array with a NULL */
+
+  if (Debug)
+    {
+      for (count = 0; oldlist[count]; count++)
+	printf ("#%d: %s\n", count, oldlist[count]);
+    }
+  return oldlist;
+}
+
+/* Word-at-a-time scanning for control characters.  ONES has a one
+   in every byte, so that ONES * 0x20 replicates 0x20 into each byte.
+   HAS_CTRL_BYTE is non-zero if, and only if, some byte of the word
+   is less than 0x20; this is the classical `hasless' bit trick.  */
+typedef unsigned long scanword_t;
+
+#define ONES		((scanword_t) -1 / 0xff)
+#define HAS_CTRL_BYTE(w)	(((w) - ONES * 0x20) & ~(w) & (ONES * 0x80))
+
+/* Copy LEN bytes of SRC to DST, which has room for DSTSIZE bytes
+   including a terminating NUL.  Control characters are rewritten
+   as in `^A', newlines become a space, and copying stops at the first
+   NUL byte.  Runs free of control characters are moved a word at a
+   time.  Returns the length of the result.  */
+static size_t
+copy_escaped (char *dst, size_t dstsize, const char *src, size_t len)
+{
+  const char *p = src, *end = src + len;
+  char *q = dst, *qend = dst + dstsize - 1;
+  size_t n;
+
+  while (p < end && q < qend)
+    {
+      unsigned char c;
+
+      while (end - p >= (ptrdiff_t) sizeof (scanword_t)
+	     && qend - q >= (ptrdiff_t) sizeof (scanword_t))
+	{
+	  scanword_t w;
+
+	  memcpy (&w, p, sizeof (w));
+	  if (HAS_CTRL_BYTE (w))
+	    break;
+	  memcpy (q, &w, sizeof (w));
+	  p += sizeof (w);
+	  q += sizeof (w);
+	}
+
+      /* Finish the word bytewise, up to and including any
+         control character.  */
+      for (n = sizeof (scanword_t); n && p < end && q < qend; n--)
+	{
+	  c = *p++;
+	  if (c >= 040)
+	    {
+	      *q++ = c;
+	      continue;
+	    }
+
+	  if (c == '\0')
+	    p = end;
+	  else if (c == '\n')
+	    *q++ = ' ';
+	  else if (c == '\t')
+	    *q++ = '\t';
+	  else if (qend - q >= 2)
+	    {
+	      *q++ = '^';
+	      *q++ = c ^ 0100;
+	    }
+	  else
+	    p = end;		/* No room left for the escape.  */
+	  break;
+	}
+    }
+  *q = '\0';
+
+  return q - dst;
+}
+
+/* Split the LEN bytes of TEXT into the parts of interest to logmsg,
+   so that no later stage needs to rescan the message.  */
+static void
+parse_msgdesc (int pri, const char *text, size_t len, struct msgdesc *md)
+{
+  const char *p, *end;
+
+  md->pri = pri;
+  md->text = text;
+  md->textlen = len;
+
+  /* Check to see if the message carries a time stamp.  */
+  if (len >= 16 && text[3] == ' ' && text[6] == ' '
+      && text[9] == ':' && text[12] == ':' && text[15] == ' ')
+    {
+      md->timestamp = text;
+      md->body = text + 16;
+      md->bodylen = len - 16;
+    }
+  else
+    {
+      md->timestamp = NULL;
+      md->body = text;
+      md->bodylen = len;
+    }
+
+  /* The program tag ends in the customary `prg:' or `prg[PID]:'.  */
+  md->tag = md->body;
+  for (p = md->body, end = p + md->bodylen;
+       p < end && *p != ':' && *p != '[' && *p != ' '; p++)
+    ;
+  md->taglen = p - md->body;
+}
+
+/* Decode the raw input line MSG of LEN bytes into MD, escaping the
+   text into LINE, a buffer of MAXLINE + 1 bytes.  Return nonzero if
+   the priority was malformed, and thus replaced by the default.  */
+static int
+parse_line (const char *msg, size_t len, char *line, struct msgdesc *md)
+{
+  int pri, bad = 0;
+  const char *p, *end;
+
+  /* test for special codes */
+  pri = DEFUPRI;
+  p = msg;
+  end = msg + len;
+  if (p < end && *p == '<')
+    {
+      pri = 0;
+      while (++p < end && isdigit (*p))
+	pri = 10 * pri + (*p - '0');
+      if (p < end && *p == '>')
+	++p;
+      else
+	bad = 1;
+    }
+
+  /* This overrides large positive and overflowing negative values.  */
+  if (pri & ~(LOG_FACMASK | LOG_PRIMASK))
+    pri = DEFUPRI, bad = 1;
+
+  /* Avoid undefined facilities.  */
+  if (LOG_FAC (pri) > LOG_NFACILITIES)
+    pri = DEFUPRI, bad = 1;
+
+  /* Do not allow users to log kernel messages.  */
+  if (LOG_FAC (pri) == (LOG_KERN >> 3))
+    pri = LOG_MAKEPRI (LOG_USER, LOG_PRI (pri));
+
+  len = copy_escaped (line, MAXLINE + 1, p, end - p);
+  parse_msgdesc (pri, line, len, md);
+  return bad;
+}
+
+/* Take a raw input line of LEN bytes, decode the message, and print
+   the message on the appropriate log files.  Return nonzero if the
+   priority was malformed.  */
+int
+printline (const char *hname, const char *msg, size_t len)
+{
+  char line[MAXLINE + 1];
+  struct msgdesc md;
+  int bad;
+
+  bad = parse_line (msg, len, line, &md);
+
+  /* This for the default behaviour on GNU/Linux syslogd who
+     sync on every line.  */
+  if (force_sync)
+    logmsg_desc (&md, hname, SYNC_FILE);
+  else
+    logmsg_desc (&md, hname, 0);
+  return bad;
+}
+
+/* Take a raw input line from /dev/klog, split and format similar to
+   syslog().  */
+void
+printsys (const char *msg)
+{
+  int c, pri, flags;
+  char *lp, *q, line[MAXLINE + 1];
+  const char *p;
+
+  MainInput.in[IN_KLOG].received++;
+
+  strcpy (line, "vmunix: ");
+  lp = line + strlen (line);
+  for (p = msg; *p != '\0';)
+    {
+      flags = SYNC_FILE | ADDDATE;	/* Fsync after write.  */
+      pri = DEFSPRI;
+      if (*p == '<')
+	{
+	  pri = 0;
+	  while (isdigit (*++p))
+	    pri = 10 * pri + (*p - '0');
+	  if (*p == '>')
 	    ++p;
 	}
       else
@@ -1156,6 +3066,197 @@ printsys (const char *msg)
     }
 }
 
+#ifdef PATH_KMSG
+/* Room kept in front of each record read from PATH_KMSG, for the time
+   stamp and tag which take the place of its prefix.  */
+# define KMSG_PREFIX	32
+# define KMSG_RECMAX	8192	/* Largest record handed out.  */
+# define KMSG_BATCH	512	/* Records taken at each wakeup.  */
+
+/* The kernel keeps its records from boot on, and each start of syslogd
+   would log them all again.  The sequence number of the last record
+   read is thus noted in KmsgFile along with the boot it belongs to.
+   After a reboot, which clears the run directory or changes the boot,
+   every record is logged; after a restart, only those not read yet.  */
+static int kmsg_fd = -1;
+static char kmsg_boot[40] = "-";
+static unsigned long long kmsg_seen;	/* Records below were logged.  */
+
+static void
+kmsg_start (void)
+{
+  char buf[96], boot[sizeof (kmsg_boot)];
+  unsigned long long seq;
+  FILE *fp;
+  ssize_t n;
+
+  fp = fopen ("/proc/sys/kernel/random/boot_id", "r");
+  if (fp != NULL)
+    {
+      if (fscanf (fp, "%39s", kmsg_boot) != 1)
+	strcpy (kmsg_boot, "-");
+      fclose (fp);
+    }
+
+  kmsg_fd = open (KmsgFile, O_RDWR | O_CREAT, 0644);
+  if (kmsg_fd < 0)
+    {
+      dbg_printf ("Can't open %s: %s\n", KmsgFile, strerror (errno));
+      return;
+    }
+  n = read (kmsg_fd, buf, sizeof (buf) - 1);
+  if (n > 0)
+    {
+      buf[n] = '\0';
+      if (sscanf (buf, "%llu %39s", &seq, boot) == 2
+	  && strcmp (boot, kmsg_boot) == 0)
+	kmsg_seen = seq + 1;
+    }
+  dbg_printf ("Kernel records from %llu on are logged\n", kmsg_seen);
+}
+
+/* Note SEQ as the last record read, in a line of constant length.  */
+static void
+kmsg_save (unsigned long long seq)
+{
+  char buf[96];
+  int n;
+
+  if (kmsg_fd < 0)
+    return;
+  n = snprintf (buf, sizeof (buf), "%020llu %s\n", seq, kmsg_boot);
+  if (pwrite (kmsg_fd, buf, n, 0) != n)
+    dbg_printf ("Can't write %s: %s\n", KmsgFile, strerror (errno));
+}
+
+/* Read the records waiting in the kernel log FD, as opened from
+   PATH_KMSG.  Every read returns one whole record,
+
+     PRI,SEQ,USEC,FLAGS;TEXT\n KEY=VALUE\n...
+
+   where USEC is taken from the monotonic clock.  The text is logged
+   where it was read, its prefix being overwritten by a time stamp and
+   the `vmunix:' tag of kernel messages.  Records overwritten by the
+   kernel before they were read show up as a gap in SEQ, and are
+   reported as lost.  Return -1 if the device failed.  */
+static int
+kmsg_read (int fd)
+{
+  static char rec[KMSG_PREFIX + KMSG_RECMAX + 1];
+  static unsigned long long next_seq;
+  static int started;
+  unsigned long long seq = 0, usec = 0, boot, lost = 0;
+  unsigned long long last = next_seq;
+  struct input_stats *st = &MainInput.in[IN_KLOG];
+  struct timeval tv;
+  struct msgdesc md;
+  int n, ret = 0;
+
+  /* Records lost since the one noted are reported too.  */
+  if (!started && kmsg_seen)
+    {
+      next_seq = last = kmsg_seen;
+      started = 1;
+    }
+
+  /* Wall clock time at which the monotonic clock started.  */
+  gettimeofday (&tv, NULL);
+  boot = tv.tv_sec * 1000000ULL + tv.tv_usec - stats_clock ();
+
+  for (n = 0; n < KMSG_BATCH; n++)
+    {
+      char *buf = rec + KMSG_PREFIX, *p, *text, *end;
+      ssize_t len;
+      time_t t;
+      int pri;
+
+      len = read (fd, buf, KMSG_RECMAX);
+      if (len < 0)
+	{
+	  /* The next record was overwritten, which the gap in sequence
+	     numbers accounts for.  */
+	  if (errno == EPIPE)
+	    continue;
+	  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	    {
+	      st->errors++;
+	      logerror ("klog");
+	      ret = -1;
+	    }
+	  break;
+	}
+      if (len == 0)
+	break;
+      st->bytes += len;
+      buf[len] = '\0';
+
+      pri = strtol (buf, &p, 10);
+      if (*p == ',')
+	seq = strtoull (p + 1, &p, 10);
+      if (*p == ',')
+	usec = strtoull (p + 1, &p, 10);
+      text = strchr (p, ';');
+      if (*p != ',' || text == NULL)
+	{
+	  st->errors++;
+	  continue;
+	}
+      text++;
+
+      if (seq < kmsg_seen)
+	continue;
+      if (started && seq > next_seq)
+	lost += seq - next_seq;
+      started = 1;
+      next_seq = seq + 1;
+
+      /* Continuation lines carry dictionary entries, not text.  */
+      end = strchr (text, '\n');
+      if (end == NULL)
+	end = buf + len;
+      if (end - text > MAXLINE)
+	{
+	  st->truncated++;
+	  end = text + MAXLINE;
+	}
+      *end = '\0';
+
+      if (pri & ~(LOG_FACMASK | LOG_PRIMASK)
+	  || LOG_FAC (pri) > LOG_NFACILITIES)
+	pri = DEFSPRI;
+
+      /* Records written by programs carry their own tag.  */
+      if (LOG_FAC (pri) == LOG_FAC (LOG_KERN))
+	{
+	  text -= sizeof ("vmunix: ") - 1;
+	  memcpy (text, "vmunix: ", sizeof ("vmunix: ") - 1);
+	}
+      t = (boot + usec) / 1000000;
+      text -= 16;
+      memcpy (text, ctime (&t) + 4, 15);
+      text[15] = ' ';
+
+      st->received++;
+      parse_msgdesc (pri, text, end - text, &md);
+      logmsg_desc (&md, LocalHostName, SYNC_FILE);
+    }
+
+  if (started && next_seq != last)
+    kmsg_save (next_seq - 1);
+
+  if (lost)
+    {
+      char buf[64];
+
+      st->lost += lost;
+      snprintf (buf, sizeof (buf), "%llu kernel messages lost", lost);
+      errno = 0;
+      logerror (buf);
+    }
+  return ret;
+}
+#endif /* PATH_KMSG */
+
 /* Decode a priority into textual information like auth.emerg.  */
 char *
 textpri (int pri)
@@ -1177,9 +3278,21 @@ textpri (int pri)
    the priority.  */
 void
 logmsg (int pri, const char *msg, const char *from, int flags)
+{
+  struct msgdesc md;
+
+  parse_msgdesc (pri, msg, strlen (msg), &md);
+  logmsg_desc (&md, from, flags);
+}
+
+/* Same as logmsg, but for a message already decoded by parse_msgdesc.  */
+void
+logmsg_desc (const struct msgdesc *md, const char *from, int flags)
 {
   struct filed *f;
-  int fac, msglen, prilev;
+  int fac, pri, prilev;
+  size_t msglen;
+  const char *msg;
 #ifdef HAVE_SIGACTION
   sigset_t sigs, osigs;
 #else
@@ -1188,8 +3301,9 @@ logmsg (int pri, const char *msg, const char *from, int flags)
 
   const char *timestamp;
 
+  pri = md->pri;
   dbg_printf ("(logmsg): %s (%d), flags %x, from %s, msg %s\n",
-	      textpri (pri), pri, flags, from, msg);
+	      textpri (pri), pri, flags, from, md->text);
 
 #ifdef HAVE_SIGACTION
   sigemptyset (&sigs);
@@ -1201,22 +3315,24 @@ logmsg (int pri, const char *msg, const char *from, int flags)
 #endif
 
   /* Check to see if msg looks non-standard.  */
-  msglen = strlen (msg);
-  if (msglen < 16 || msg[3] != ' ' || msg[6] != ' ' ||
-      msg[9] != ':' || msg[12] != ':' || msg[15] != ' ')
+  if (md->timestamp == NULL)
     flags |= ADDDATE;
 
   time (&now);
   if (flags & ADDDATE)
-    timestamp = ctime (&now) + 4;
+    {
+      timestamp = ctime (&now) + 4;
+      msg = md->text;
+      msglen = md->textlen;
+    }
   else
     {
       if (set_local_time)
 	timestamp = ctime (&now) + 4;
       else
-	timestamp = msg;
-      msg += 16;
-      msglen -= 16;
+	timestamp = md->timestamp;
+      msg = md->body;
+      msglen = md->bodylen;
     }
 
   /* Extract facility and priority level.  */
@@ -1270,18 +3386,22 @@ logmsg (int pri, const char *msg, const char *from, int flags)
 	   */
 
 	  /* Skip on selector mismatch.  */
-	  if (strncmp (msg, f->f_progname, f->f_prognlen))
+	  if (md->taglen < (size_t) f->f_prognlen
+	      || memcmp (md->tag, f->f_progname, f->f_prognlen))
 	    continue;
 
 	  /* Avoid matching on prefixes.  */
-	  if (isalnum (msg[f->f_prognlen])
-	      || msg[f->f_prognlen] == '-' || msg[f->f_prognlen] == '_')
+	  if (md->taglen > (size_t) f->f_prognlen
+	      && (isalnum (md->tag[f->f_prognlen])
+		  || md->tag[f->f_prognlen] == '-'
+		  || md->tag[f->f_prognlen] == '_'))
 	    continue;
 	}
 
       /* Suppress duplicate lines to this file.  */
-      if ((flags & MARK) == 0 && msglen == f->f_prevlen && f->f_prevhost
-	  && !strcmp (msg, f->f_prevline) && !strcmp (from, f->f_prevhost))
+      if ((flags & MARK) == 0 && msglen == (size_t) f->f_prevlen
+	  && f->f_prevhost && !memcmp (msg, f->f_prevline, msglen)
+	  && !strcmp (from, f->f_prevhost))
 	{
 	  strncpy (f->f_lasttime, timestamp, sizeof (f->f_lasttime) - 1);
 	  f->f_prevcount++;
@@ -1310,13 +3430,14 @@ logmsg (int pri, const char *msg, const char *from, int flags)
 	    {
 	      f->f_prevlen = msglen;
 	      f->f_prevpri = pri;
-	      strcpy (f->f_prevline, msg);
+	      memcpy (f->f_prevline, msg, msglen + 1);
 	      fprintlog (f, from, flags, (char *) NULL);
 	    }
 	  else
 	    {
 	      f->f_prevline[0] = 0;
 	      f->f_prevlen = 0;
+	      f->f_prevpri = pri;
 	      fprintlog (f, from, flags, msg);
 	    }
 	}
@@ -1336,6 +3457,9 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
   int l;
   char line[MAXLINE + 1], repbuf[80], greetings[200];
   time_t fwd_suspend;
+  ssize_t written;
+  unsigned long long start;
+  int outcome = OUT_NONE;
 
   v = iov;
   /* Be paranoid.  */
@@ -1392,6 +3516,7 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 
   dbg_printf ("Logging to %s", TypeNames[f->f_type]);
 
+  start = stats_clock ();
   switch (f->f_type)
     {
     case F_UNUSED:
@@ -1404,6 +3529,7 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
       if (fwd_suspend >= INET_SUSPEND_TIME)
 	{
 	  dbg_printf ("\nForwarding suspension over, retrying FORW ");
+	  f->f_stats.suspended += fwd_suspend;
 	  f->f_type = F_FORW;
 	  goto f_forw;
 	}
@@ -1412,6 +3538,7 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	  dbg_printf (" %s\n", f->f_un.f_forw.f_hname);
 	  dbg_printf ("Forwarding suspension not over, time left: %d.\n",
 		      INET_SUSPEND_TIME - fwd_suspend);
+	  outcome = OUT_DROPPED;
 	}
       break;
 
@@ -1435,6 +3562,7 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	    {
 	      dbg_printf ("Failure: %s\n", gai_strerror (err));
 	      dbg_printf ("Retries: %d\n", f->f_prevcount);
+	      outcome = OUT_DROPPED;
 	      if (--f->f_prevcount < 0)
 		{
 		  f->f_type = F_UNUSED;
@@ -1454,8 +3582,11 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	    }
 	}
       else
-	dbg_printf ("Forwarding suspension not over, time left: %d\n",
-		    INET_SUSPEND_TIME - fwd_suspend);
+	{
+	  dbg_printf ("Forwarding suspension not over, time left: %d\n",
+		      INET_SUSPEND_TIME - fwd_suspend);
+	  outcome = OUT_DROPPED;
+	}
       break;
 
     case F_FORW:
@@ -1475,6 +3606,7 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	    pfinet = &finet[IU_FD_IP6];
 
 	  temp_finet = *pfinet;
+	  outcome = OUT_DROPPED;	/* Until sent.  */
 
 	  if (temp_finet < 0)
 	    {
@@ -1531,6 +3663,8 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	      errno = e;
 	      logerror ("sendto");
 	    }
+	  else
+	    outcome = OUT_WRITTEN;
 
 	  if (*pfinet < 0)
 	    close (temp_finet);	/* Only temporary socket may be closed.  */
@@ -1561,14 +3695,20 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	  v->iov_len = 1;
 	}
     again:
-      if (writev (f->f_file, iov, IOVCNT) < 0)
+      if ((written = writev (f->f_file, iov, IOVCNT)) < 0)
 	{
 	  int e = errno;
 
+	  outcome = OUT_DROPPED;
+
 	  /* XXX: If a named pipe is full, ignore it.  */
 	  if (f->f_type == F_PIPE && e == EAGAIN)
 	    break;
 
+	  /* Leave errors to the entry now owning the descriptor.  */
+	  if (f->f_flags & ADOPTED)
+	    break;
+
 	  close (f->f_file);
 	  /* Check for errors on TTY's due to loss of tty. */
 	  if ((e == EIO || e == EBADF)
@@ -1594,41 +3734,224 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	      f->f_un.f_fname = NULL;
 	    }
 	}
+      else
+	{
+	  outcome = OUT_WRITTEN;
+	  if ((flags & SYNC_FILE) && !(f->f_flags & OMIT_SYNC))
+	    fsync (f->f_file);
+	  if (f->f_type == F_FILE)
+	    {
+	      struct rotation *rot = f->f_rotp;
+
+	      rot->size += written;
+	      if (rot->limit && rot->size >= rot->limit
+		  && !(f->f_flags & ADOPTED))
+		rotate_file (f);
+	    }
+	}
+      break;
+
+#ifdef COMPRESSED_FILES
+    case F_ZFILE:
+      f->f_time = now;
+      dbg_printf (" %s\n", f->f_un.f_fname);
+      v->iov_base = (char *) "\n";
+      v->iov_len = 1;
+      outcome = OUT_WRITTEN;
+      if (zfile_write (f->f_zf, iov, IOVCNT) < 0)
+	{
+	  int e = errno;
+
+	  outcome = OUT_DROPPED;
+	  if (f->f_flags & ADOPTED)
+	    break;
+	  zfile_close (f->f_zf);
+	  f->f_zf = NULL;
+	  f->f_type = F_UNUSED;
+	  errno = e;
+	  logerror (f->f_un.f_fname);
+	  free (f->f_un.f_fname);
+	  f->f_un.f_fname = NULL;
+	  break;
+	}
+      for (v = iov; v < iov + IOVCNT; v++)
+	f->f_rotp->size += v->iov_len;
+      if (f->f_rotp->limit && f->f_rotp->size >= f->f_rotp->limit
+	  && !(f->f_flags & ADOPTED))
+	rotate_file (f);
+      break;
+#endif
+
+#ifdef MEMORY_RINGS
+    case F_RING:
+      f->f_time = now;
+      dbg_printf (" %s\n", f->f_un.f_fname);
+      v->iov_base = (char *) "\n";
+      v->iov_len = 1;
+      ring_write (f->f_ring, iov, IOVCNT);
+      outcome = OUT_WRITTEN;
+      break;
+#endif
+
+    case F_STORE:
+      f->f_time = now;
+      dbg_printf (" %s\n", f->f_un.f_fname);
+      v--;			/* The text, without a newline.  */
+      outcome = OUT_WRITTEN;
+      if (store_write (f->f_store, f->f_prevpri,
+		       f->f_prevhost ? f->f_prevhost : "",
+		       v->iov_base, v->iov_len) < 0)
+	{
+	  int e = errno;
+
+	  outcome = OUT_DROPPED;
+	  if (f->f_flags & ADOPTED)
+	    break;
+	  store_close (f->f_store);
+	  f->f_store = NULL;
+	  f->f_type = F_UNUSED;
+	  errno = e;
+	  logerror (f->f_un.f_fname + 1);
+	  free (f->f_un.f_fname);
+	  f->f_un.f_fname = NULL;
+	}
       else if ((flags & SYNC_FILE) && !(f->f_flags & OMIT_SYNC))
 	fsync (f->f_file);
       break;
 
-    case F_USERS:
-    case F_WALL:
-      f->f_time = now;
-      dbg_printf ("\n");
-      v->iov_base = (char *) "\r\n";
-      v->iov_len = 2;
-      wallmsg (f, iov);
-      break;
-    }
+    case F_USERS:
+    case F_WALL:
+      f->f_time = now;
+      dbg_printf ("\n");
+      v->iov_base = (char *) "\r\n";
+      v->iov_len = 2;
+      /* A message some terminal missed counts as dropped.  */
+      outcome = wallmsg (f, iov) ? OUT_DROPPED : OUT_WRITTEN;
+      break;
+    }
+
+  if (outcome != OUT_NONE)
+    output_count (&f->f_stats, outcome, iov, start);
+
+  if (f->f_type != F_FORW_UNKN)
+    f->f_prevcount = 0;
+}
+
+/* Terminals of logged-in users, indexed from utmp once and reused by
+   every message for F_USERS and F_WALL until utmp changes.  Where
+   inotify is available a change is noticed by a watch on the utmp
+   file, elsewhere by its time stamp.  The terminals stay open and
+   never block: a message costs one writev(2) for each of them, and a
+   terminal that does not drain loses it instead of stalling us.  What
+   a terminal took only part of is kept, and finished at each wakeup
+   before it is given another message.  */
+#define UTTY_NAMESIZE	sizeof (UT_USER ((STRUCT_UTMP *) 0))
+#define UTTY_FAILED	-2	/* Open failed, retry after a refresh.  */
+
+struct utty
+{
+  char user[UTTY_NAMESIZE + 1];
+  char *device;			/* Path of the terminal.  */
+  int fd;			/* Descriptor, -1, or UTTY_FAILED.  */
+  char *tail;			/* Unwritten end of the last message.  */
+  size_t ntail;
+};
+
+static struct utty *Utty;
+static size_t nutty;
+static size_t utty_tails;	/* Terminals with a tail to finish.  */
+static int utty_stale = 1;	/* Utmp changed since the index was made.  */
+static ino_t utty_ino;		/* Utmp file indexed.  */
+static time_t utty_time;	/* When the index was made.  */
+#ifdef HAVE_SYS_INOTIFY_H
+static int utty_watch = -1;	/* Watch on the utmp file, or -1.  */
+#endif
+
+/* Set up the notification of utmp changes.  Return the descriptor
+   to poll, or -1 if there is none.  */
+static int
+utty_init (void)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  utty_notify = inotify_init ();
+  if (utty_notify >= 0)
+    fcntl (utty_notify, F_SETFL, O_NONBLOCK);
+#endif
+  return utty_notify;
+}
+
+/* Take note of the changes reported on UTTY_NOTIFY.  */
+static void
+utty_notified (void)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  union
+  {
+    struct inotify_event ev;
+    char buf[4096];
+  } u;
+  struct inotify_event *ev;
+  ssize_t n;
+  char *p;
+
+  while ((n = read (utty_notify, u.buf, sizeof (u.buf))) > 0)
+    for (p = u.buf; p < u.buf + n; p += sizeof (*ev) + ev->len)
+      {
+	ev = (struct inotify_event *) p;
+	if (ev->wd != utty_watch)
+	  continue;
 
-  if (f->f_type != F_FORW_UNKN)
-    f->f_prevcount = 0;
+	/* A file renamed over utmp needs a watch of its own.  */
+	if (ev->mask & IN_MOVE_SELF)
+	  inotify_rm_watch (utty_notify, utty_watch);
+	if (ev->mask & (IN_MOVE_SELF | IN_IGNORED))
+	  utty_watch = -1;
+      }
+  utty_stale = 1;
+#endif
 }
 
-/* Write the specified message to either the entire world,
- * or to a list of approved users.  */
-void
-wallmsg (struct filed *f, struct iovec *iov)
+/* Return nonzero if utmp may have changed since the index was made.  */
+static int
+utty_changed (void)
+{
+  struct stat st;
+
+#ifdef HAVE_SYS_INOTIFY_H
+  if (utty_watch >= 0)
+    return utty_stale;
+#endif
+
+  /* Time stamps have a granularity of a second, so a change in the
+     second the index was made can not be told from the index.  */
+  return utty_stale || stat (UTMP_FILE, &st) < 0
+    || st.st_ino != utty_ino || st.st_mtime >= utty_time;
+}
+
+/* Make the index of terminals anew from utmp.  Terminals which are
+   still used by the same user are kept open.  */
+static void
+utty_refresh (void)
 {
-  static int reenter;		/* Avoid calling ourselves.  */
   STRUCT_UTMP *utp;
 #if defined UTMP_NAME_FUNCTION || !defined HAVE_GETUTXENT
   STRUCT_UTMP *utmpbuf;
   size_t utmp_count;
 #endif /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
-  int i;
-  char *p;
+  struct utty *list = NULL, *ut;
+  size_t i, n = 0, alloc = 0;
   char line[sizeof (utp->ut_line) + 1];
-
-  if (reenter++)
-    return;
+  struct stat st;
+
+  utty_stale = 0;
+#ifdef HAVE_SYS_INOTIFY_H
+  if (utty_notify >= 0 && utty_watch < 0)
+    utty_watch = inotify_add_watch (utty_notify, UTMP_FILE,
+				    IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF
+				    | IN_DELETE_SELF);
+#endif
+  utty_ino = stat (UTMP_FILE, &st) == 0 ? st.st_ino : 0;
+  utty_time = time (NULL);
 
 #if !defined UTMP_NAME_FUNCTION && defined HAVE_GETUTXENT
   setutxent ();
@@ -1639,38 +3962,52 @@ wallmsg (struct filed *f, struct iovec *iov)
 		 READ_UTMP_USER_PROCESS | READ_UTMP_CHECK_PIDS) < 0)
     {
       logerror ("opening utmp file");
-      return;
+      utmp_count = 0;
+      utmpbuf = NULL;
     }
 
   for (utp = utmpbuf; utp < utmpbuf + utmp_count; utp++)
 #endif /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
     {
+#if !defined UTMP_NAME_FUNCTION && defined HAVE_GETUTXENT
+      if (utp->ut_type != USER_PROCESS)
+	continue;
+#endif
       strncpy (line, utp->ut_line, sizeof (utp->ut_line));
       line[sizeof (utp->ut_line)] = '\0';
-      if (f->f_type == F_WALL)
+
+      /* An attempt to break security, or a line without a device.  */
+      if (*line == '\0' || strstr (line, ".."))
 	{
-	  /* Note we're using our own version of ttymsg
-	     which does a double fork () to not have
-	     zombies.  No need to waitpid().  */
-	  p = inetutils_ttymsg (iov, IOVCNT, line, TTYMSGTIME);
-	  if (p != NULL)
-	    {
-	      errno = 0;	/* Already in message. */
-	      logerror (p);
-	    }
+	  dbg_printf ("bad line name: %s\n", line);
 	  continue;
 	}
-      /* Should we send the message to this user? */
-      for (i = 0; i < f->f_un.f_user.f_nusers; i++)
-	if (!strncmp (f->f_un.f_user.f_unames[i], UT_USER (utp),
-		      sizeof (UT_USER (utp))))
+
+      if (n == alloc)
+	{
+	  alloc = alloc ? 2 * alloc : 16;
+	  list = xrealloc (list, alloc * sizeof (*list));
+	}
+      ut = &list[n++];
+      strncpy (ut->user, UT_USER (utp), UTTY_NAMESIZE);
+      ut->user[UTTY_NAMESIZE] = '\0';
+      ut->device = xmalloc (strlen (PATH_TTY_PFX) + strlen (line) + 1);
+      strcpy (ut->device, PATH_TTY_PFX);
+      strcat (ut->device, line);
+      ut->fd = -1;
+      ut->tail = NULL;
+      ut->ntail = 0;
+
+      for (i = 0; i < nutty; i++)
+	if (Utty[i].fd >= 0 && !strcmp (Utty[i].device, ut->device)
+	    && !strcmp (Utty[i].user, ut->user))
 	  {
-	    p = inetutils_ttymsg (iov, IOVCNT, line, TTYMSGTIME);
-	    if (p != NULL)
-	      {
-		errno = 0;	/* Already in message. */
-		logerror (p);
-	      }
+	    ut->fd = Utty[i].fd;
+	    ut->tail = Utty[i].tail;
+	    ut->ntail = Utty[i].ntail;
+	    Utty[i].fd = -1;
+	    Utty[i].tail = NULL;
+	    Utty[i].ntail = 0;
 	    break;
 	  }
     }
@@ -1679,17 +4016,190 @@ wallmsg (struct filed *f, struct iovec *iov)
 #else /* !UTMP_NAME_FUNCTION && HAVE_GETUTXENT */
   endutxent ();
 #endif
+
+  for (i = 0; i < nutty; i++)
+    {
+      if (Utty[i].fd >= 0)
+	close (Utty[i].fd);
+      if (Utty[i].tail)
+	utty_tails--;
+      free (Utty[i].tail);
+      free (Utty[i].device);
+    }
+  free (Utty);
+  Utty = list;
+  nutty = n;
+  dbg_printf ("%lu user terminals\n", (unsigned long) nutty);
+}
+
+/* Close the terminal UT after a failed write, which errno tells.  */
+static void
+utty_close (struct utty *ut)
+{
+  /* We get ENODEV on a slip line if we're running as root,
+     and EIO if the line just went away.  */
+  if (errno != ENODEV && errno != EIO)
+    logerror (ut->device);
+  close (ut->fd);
+  ut->fd = -1;
+  if (ut->tail)
+    utty_tails--;
+  free (ut->tail);
+  ut->tail = NULL;
+  ut->ntail = 0;
+}
+
+/* Write what is left of the last message to the terminal UT.  Return
+   nonzero if some is left still.  */
+static int
+utty_finish (struct utty *ut)
+{
+  ssize_t n;
+
+  if (ut->tail == NULL)
+    return 0;
+
+  n = write (ut->fd, ut->tail, ut->ntail);
+  if (n < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	return 1;
+      utty_close (ut);
+      return 0;
+    }
+  ut->ntail -= n;
+  if (ut->ntail > 0)
+    {
+      memmove (ut->tail, ut->tail + n, ut->ntail);
+      return 1;
+    }
+  free (ut->tail);
+  ut->tail = NULL;
+  utty_tails--;
+  return 0;
+}
+
+/* Finish the messages terminals took only part of.  */
+static void
+utty_flush (void)
+{
+  size_t i;
+
+  for (i = 0; utty_tails > 0 && i < nutty; i++)
+    if (Utty[i].fd >= 0)
+      utty_finish (&Utty[i]);
+}
+
+/* Write the line in IOV to the terminal UT.  Return -1 if the line
+   was dropped.  */
+static int
+utty_write (struct utty *ut, struct iovec *iov)
+{
+  ssize_t n;
+  size_t len, i;
+
+  if (ut->fd == UTTY_FAILED)
+    return 0;
+
+  if (ut->fd < 0)
+    {
+      ut->fd = open (ut->device, O_WRONLY | O_NONBLOCK | O_NOCTTY, 0);
+      if (ut->fd < 0)
+	{
+	  /* Slip lines and exclusive-use lines are not an error.  */
+	  if (errno != EBUSY && errno != EACCES)
+	    logerror (ut->device);
+	  ut->fd = UTTY_FAILED;
+	  return 0;
+	}
+    }
+
+  /* Lines are not interleaved: the rest of the former comes first.  */
+  if (utty_finish (ut))
+    {
+      dbg_printf ("%s is full, message dropped\n", ut->device);
+      return -1;
+    }
+  if (ut->fd < 0)
+    return 0;
+
+  n = writev (ut->fd, iov, IOVCNT);
+  if (n < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	{
+	  dbg_printf ("%s is full, message dropped\n", ut->device);
+	  return -1;
+	}
+      utty_close (ut);
+      return 0;
+    }
+
+  for (len = 0, i = 0; i < IOVCNT; i++)
+    len += iov[i].iov_len;
+  if ((size_t) n == len)
+    return 0;
+
+  /* Keep the unwritten end, from the iovec entry N falls in on.  */
+  ut->ntail = len - n;
+  ut->tail = xmalloc (ut->ntail);
+  for (len = 0, i = 0; i < IOVCNT; i++)
+    {
+      size_t skip = (size_t) n > iov[i].iov_len ? iov[i].iov_len : n;
+
+      memcpy (ut->tail + len, (char *) iov[i].iov_base + skip,
+	      iov[i].iov_len - skip);
+      len += iov[i].iov_len - skip;
+      n -= skip;
+    }
+  utty_tails++;
+  return 0;
+}
+
+/* Write the specified message to either the entire world,
+ * or to a list of approved users.  */
+int
+wallmsg (struct filed *f, struct iovec *iov)
+{
+  static int reenter;		/* Avoid calling ourselves.  */
+  size_t i;
+  int j, dropped = 0;
+
+  if (reenter++)
+    return 0;
+
+  if (utty_changed ())
+    utty_refresh ();
+
+  for (i = 0; i < nutty; i++)
+    {
+      if (f->f_type != F_WALL)
+	{
+	  /* Should we send the message to this user? */
+	  for (j = 0; j < f->f_un.f_user.f_nusers; j++)
+	    if (!strncmp (f->f_un.f_user.f_unames[j], Utty[i].user,
+			  UTTY_NAMESIZE))
+	      break;
+	  if (j == f->f_un.f_user.f_nusers)
+	    continue;
+	}
+      if (utty_write (&Utty[i], iov) < 0)
+	dropped++;
+    }
   reenter = 0;
+  return dropped;
 }
 
-/* Return a printable representation of a host address.  */
-const char *
-cvthname (struct sockaddr *f, socklen_t len)
+/* Return a printable representation of a host address, stored in
+   either of the caller's buffers NUMBUF and NAMEBUF.  */
+static const char *
+cvthname_r (struct sockaddr *f, socklen_t len,
+	    char numbuf[INET6_ADDRSTRLEN], char namebuf[NI_MAXHOST])
 {
   int err;
   char *p;
 
-  err = getnameinfo (f, len, addrstr, sizeof (addrstr),
+  err = getnameinfo (f, len, numbuf, INET6_ADDRSTRLEN,
 		     NULL, 0, NI_NUMERICHOST);
   if (err)
     {
@@ -1697,17 +4207,17 @@ cvthname (struct sockaddr *f, socklen_t len)
       return "???";
     }
 
-  dbg_printf ("cvthname(%s)\n", addrstr);
+  dbg_printf ("cvthname(%s)\n", numbuf);
 
-  err = getnameinfo (f, len, addrname, sizeof (addrname),
+  err = getnameinfo (f, len, namebuf, NI_MAXHOST,
 		     NULL, 0, NI_NAMEREQD);
   if (err)
     {
-      dbg_printf ("Host name for your address (%s) unknown.\n", addrstr);
-      return addrstr;
+      dbg_printf ("Host name for your address (%s) unknown.\n", numbuf);
+      return numbuf;
     }
 
-  p = strchr (addrname, '.');
+  p = strchr (namebuf, '.');
   if (p != NULL)
     {
       if (strcasecmp (p + 1, LocalDomain) == 0)
@@ -1724,7 +4234,7 @@ cvthname (struct sockaddr *f, socklen_t len)
 		  if (strcasecmp (p + 1, StripDomains[count]) == 0)
 		    {
 		      *p = '\0';
-		      return addrname;
+		      return namebuf;
 		    }
 		  count++;
 		}
@@ -1734,17 +4244,24 @@ cvthname (struct sockaddr *f, socklen_t len)
 	      count = 0;
 	      while (LocalHosts[count])
 		{
-		  if (strcasecmp (addrname, LocalHosts[count]) == 0)
+		  if (strcasecmp (namebuf, LocalHosts[count]) == 0)
 		    {
 		      *p = '\0';
-		      return addrname;
+		      return namebuf;
 		    }
 		  count++;
 		}
 	    }
 	}
     }
-  return addrname;
+  return namebuf;
+}
+
+/* Return a printable representation of a host address.  */
+const char *
+cvthname (struct sockaddr *f, socklen_t len)
+{
+  return cvthname_r (f, len, addrstr, addrname);
 }
 
 void
@@ -1773,6 +4290,8 @@ domark (int signo MAYBE_UNUSED)
 	  fprintlog (f, LocalHostName, 0, (char *) NULL);
 	  BACKOFF (f);
 	}
+      if (f->f_rot.maxage)
+	ages_due = 1;
     }
 
 #ifndef HAVE_SIGACTION
@@ -1827,6 +4346,26 @@ die (int signo)
       logerror (buf);
     }
 
+#ifdef COMPRESSED_FILES
+  /* Complete the compressed streams.  */
+  for (f = Files; f != NULL; f = f->f_next)
+    if (f->f_type == F_ZFILE)
+      {
+	zfile_close (f->f_zf);
+	f->f_zf = NULL;
+	f->f_type = F_UNUSED;
+      }
+#endif
+
+  /* Index the last blocks of the stores.  */
+  for (f = Files; f != NULL; f = f->f_next)
+    if (f->f_type == F_STORE)
+      {
+	store_close (f->f_store);
+	f->f_store = NULL;
+	f->f_type = F_UNUSED;
+      }
+
   if (fklog >= 0)
     close (fklog);
 
@@ -2087,67 +4626,327 @@ load_confdir (const char *dirname, struct filed **nextp)
 
   closedir (dir);
 
-  /* An empty directory is acceptable.
-   */
-  return (found ? rc : 1);
-}
+  /* An empty directory is acceptable.
+   */
+  return (found ? rc : 1);
+}
+
+/* Release all resources held by the table entry F.  */
+static void
+free_filed (struct filed *f)
+{
+  int j;
+
+  switch (f->f_type)
+    {
+    case F_FILE:
+    case F_TTY:
+    case F_CONSOLE:
+    case F_PIPE:
+      free (f->f_un.f_fname);
+      if (f->f_file >= 0 && !(f->f_flags & ADOPTED))
+	close (f->f_file);
+      break;
+#ifdef COMPRESSED_FILES
+    case F_ZFILE:
+      free (f->f_un.f_fname);
+      if (f->f_zf && !(f->f_flags & ADOPTED))
+	zfile_close (f->f_zf);	/* Also closes f_file.  */
+      break;
+#endif
+#ifdef MEMORY_RINGS
+    case F_RING:
+      free (f->f_un.f_fname);
+      if (f->f_ring && !(f->f_flags & ADOPTED))
+	{
+	  ring_close (f->f_ring);
+	  close (f->f_file);
+	}
+      break;
+#endif
+    case F_STORE:
+      free (f->f_un.f_fname);
+      if (f->f_store && !(f->f_flags & ADOPTED))
+	store_close (f->f_store);	/* Also closes f_file.  */
+      break;
+    case F_FORW:
+    case F_FORW_SUSP:
+    case F_FORW_UNKN:
+      free (f->f_un.f_forw.f_hname);
+      break;
+    case F_USERS:
+      for (j = 0; j < f->f_un.f_user.f_nusers; ++j)
+	free (f->f_un.f_user.f_unames[j]);
+      free (f->f_un.f_user.f_unames);
+      break;
+    }
+  free (f->f_progname);
+  free (f->f_prevhost);
+  free (f);
+}
+
+/* Return true if table entries A and B deliver to the same place.  */
+static int
+same_action (const struct filed *a, const struct filed *b)
+{
+  int j;
+
+  switch (a->f_type)
+    {
+    case F_FILE:
+    case F_TTY:
+    case F_CONSOLE:
+    case F_PIPE:
+    case F_ZFILE:
+    case F_RING:
+    case F_STORE:
+      return a->f_type == b->f_type
+	&& !strcmp (a->f_un.f_fname, b->f_un.f_fname);
+
+    case F_FORW:
+    case F_FORW_SUSP:
+    case F_FORW_UNKN:
+      return (b->f_type == F_FORW || b->f_type == F_FORW_SUSP
+	      || b->f_type == F_FORW_UNKN)
+	&& !strcmp (a->f_un.f_forw.f_hname, b->f_un.f_forw.f_hname);
+
+    case F_USERS:
+      if (b->f_type != F_USERS
+	  || a->f_un.f_user.f_nusers != b->f_un.f_user.f_nusers)
+	return 0;
+      for (j = 0; j < a->f_un.f_user.f_nusers; j++)
+	if (strcmp (a->f_un.f_user.f_unames[j], b->f_un.f_user.f_unames[j]))
+	  return 0;
+      return 1;
+
+    case F_WALL:
+      return b->f_type == F_WALL;
+    }
+
+  return 0;
+}
+
+/* Return true if table entries A and B select the same messages.  */
+static int
+same_selection (const struct filed *a, const struct filed *b)
+{
+  if (memcmp (a->f_pmask, b->f_pmask, sizeof (a->f_pmask))
+      || a->f_flags != b->f_flags)
+    return 0;
+  if (a->f_progname == NULL || b->f_progname == NULL)
+    return a->f_progname == b->f_progname;
+  return !strcmp (a->f_progname, b->f_progname);
+}
+
+/* Live table during a reload, and thus the source of descriptors
+   which cfline may adopt instead of opening a destination anew.  */
+static struct filed *ReloadFiles;
+
+/* Move the repetition state of the old entry O to the new entry F.  */
+static void
+inherit_state (struct filed *f, struct filed *o)
+{
+  memcpy (f->f_prevline, o->f_prevline, sizeof (f->f_prevline));
+  memcpy (f->f_lasttime, o->f_lasttime, sizeof (f->f_lasttime));
+  f->f_prevhost = o->f_prevhost;
+  o->f_prevhost = NULL;
+  f->f_prevpri = o->f_prevpri;
+  f->f_prevlen = o->f_prevlen;
+  f->f_prevcount = o->f_prevcount;
+  f->f_repeatcount = o->f_repeatcount;
+  f->f_time = o->f_time;
+  o->f_prevcount = 0;
+}
+
+/* Hand the open descriptor of a live entry writing to FNAME over to
+   the new entry F, together with any pending repetitions if F selects
+   the same messages.  Otherwise these are flushed first.  Return zero
+   if there is no descriptor to take.  */
+static int
+adopt_file (struct filed *f, const char *fname)
+{
+  struct filed *o;
+  struct stat st, ost;
+
+  for (o = ReloadFiles; o; o = o->f_next)
+    if ((o->f_type == F_FILE || o->f_type == F_TTY || o->f_type == F_ZFILE
+	 || o->f_type == F_CONSOLE || o->f_type == F_PIPE
+	 || o->f_type == F_RING || o->f_type == F_STORE)
+	&& o->f_file >= 0 && !(o->f_flags & ADOPTED)
+	&& o->f_codec == f->f_codec
+	&& !strcmp (o->f_un.f_fname, fname))
+      {
+	/* A file renamed or removed since, say by logrotate, is left
+	   to the old entry, and opened anew.  A store keeps track of
+	   its own segments.  */
+	if (o->f_type != F_STORE
+	    && (stat (strchr ("%|", *fname) ? fname + 1 : fname, &st) < 0
+		|| fstat (o->f_file, &ost) < 0
+		|| st.st_dev != ost.st_dev || st.st_ino != ost.st_ino))
+	  {
+	    dbg_printf ("%s was replaced, reopening\n", fname);
+	    return 0;
+	  }
+	dbg_printf ("keeping %s open\n", fname);
+	if (same_selection (f, o))
+	  inherit_state (f, o);
+	else if (o->f_prevcount)
+	  {
+	    fprintlog (o, LocalHostName, 0, (char *) NULL);
+	    if (o->f_type == F_UNUSED)
+	      return 0;		/* Failed and closed.  */
+	  }
+	f->f_type = o->f_type;
+	f->f_file = o->f_file;
+	f->f_zf = o->f_zf;
+	f->f_ring = o->f_ring;
+	f->f_store = o->f_store;
+	f->f_rot.size = o->f_rotp->size;
+	f->f_rot.begun = o->f_rotp->begun;
+	f->f_stats = o->f_stats;
+	/* O keeps writing through the shared descriptor until the
+	   new table is put in place, but must not close it.  */
+	o->f_flags |= ADOPTED;
+	return 1;
+      }
+
+  return 0;
+}
+
+/* INIT -- Initialize syslogd from configuration table.
+
+   The new configuration is read aside while the live one stays in
+   service.  Destinations present in both keep their descriptors, and
+   entries with unchanged selectors also keep pending repetitions.
+   Only then is the new table put in place, in a single step.  */
+void
+init (int signo MAYBE_UNUSED)
+{
+  int rc, ret;
+  struct filed *f, *o, *next, *newfiles = NULL;
+#ifdef HAVE_SIGACTION
+  sigset_t sigs, osigs;
+#else
+  int omask;
+#endif
+
+  dbg_printf ("init\n");
+
+  /* Index the user terminals anew at the next message for them.  */
+  utty_stale = 1;
+
+  ReloadFiles = Files;
+  facilities_seen = 0;
+
+  rc = load_conffile (ConfFile, &newfiles);
+
+  ret = load_confdir (ConfDir, &newfiles);
+  if (!ret)
+    rc = 0;			/* Some allocation errors were found.  */
+
+  ReloadFiles = NULL;
+
+  /* Carry the state of other unchanged entries over.  File entries
+     were dealt with by adopt_file.  */
+  for (f = newfiles; f; f = f->f_next)
+    if (f->f_type == F_FORW || f->f_type == F_FORW_SUSP
+	|| f->f_type == F_USERS || f->f_type == F_WALL)
+      for (o = Files; o; o = o->f_next)
+	if (o->f_type != F_FORW_UNKN && same_action (f, o)
+	    && same_selection (f, o))
+	  {
+	    inherit_state (f, o);
+	    f->f_stats = o->f_stats;
+	    break;
+	  }
+
+  /* Entries writing to the same file share the rotation state of the
+     first, lest one of them rotate it from under the others, and the
+     first policy given for the file.  */
+  for (f = newfiles; f; f = f->f_next)
+    {
+      f->f_rotp = &f->f_rot;
+      if (f->f_type != F_FILE && f->f_type != F_ZFILE)
+	continue;
+      for (o = newfiles; o != f; o = o->f_next)
+	if ((o->f_type == F_FILE || o->f_type == F_ZFILE)
+	    && !strcmp (o->f_un.f_fname, f->f_un.f_fname))
+	  {
+	    f->f_rotp = o->f_rotp;
+	    if (!o->f_rot.limit && !o->f_rot.maxage)
+	      {
+		o->f_rot.limit = f->f_rot.limit;
+		o->f_rot.maxage = f->f_rot.maxage;
+		o->f_rot.keep = f->f_rot.keep;
+	      }
+	    break;
+	  }
+    }
+
+#ifdef HAVE_SIGACTION
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGALRM);
+  sigprocmask (SIG_BLOCK, &sigs, &osigs);
+#else
+  omask = sigblock (sigmask (SIGALRM));
+#endif
+
+  o = Files;
+  Files = newfiles;
+  Initialized = 1;
 
-/* INIT -- Initialize syslogd from configuration table.  */
-void
-init (int signo MAYBE_UNUSED)
-{
-  int rc, ret;
-  struct filed *f, *next, **nextp;
+#ifdef RECEIVER_THREADS
+  {
+    int i;
 
-  dbg_printf ("init\n");
+    for (i = 0; i <= LOG_NFACILITIES; i++)
+      {
+	unsigned char mask = 0;
 
-  /* Close all open log files.  */
-  Initialized = 0;
-  for (f = Files; f != NULL; f = next)
-    {
-      int j;
+	for (f = Files; f; f = f->f_next)
+	  mask |= f->f_pmask[i];
+	SelectMask[i] = mask;
+      }
+  }
+#endif
 
-      /* Flush any pending output.  */
-      if (f->f_prevcount)
-	fprintlog (f, LocalHostName, 0, (char *) NULL);
+#ifdef HAVE_SIGACTION
+  sigprocmask (SIG_SETMASK, &osigs, 0);
+#else
+  sigsetmask (omask);
+#endif
 
-      switch (f->f_type)
-	{
-	case F_FILE:
-	case F_TTY:
-	case F_CONSOLE:
-	case F_PIPE:
-	  free (f->f_un.f_fname);
-	  close (f->f_file);
-	  break;
-	case F_FORW:
-	case F_FORW_SUSP:
-	case F_FORW_UNKN:
-	  free (f->f_un.f_forw.f_hname);
-	  break;
-	case F_USERS:
-	  for (j = 0; j < f->f_un.f_user.f_nusers; ++j)
-	    free (f->f_un.f_user.f_unames[j]);
-	  free (f->f_un.f_user.f_unames);
-	  break;
-	}
-      free (f->f_progname);
-      free (f->f_prevhost);
-      next = f->f_next;
-      free (f);
+  /* Retire the old table, flushing pending repetitions.  */
+  for (; o != NULL; o = next)
+    {
+      next = o->f_next;
+      if (o->f_prevcount && o->f_type != F_FORW_UNKN)
+	fprintlog (o, LocalHostName, 0, (char *) NULL);
+      free_filed (o);
     }
 
-  Files = NULL;			/* Empty the table.  */
-  nextp = &Files;
-  facilities_seen = 0;
-
-  rc = load_conffile (ConfFile, nextp);
-
-  ret = load_confdir (ConfDir, nextp);
-  if (!ret)
-    rc = 0;			/* Some allocation errors were found.  */
+#ifdef MEMORY_RINGS
+  /* Rings adopted with another size are made anew, now that no old
+     entry writes through their former mapping.  Should that fail, the
+     old ring is kept.  */
+  for (f = Files; f; f = f->f_next)
+    if (f->f_type == F_RING
+	&& f->f_ring->size != ring_datasize (f->f_ringsize))
+      {
+	struct logring_hdr *ring;
+	int fd = ring_file_open (f->f_un.f_fname + 1, f->f_ringsize, &ring);
 
-  Initialized = 1;
+	if (fd < 0)
+	  {
+	    logerror (f->f_un.f_fname + 1);
+	    continue;
+	  }
+	ring_close (f->f_ring);
+	close (f->f_file);
+	f->f_ring = ring;
+	f->f_file = fd;
+      }
+#endif
 
   if (Debug)
     {
@@ -2166,6 +4965,9 @@ init (int signo MAYBE_UNUSED)
 	    case F_TTY:
 	    case F_CONSOLE:
 	    case F_PIPE:
+	    case F_ZFILE:
+	    case F_RING:
+	    case F_STORE:
 	      dbg_printf ("%s", f->f_un.f_fname);
 	      break;
 
@@ -2199,6 +5001,145 @@ init (int signo MAYBE_UNUSED)
   dbg_printf ("syslogd: restarted\n");
 }
 
+/* Decode the number from P to END, which may carry a suffix of
+   SUFFIXES: each letter multiplies the number by the value that
+   follows it.  Return zero if the number is invalid or zero.  */
+static unsigned long
+option_number (const char *p, const char *end, const char *suffixes,
+	       const unsigned long *units)
+{
+  const char *u;
+  char *q;
+  unsigned long n = strtoul (p, &q, 10);
+
+  if (q < end && *q && (u = strchr (suffixes, *q)) != NULL)
+    n *= units[u - suffixes], q++;
+  return q == end ? n : 0;
+}
+
+static const char size_suffixes[] = "kKmMgG";
+static const unsigned long size_units[] = {
+  1024, 1024, 1024 * 1024, 1024 * 1024,
+  1024 * 1024 * 1024, 1024 * 1024 * 1024
+};
+
+static const char time_suffixes[] = "smhdw";
+static const unsigned long time_units[] = {
+  1, 60, 60 * 60, 24 * 60 * 60, 7 * 24 * 60 * 60
+};
+
+/* Parse the options OPTS following a file name in the action field
+   of F.  Each is a keyword, possibly with a value, separated by white
+   space from the next.  */
+static void
+file_options (struct filed *f, const char *opts)
+{
+  char ebuf[200];
+  const char *p, *q;
+
+  for (p = opts; *p; p = q)
+    {
+      size_t len;
+
+      while (*p == ' ' || *p == '\t')
+	p++;
+      for (q = p; *q && *q != ' ' && *q != '\t'; q++)
+	;
+      len = q - p;
+      if (len == 0)
+	break;
+
+      if ((f->f_type == F_RING || f->f_type == F_STORE)
+	  && len > 5 && !strncmp (p, "size=", 5))
+	{
+	  unsigned long n = option_number (p + 5, q, size_suffixes,
+					   size_units);
+
+	  if (n > 0)
+	    {
+	      if (f->f_type == F_RING)
+		f->f_ringsize = n;
+	      else
+		f->f_storesize = n;
+	      continue;
+	    }
+	}
+      if (f->f_type == F_UNUSED && len > 7 && !strncmp (p, "rotate=", 7))
+	{
+	  f->f_rot.limit = option_number (p + 7, q, size_suffixes,
+					  size_units);
+	  if (f->f_rot.limit > 0)
+	    continue;
+	}
+      if (f->f_type == F_UNUSED && len > 7 && !strncmp (p, "maxage=", 7))
+	{
+	  f->f_rot.maxage = option_number (p + 7, q, time_suffixes,
+					   time_units);
+	  if (f->f_rot.maxage > 0)
+	    continue;
+	}
+      if (f->f_type == F_UNUSED && len > 5 && !strncmp (p, "keep=", 5))
+	{
+	  char *end;
+	  long n = strtol (p + 5, &end, 10);
+
+	  if (end == q && n >= 0 && n < 1000)
+	    {
+	      f->f_rot.keep = n;
+	      continue;
+	    }
+	}
+#ifdef COMPRESSED_FILES
+# ifdef HAVE_LIBZ
+      if (f->f_type == F_UNUSED && len == 13
+	  && !strncmp (p, "compress=gzip", len))
+	{
+	  f->f_codec = ZCODEC_GZIP;
+	  continue;
+	}
+# endif
+# ifdef HAVE_LIBZSTD
+      if (f->f_type == F_UNUSED && len == 13
+	  && !strncmp (p, "compress=zstd", len))
+	{
+	  f->f_codec = ZCODEC_ZSTD;
+	  continue;
+	}
+# endif
+#endif
+
+      snprintf (ebuf, sizeof (ebuf), "unknown file option \"%.*s\"",
+		(int) (len < 100 ? len : 100), p);
+      errno = 0;
+      logerror (ebuf);
+    }
+}
+
+/* Keywords of the options which may follow a file name.  */
+static const char *const file_option_keys[] = {
+  "compress=", "keep=", "maxage=", "rotate=", "size=", NULL
+};
+
+/* Return the first blank in the action P which is followed by one of
+   file_option_keys, or NULL.  Blanks before anything else belong to
+   the file name.  */
+static const char *
+file_options_start (const char *p)
+{
+  const char *const *key;
+  const char *q, *r;
+
+  for (q = strpbrk (p, " \t"); q; q = strpbrk (q + 1, " \t"))
+    {
+      for (r = q; *r == ' ' || *r == '\t'; r++)
+	;
+      for (key = file_option_keys; *key; key++)
+	if (!strncmp (r, *key, strlen (*key)))
+	  return q;
+    }
+  return NULL;
+}
+
 /* Crack a configuration file line.  */
 void
 cfline (const char *line, struct filed *f)
@@ -2340,6 +5281,15 @@ cfline (const char *line, struct filed *f)
       p++;
     }
 
+  /* Set program selector.  */
+  if (selector)
+    {
+      f->f_progname = strdup (selector);
+      f->f_prognlen = strlen (selector);
+    }
+  else
+    f->f_progname = NULL;
+
   if (!strlen (p))
     {
       /* Invalidate an entry with empty action field.  */
@@ -2398,6 +5348,8 @@ cfline (const char *line, struct filed *f)
 
     case '|':
       f->f_un.f_fname = strdup (p);
+      if (adopt_file (f, f->f_un.f_fname))
+	break;
       f->f_file = open (++p, O_RDWR | O_NONBLOCK);
       if (f->f_file < 0)
 	{
@@ -2417,23 +5369,117 @@ cfline (const char *line, struct filed *f)
 
     case '/':
       f->f_un.f_fname = strdup (p);
-      f->f_file = open (p, O_WRONLY | O_APPEND | O_CREAT, 0644);
+
+      /* Options may follow the file name.  */
+      f->f_rot.keep = ROTATEKEEP;
+      q = file_options_start (p);
+      if (q)
+	{
+	  f->f_un.f_fname[q - p] = '\0';
+	  file_options (f, q);
+	}
+
+      if (adopt_file (f, f->f_un.f_fname))
+	break;
+      f->f_file = open (f->f_un.f_fname, O_WRONLY | O_APPEND | O_CREAT, 0644);
       if (f->f_file < 0)
 	{
 	  f->f_type = F_UNUSED;
-	  logerror (p);
+	  logerror (f->f_un.f_fname);
 	  free (f->f_un.f_fname);
 	  f->f_un.f_fname = NULL;
 	  break;
 	}
-      if (strcmp (p, ctty) == 0)
+      {
+	struct stat st;
+
+	if (fstat (f->f_file, &st) == 0)
+	  {
+	    f->f_rot.size = st.st_size;
+	    f->f_rot.begun = rotation_begun (f, &st);
+	  }
+	else
+	  f->f_rot.begun = time (NULL);
+      }
+      if (strcmp (f->f_un.f_fname, ctty) == 0)
 	f->f_type = F_CONSOLE;
       else if (isatty (f->f_file))
 	f->f_type = F_TTY;
+#ifdef COMPRESSED_FILES
+      else if (f->f_codec != ZCODEC_NONE)
+	{
+	  f->f_type = F_ZFILE;
+	  f->f_zf = zfile_open (f->f_file, f->f_codec);
+	  if (f->f_zf == NULL)
+	    {
+	      f->f_type = F_UNUSED;
+	      logerror (f->f_un.f_fname);
+	      close (f->f_file);
+	      free (f->f_un.f_fname);
+	      f->f_un.f_fname = NULL;
+	    }
+	}
+#endif
       else
 	f->f_type = F_FILE;
       break;
 
+#ifdef MEMORY_RINGS
+    case '%':
+      f->f_un.f_fname = strdup (p);
+      f->f_ringsize = RINGSIZE;
+
+      q = file_options_start (p);
+      if (q)
+	{
+	  f->f_un.f_fname[q - p] = '\0';
+	  f->f_type = F_RING;	/* Selects the options of rings.  */
+	  file_options (f, q);
+	  f->f_type = F_UNUSED;
+	}
+
+      if (adopt_file (f, f->f_un.f_fname))
+	break;
+      f->f_file = ring_file_open (f->f_un.f_fname + 1, f->f_ringsize,
+				  &f->f_ring);
+      if (f->f_file < 0)
+	{
+	  logerror (f->f_un.f_fname + 1);
+	  free (f->f_un.f_fname);
+	  f->f_un.f_fname = NULL;
+	  break;
+	}
+      f->f_type = F_RING;
+      break;
+#endif
+
+    case '+':
+      f->f_un.f_fname = strdup (p);
+      f->f_storesize = STORESIZE;
+
+      q = file_options_start (p);
+      if (q)
+	{
+	  f->f_un.f_fname[q - p] = '\0';
+	  f->f_type = F_STORE;	/* Selects the options of stores.  */
+	  file_options (f, q);
+	  f->f_type = F_UNUSED;
+	}
+
+      if (adopt_file (f, f->f_un.f_fname))
+	break;
+      f->f_store = store_open (f->f_un.f_fname + 1, f->f_storesize);
+      if (f->f_store == NULL)
+	{
+	  logerror (f->f_un.f_fname + 1);
+	  free (f->f_un.f_fname);
+	  f->f_un.f_fname = NULL;
+	  break;
+	}
+      f->f_file = f->f_store->fd;
+      f->f_type = F_STORE;
+      break;
+
     case '*':
       f->f_type = F_WALL;
       break;
@@ -2462,15 +5508,6 @@ cfline (const char *line, struct filed *f)
       f->f_type = F_USERS;
       break;
     }
-
-  /* Set program selector.  */
-  if (selector)
-    {
-      f->f_progname = strdup (selector);
-      f->f_prognlen = strlen (selector);
-    }
-  else
-    f->f_progname = NULL;
 }
 
 /* Decode a symbolic name to a numeric value.  */
@@ -2534,6 +5571,190 @@ trigger_restart (int signo MAYBE_UNUSED)
 #endif
 }
 
+void
+trigger_stats (int signo MAYBE_UNUSED)
+{
+  stats_requested = 1;
+#ifndef HAVE_SIGACTION
+  signal (SIGUSR2, trigger_stats);
+#endif
+}
+
+/* Statistics.  Every thread counts its input in counters of its own,
+   which are summed up only when a report is written, and the main
+   thread alone counts output.  Readings from other threads may thus
+   be slightly out of date, but never block them.  */
+
+/* Microseconds on a clock that does not jump.  */
+static unsigned long long
+stats_clock (void)
+{
+#if defined CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+  return time (NULL) * 1000000ULL;
+}
+
+/* Count a message of LEN bytes as received in ST.  */
+static void
+input_count (struct input_stats *st, size_t len)
+{
+  st->received++;
+  st->bytes += len;
+  if (len >= MAXLINE)
+    st->truncated++;
+}
+
+/* Count the line in IOV according to OUTCOME in ST, together with the
+   time spent since START.  */
+static void
+output_count (struct output_stats *st, int outcome, struct iovec *iov,
+	      unsigned long long start)
+{
+  unsigned long long usec = stats_clock () - start;
+  size_t len = 0;
+  int i;
+
+  if (outcome == OUT_DROPPED)
+    {
+      st->dropped++;
+      return;
+    }
+
+  for (i = 0; i < IOVCNT; i++)
+    len += iov[i].iov_len;
+  st->written++;
+  st->bytes += len;
+
+  for (i = 0; i < LATBUCKETS - 1 && usec >= (1ULL << i); i++)
+    ;
+  st->latency[i]++;
+}
+
+static void
+stats_input (FILE *fp, const char *name, int kind)
+{
+  struct input_stats sum = MainInput.in[kind];
+#ifdef RECEIVER_THREADS
+  size_t i;
+
+  for (i = 0; i < nreceivers; i++)
+    {
+      struct input_stats *st = &receivers[i]->stats.in[kind];
+
+      sum.received += st->received;
+      sum.bytes += st->bytes;
+      sum.truncated += st->truncated;
+      sum.errors += st->errors;
+      sum.lost += st->lost;
+    }
+#endif
+
+  fprintf (fp, "input %s received %lu bytes %llu truncated %lu errors %lu"
+	   " lost %lu\n", name, sum.received, sum.bytes, sum.truncated,
+	   sum.errors, sum.lost);
+}
+
+static void
+stats_output (FILE *fp, struct filed *f)
+{
+  struct output_stats *st = &f->f_stats;
+  unsigned long suspended = st->suspended;
+  size_t queued = 0;
+  int i;
+
+  fprintf (fp, "output %s ", TypeNames[f->f_type]);
+  switch (f->f_type)
+    {
+    case F_FILE:
+    case F_TTY:
+    case F_CONSOLE:
+    case F_PIPE:
+    case F_ZFILE:
+    case F_RING:
+    case F_STORE:
+      fputs (f->f_un.f_fname, fp);
+      break;
+
+    case F_FORW_SUSP:
+      suspended += now - f->f_time;
+      /* Fall through.  */
+    case F_FORW:
+    case F_FORW_UNKN:
+      fprintf (fp, "@%s", f->f_un.f_forw.f_hname);
+      break;
+
+    case F_USERS:
+      for (i = 0; i < f->f_un.f_user.f_nusers; i++)
+	fprintf (fp, "%s%s", i ? "," : "", f->f_un.f_user.f_unames[i]);
+      break;
+
+    default:
+      fputc ('*', fp);
+      break;
+    }
+
+#ifdef COMPRESSED_FILES
+  if (f->f_type == F_ZFILE && f->f_zf)
+    queued = zfile_pending (f->f_zf);
+#endif
+
+  fprintf (fp, " written %lu bytes %llu dropped %lu suspended %lu"
+	   " queued %zu latency", st->written, st->bytes, st->dropped,
+	   suspended, queued);
+  for (i = 0; i < LATBUCKETS; i++)
+    fprintf (fp, " %lu", st->latency[i]);
+  fputc ('\n', fp);
+}
+
+/* Write all counters to StatsFile, replacing it at once.  */
+static void
+stats_dump (void)
+{
+  struct filed *f;
+  char *tmp;
+  FILE *fp;
+  int i;
+
+  tmp = malloc (strlen (StatsFile) + sizeof (".tmp"));
+  if (tmp == NULL)
+    {
+      logerror ("cannot allocate memory");
+      return;
+    }
+  sprintf (tmp, "%s.tmp", StatsFile);
+
+  fp = fopen (tmp, "w");
+  if (fp == NULL)
+    {
+      logerror (tmp);
+      free (tmp);
+      return;
+    }
+
+  (void) time (&now);
+  fprintf (fp, "latency-buckets-usec");
+  for (i = 0; i < LATBUCKETS - 1; i++)
+    fprintf (fp, " <%lu", 1UL << i);
+  fprintf (fp, " more\n");
+
+  stats_input (fp, "klog", IN_KLOG);
+  stats_input (fp, "unix", IN_UNIX);
+  stats_input (fp, "inet", IN_INET);
+  for (f = Files; f; f = f->f_next)
+    if (f->f_type != F_UNUSED)
+      stats_output (fp, f);
+
+  if (fclose (fp) != 0 || rename (tmp, StatsFile) < 0)
+    logerror (StatsFile);
+  else
+    dbg_printf ("Statistics written to %s.\n", StatsFile);
+  free (tmp);
+}
+
 /* Override default port with a non-NULL argument.
  * Otherwise identify the default syslog/udp with
  * proper fallback to avoid resolve issues.  */
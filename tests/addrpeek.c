@@ -24,6 +24,9 @@
  *
  *    addr : Reply with "Your address is $IP."
  *    env  : Reply with all known environment variables and their values.
+ *    accept : Given a listening socket, as a server of a pool is,
+ *             accept a connection on it and reply there instead.
+ *    sleep : Wait three seconds, holding the connection.
  *
  * Reasonable entries in `inetf.conf' could be
  *
@@ -92,6 +95,26 @@ write_address (int fd)
   sendto (fd, answer, len, 0, (struct sockaddr *) &ss, sslen);
 }
 
+static void
+accept_connection (void)
+{
+#ifdef SO_ACCEPTCONN
+  int fd, on = 0;
+  socklen_t len = sizeof (on);
+
+  if (getsockopt (STDIN_FILENO, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) < 0
+      || !on)
+    return;
+
+  fd = accept (STDIN_FILENO, NULL, NULL);
+  if (fd < 0)
+    exit (EXIT_FAILURE);
+  dup2 (fd, STDIN_FILENO);
+  dup2 (fd, STDOUT_FILENO);
+  close (fd);
+#endif
+}
+
 void
 write_environment (int fd, char *envp[])
 {
@@ -120,6 +143,18 @@ main (int argc, char *argv[])
 	  write_environment (STDOUT_FILENO, environ);
 	  continue;
 	}
+
+      if (strcmp (argv[j], "accept") == 0)
+	{
+	  accept_connection ();
+	  continue;
+	}
+
+      if (strcmp (argv[j], "sleep") == 0)
+	{
+	  sleep (3);
+	  continue;
+	}
     }
 
   close (STDIN_FILENO);
@@ -0,0 +1,229 @@
+#!/bin/sh
+
+# Copyright (C) 2024 Free Software Foundation, Inc.
+#
+# This file is part of GNU Inetutils.
+#
+# GNU Inetutils is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or (at
+# your option) any later version.
+#
+# GNU Inetutils is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see `http://www.gnu.org/licenses/'.
+
+# Regression tests for the ASCII mode of the FTP server "ftpd".
+#
+# The server is told to use ASCII mode while the client stays in image
+# mode, so that what goes over the wire are the very bytes of the local
+# files.  A file is stored and another retrieved, and both are compared
+# with what the conversions of ASCII mode must make of them: line ends,
+# CR NUL, runs of CR, and a CR ending a 64 kB block, which the server
+# converts one at a time.
+#
+# Prerequisites are those of ftp-localhost.sh: a superuser, and an
+# anonymous user `ftp' owning a writable directory in its home.
+
+. ./tools.sh
+
+FTP=${FTP:-../ftp/ftp$EXEEXT}
+FTPD=${FTPD:-../ftpd/ftpd$EXEEXT}
+INETD=${INETD:-../src/inetd$EXEEXT}
+TARGET=${TARGET:-127.0.0.1}
+
+# Portability fix for SVR4
+PWD="${PWD:-`pwd`}"
+
+USER=`func_id_user`
+FTPUSER=${FTPUSER:-ftp}
+
+if test -z "${VERBOSE+set}"; then
+    silence=:
+fi
+
+if [ ! -x $FTP ]; then
+    echo "No FTP client '$FTP' present.  Skipping test" >&2
+    exit 77
+elif [ ! -x $FTPD ]; then
+    echo "No FTP server '$FTPD' present.  Skipping test" >&2
+    exit 77
+elif [ ! -x $INETD ]; then
+    echo "No inetd superserver '$INETD' present.  Skipping test" >&2
+    exit 77
+fi
+
+# Inetd changes directory to / and needs an absolute path.
+case $FTPD in
+    /*) ;;
+    *) FTPD="$PWD/$FTPD" ;;
+esac
+
+$need_dd || exit_no_dd
+$need_mktemp || exit_no_mktemp
+$need_netstat || exit_no_netstat
+
+if [ $VERBOSE ]; then
+    set -x
+    $FTPD --version | $SED '1q'
+fi
+
+if test "$TEST_IPV4" = "no"; then
+    echo >&2 "IPv4 testing is disabled.  Skipping test."
+    exit 77
+fi
+
+if test `func_id_uid` != 0; then
+    echo "ftpd needs to run as root" >&2
+    exit 77
+fi
+
+if id "$FTPUSER" > /dev/null 2>&1; then
+    :
+else
+    echo "anonymous ftpd needs a '$FTPUSER' user" >&2
+    exit 77
+fi
+
+FTPHOME="`eval echo ~"$FTPUSER"`"
+
+# A directory below FTPHOME, owned by and writable for FTPUSER.
+DLDIR=none
+for dir in /pub /download /downloads /dl /tmp / ; do
+    test -d "$FTPHOME$dir" || continue
+    set -- `ls -ld "$FTPHOME$dir"`
+    test "$3" = $FTPUSER && test `expr $1 : 'drwx'` -eq 4 &&
+	DLDIR=$dir && break
+done
+if test "$DLDIR" = none; then
+    echo "No writable directory for $FTPUSER.  Skipping test." >&2
+    exit 77
+fi
+
+TMPDIR=`$MKTEMP -d $PWD/tmp.XXXXXXXXXX` ||
+    {
+	echo 'Failed at creating test directory.  Aborting.' >&2
+	exit 1
+    }
+
+STORED="$FTPHOME$DLDIR/ascii-stor.$$"
+SERVED="$FTPHOME$DLDIR/ascii-retr.$$"
+
+posttesting () {
+    test -n "$TMPDIR" && test -f "$TMPDIR/inetd.pid" \
+	&& test -r "$TMPDIR/inetd.pid" \
+	&& { kill "`cat $TMPDIR/inetd.pid`" \
+	     || kill -9 "`cat $TMPDIR/inetd.pid`"; }
+    test -n "$TMPDIR" && test -d "$TMPDIR" && rm -rf "$TMPDIR"
+    rm -f "$STORED" "$SERVED"
+}
+
+trap posttesting 0 1 2 3 15
+
+for PORT in 4719 4727 4743 4779 none; do
+    test $PORT = none && break
+    $NETSTAT -na | $GREP "^tcp[46]\{0,2\}.*[^0-9]$PORT[^0-9]" \
+	>/dev/null 2>&1 || break
+done
+if test "$PORT" = none; then
+    echo 'Our port allocation failed.  Skipping test.' >&2
+    exit 77
+fi
+
+echo "$TARGET:$PORT stream tcp4 nowait $USER $FTPD ftpd -A" \
+    > "$TMPDIR/inetd.conf"
+echo "machine $TARGET login $FTPUSER password foobar" > "$TMPDIR/.netrc"
+chmod 600 "$TMPDIR/.netrc"
+
+# Print N times the letter x, without any line end.
+xes () {
+    $DD if=/dev/zero bs=$1 count=1 2>/dev/null | tr '\000' x
+}
+
+# Print the line UNIT a thousand times.
+units () {
+    i=0
+    while test $i -lt 1000; do
+	printf "$1"
+	i=`expr $i + 1`
+    done
+}
+
+# Data to store, as sent and as the server must write it.  Each piece
+# of x ends a 64 kB block with a CR, followed in the next block by LF,
+# NUL, CR LF and a plain letter in turn.
+{
+    xes 65535; printf '\r'
+    printf '\n'; xes 65534; printf '\r'
+    printf '\000'; xes 65534; printf '\r'
+    printf '\r\n'; xes 65533; printf '\r'
+    printf 'y\n'
+    units 'ab\r\ncd\r\r\nef\r\000gh\r\r\r\000ij\rk\n'
+    printf 'z\r'
+} > "$TMPDIR/stor.wire"
+{
+    xes 65535; printf '\n'
+    xes 65534; printf '\r'
+    xes 65534; printf '\r\n'
+    xes 65533; printf '\ry\n'
+    units 'ab\ncd\r\nef\rgh\r\r\rij\rk\n'
+    printf 'z\r'
+} > "$TMPDIR/stor.expect"
+
+# Data to retrieve, as stored and as the server must send it.
+{
+    xes 65535; printf '\r\n'
+    xes 65534; printf '\r\r\n'
+    units 'ab\r\ncd\r\r\n\r\000ef\n'
+    printf 'z\r'
+} > "$TMPDIR/retr.file"
+{
+    xes 65535; printf '\r\r\n'
+    xes 65534; printf '\r\r\r\n'
+    units 'ab\r\r\ncd\r\r\r\n\r\000ef\r\n'
+    printf 'z\r'
+} > "$TMPDIR/retr.expect"
+
+$INETD --pidfile="$TMPDIR/inetd.pid" "$TMPDIR/inetd.conf" ||
+    {
+	echo 'Not able to start Inetd.  Skipping test.' >&2
+	exit 1
+    }
+
+# Wait for inetd to write pid and open socket
+sleep 2
+
+cat <<-STOP |
+	cd $DLDIR
+	lcd $TMPDIR
+	image
+	put retr.file `basename $SERVED`
+	quote TYPE A
+	put stor.wire `basename $STORED`
+	get `basename $SERVED` retr.wire
+	STOP
+HOME=$TMPDIR $FTP "$TARGET" $PORT -4 -v -p >$TMPDIR/ftp.stdout 2>&1
+
+test -z "${VERBOSE}" || cat "$TMPDIR/ftp.stdout"
+
+errno=0
+
+if cmp "$TMPDIR/stor.expect" "$STORED" >&2; then
+    $silence echo 'ASCII mode STOR succeeded.'
+else
+    echo 'ASCII mode STOR stored other data than expected.' >&2
+    errno=1
+fi
+
+if cmp "$TMPDIR/retr.expect" "$TMPDIR/retr.wire" >&2; then
+    $silence echo 'ASCII mode RETR succeeded.'
+else
+    echo 'ASCII mode RETR sent other data than expected.' >&2
+    errno=1
+fi
+
+exit $errno
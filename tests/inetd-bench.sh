@@ -0,0 +1,152 @@
+#!/bin/sh
+
+# Copyright (C) 2024 Free Software Foundation, Inc.
+#
+# This file is part of GNU Inetutils.
+#
+# GNU Inetutils is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or (at
+# your option) any later version.
+#
+# GNU Inetutils is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see `http://www.gnu.org/licenses/'.
+
+# Connection benchmark of the internet super-server.  Not part of
+# `make check', since the figures need a human to judge them.  Start
+# it from the build directory of `tests/' after `make check'.
+
+# Prerequisites:
+#
+#  * Shell: SVR4 Bourne shell, or newer.
+#
+#  * mktemp(1).
+
+# Is usage explanation in demand?
+#
+if test "$1" = "-h" || test "$1" = "--help" || test "$1" = "--usage"; then
+    cat <<HERE
+Benchmark of inetd, using inetdblast.
+
+Many concurrent clients connect over the loopback interface, first to
+a trivial server which inetd executes for each connection, then, when
+run as root, to the built-in services echo, discard and chargen, the
+latter also for bulk throughput.  For each, the rate of connections,
+the time to the first byte and to the end of connections, and the
+throughput are reported, followed by the statistics of inetd.
+
+Point INETD at builds of inetd with differing event handling, or add
+OPTIONS, to compare them.
+
+The following environment variables are used:
+
+COUNT		Connections per run (default 10000).
+CLIENTS		Connections at once (default 50).
+SIZE		Bytes exchanged on each connection (default 64).
+BULK		Bytes read from chargen on each connection of the
+		throughput run (default 10000000).
+INETD		The inetd to measure (default ../src/inetd).
+OPTIONS		Further options to inetd.
+NOCLEAN		No clean up of testing directory, if set.
+PORT		TCP port of the executed server (default 7777).
+TARGET		Receiving IPv4 address (default 127.0.0.1).
+
+HERE
+    exit 0
+fi
+
+# Step into `tests/', should the invokation
+# have been made outside of it.
+#
+[ -d src ] && [ -f tests/inetd-bench.sh ] && cd tests/
+
+. ./tools.sh
+
+$need_mktemp || exit_no_mktemp
+
+# Portability fix for SVR4
+PWD="${PWD:-`pwd`}"
+USER=${USER:-`func_id_user`}
+
+INETD=${INETD:-../src/inetd$EXEEXT}
+ADDRPEEK=${ADDRPEEK:-$PWD/addrpeek$EXEEXT}
+BLAST=${BLAST:-./inetdblast$EXEEXT}
+
+if [ ! -x $INETD ] || [ ! -x $ADDRPEEK ] || [ ! -x $BLAST ]; then
+    echo "Missing executable '$INETD', '$ADDRPEEK' or '$BLAST'.  Skipping." >&2
+    exit 77
+fi
+
+: ${COUNT:=10000}
+: ${CLIENTS:=50}
+: ${SIZE:=64}
+: ${BULK:=10000000}
+: ${PORT:=7777}
+: ${TARGET:=127.0.0.1}
+
+IU_TESTDIR="`$MKTEMP -d "$PWD/iu_bench.XXXXXX" 2>/dev/null`" ||
+    {
+	echo 'Failed at creating test directory.  Aborting.' >&2
+	exit 77
+    }
+
+CONF="$IU_TESTDIR"/inetd.conf
+PID="$IU_TESTDIR"/inetd.pid
+STATS="$IU_TESTDIR"/inetd.stats
+
+clean_testdir () {
+    if test -f "$PID" && kill -0 "`cat "$PID"`" >/dev/null 2>&1; then
+	kill "`cat "$PID"`" || kill -9 "`cat "$PID"`"
+    fi
+    test -n "${NOCLEAN+no}" || rm -r -f "$IU_TESTDIR"
+}
+
+trap clean_testdir EXIT HUP INT QUIT TERM
+
+# The built-in services listen on their well-known ports, which only
+# root may bind.  The rate of connections is limited by option -R
+# alone, set high enough not to get in the way.
+echo "$TARGET:$PORT stream tcp4 nowait $USER $ADDRPEEK addrpeek addr" \
+    > "$CONF"
+if test `func_id_uid` = 0; then
+    for service in echo discard chargen; do
+	echo "$TARGET:$service stream tcp4 nowait root internal" >> "$CONF"
+    done
+else
+    echo 'Built-in services are left out, needing root.' >&2
+fi
+
+eval $INETD -R 1000000000 -p"'$PID'" --stats-file="'$STATS'" $OPTIONS "'$CONF'"
+
+sleep 1
+if [ ! -r "$PID" ]; then
+    echo "The service daemon never started.  Failing." >&2
+    exit 1
+fi
+
+EXITCODE=0
+
+run () {
+    echo "== $*"
+    $BLAST -n $COUNT -c $CLIENTS "$@" || EXITCODE=1
+}
+
+run -s 0 read $TARGET $PORT
+if test `func_id_uid` = 0; then
+    run -s $SIZE echo $TARGET echo
+    run -s $SIZE write $TARGET discard
+    run -s $SIZE read $TARGET chargen
+    COUNT=$CLIENTS run -s $BULK read $TARGET chargen
+fi
+
+kill -USR2 "`cat "$PID"`"
+sleep 1
+echo "== statistics"
+cat "$STATS"
+
+exit $EXITCODE
@@ -217,6 +217,66 @@ else
     $silence echo "Passed `expr $nn - 1` SIGHUP rounds."
 fi
 
+# Limits and pools, over IPv4 alone.  A server which holds its
+# connection for three seconds shows a second client held back by
+# the limit of one server at a time, and a client queued meanwhile
+# served after a reload, which must keep the listening socket.  The
+# servers of a pool are handed the socket the way of socket activation.
+#
+PORT2=`expr $PORT + 1`
+PORT3=`expr $PORT + 2`
+FIRST="$IU_TESTDIR"/first
+SECOND="$IU_TESTDIR"/second
+POOLENV="$IU_TESTDIR"/pool.env
+
+if test $errno -eq 0 && test "$TEST_IPV4" != "no" && test -n "$TARGET"
+then
+    write_conf $PORT
+    cat >> $CONF <<-EOT
+	$TARGET:$PORT2 stream tcp4 nowait.0.1.1 $USER $ADDRPEEK addrpeek addr sleep
+	$TARGET:$PORT3 stream tcp4 wait.0.2 $USER $ADDRPEEK addrpeek accept env
+	EOT
+    kill -HUP `cat $PID`
+    sleep 1
+
+    $TCPGET -t 10 $TARGET $PORT2 > "$FIRST" 2>/dev/null &
+    sleep 1
+    $TCPGET -t 1 $TARGET $PORT2 > "$SECOND" 2>/dev/null
+    wait
+    if $GREP "Your address is $TARGET." "$FIRST" >/dev/null 2>&1 &&
+	test ! -s "$SECOND"; then
+	$silence echo 'A second client was held back.'
+    else
+	echo >&2 '*** A second client was served at once, or none was. ***'
+	errno=`expr $errno + 1`
+    fi
+
+    # Let the client queued above be served and gone.
+    sleep 4
+
+    $TCPGET -t 10 $TARGET $PORT2 > "$FIRST" 2>/dev/null &
+    sleep 1
+    $TCPGET -t 10 $TARGET $PORT2 > "$SECOND" 2>/dev/null &
+    sleep 1
+    kill -HUP `cat $PID`
+    wait
+    if $GREP "Your address is $TARGET." "$SECOND" >/dev/null 2>&1; then
+	$silence echo 'A queued client was served after a reload.'
+    else
+	echo >&2 '*** A reload lost the connection queued on a service. ***'
+	errno=`expr $errno + 1`
+    fi
+
+    $TCPGET $TARGET $PORT3 > "$POOLENV" 2>/dev/null
+    if $GREP '^LISTEN_FDS=1$' "$POOLENV" >/dev/null 2>&1 &&
+	$GREP '^LISTEN_PID=[0-9]\{1,\}$' "$POOLENV" >/dev/null 2>&1; then
+	$silence echo 'A pool server was activated with its socket.'
+    else
+	echo >&2 '*** A pool server lacked LISTEN_FDS or LISTEN_PID. ***'
+	errno=`expr $errno + 1`
+    fi
+fi
+
 test $errno -ne 0 || $silence echo 'Successful testing.'
 
 clean_testdir
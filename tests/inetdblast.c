@@ -0,0 +1,382 @@
+/* inetdblast - connection load generator for inetd.
+  Copyright (C) 2024 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'. */
+
+/* Inetdblast opens a number of TCP connections to a service, keeping
+ * a given number of them in progress at any time, and reports the
+ * rate at which they complete, the time from connecting to the first
+ * byte received and to the end of each connection, and the throughput.
+ *
+ * What is done on a connection depends on the mode:
+ *
+ *   echo	write SIZE bytes, and read them back (echo service);
+ *   read	read SIZE bytes, or up to end of file with SIZE 0, as sent
+ *		by chargen, daytime, or most exec'd servers;
+ *   write	write SIZE bytes and close (discard service).
+ *
+ * Invocation:
+ *
+ *   inetdblast [-n count] [-c clients] [-s size] [-t secs] MODE HOST PORT
+ *
+ * A connection refused, reset, or not over after the timeout counts
+ * as failed.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <progname.h>
+
+enum mode
+{
+  MODE_ECHO,
+  MODE_READ,
+  MODE_WRITE
+};
+
+static enum mode mode;
+static unsigned long count = 1000;	/* Connections to make.  */
+static unsigned long clients = 10;	/* Connections at once.  */
+static size_t size = 64;		/* Bytes to exchange on each.  */
+static int timeout = 10;		/* Seconds a connection may take.  */
+
+/* A connection in progress.  */
+struct client
+{
+  int fd;
+  int connected;
+  size_t sent, received;
+  unsigned long long start;		/* Microseconds.  */
+  unsigned long long first;		/* First byte received, or 0.  */
+};
+
+static struct sockaddr_storage target;
+static socklen_t targetlen;
+static char *payload;
+static char buf[65536];
+
+/* Results.  */
+static unsigned long started, completed, failed;
+static unsigned long long bytes;
+static unsigned long long *ttfb, *duration;	/* Microseconds.  */
+static unsigned long nttfb;
+
+static unsigned long long
+now_usec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "Usage: %s [-n count] [-c clients] [-s size] [-t secs]"
+	   " echo|read|write HOST PORT\n", program_name);
+  exit (EXIT_FAILURE);
+}
+
+/* Start a new connection in CL, unless all have been.  Connections
+   refused at once count as failed, and the next one is tried.  */
+static void
+client_start (struct client *cl)
+{
+  int fd;
+
+  cl->fd = -1;
+  while (started < count)
+    {
+      started++;
+
+      fd = socket (target.ss_family, SOCK_STREAM, 0);
+      if (fd < 0)
+	{
+	  perror ("socket");
+	  exit (EXIT_FAILURE);
+	}
+      fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+      memset (cl, 0, sizeof (*cl));
+      cl->fd = fd;
+      cl->start = now_usec ();
+      if (connect (fd, (struct sockaddr *) &target, targetlen) == 0)
+	cl->connected = 1;
+      else if (errno != EINPROGRESS)
+	{
+	  close (fd);
+	  cl->fd = -1;
+	  failed++;
+	  continue;
+	}
+      return;
+    }
+}
+
+/* Finish the connection in CL, successfully if OK, and start the
+   next one.  */
+static void
+client_end (struct client *cl, int ok)
+{
+  unsigned long long now = now_usec ();
+
+  close (cl->fd);
+  if (ok)
+    {
+      duration[completed++] = now - cl->start;
+      if (cl->first)
+	ttfb[nttfb++] = cl->first - cl->start;
+      bytes += cl->sent + cl->received;
+    }
+  else
+    failed++;
+  client_start (cl);
+}
+
+/* The poll events CL waits for.  An echo client reads while it is
+   still writing, lest both ends block on full socket buffers.  */
+static short
+client_events (struct client *cl)
+{
+  if (!cl->connected)
+    return POLLOUT;
+  switch (mode)
+    {
+    case MODE_ECHO:
+      return POLLIN | (cl->sent < size ? POLLOUT : 0);
+    case MODE_WRITE:
+      return POLLOUT;
+    default:
+      return POLLIN;
+    }
+}
+
+/* Make progress on CL, whose socket is ready.  */
+static void
+client_event (struct client *cl)
+{
+  ssize_t n;
+
+  if (!cl->connected)
+    {
+      int err = 0;
+      socklen_t len = sizeof (err);
+
+      if (getsockopt (cl->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0
+	  || err != 0)
+	{
+	  client_end (cl, 0);
+	  return;
+	}
+      cl->connected = 1;
+    }
+
+  while (mode != MODE_READ && cl->sent < size)
+    {
+      size_t len = size - cl->sent;
+
+      if (len > sizeof (buf))
+	len = sizeof (buf);
+      n = write (cl->fd, payload, len);
+      if (n < 0)
+	{
+	  if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    break;
+	  client_end (cl, 0);
+	  return;
+	}
+      cl->sent += n;
+    }
+
+  if (mode == MODE_WRITE)
+    {
+      if (cl->sent == size)
+	client_end (cl, 1);
+      return;
+    }
+
+  for (;;)
+    {
+      n = read (cl->fd, buf, sizeof (buf));
+      if (n < 0)
+	{
+	  if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    return;
+	  client_end (cl, 0);
+	  return;
+	}
+      if (n > 0 && cl->first == 0)
+	cl->first = now_usec ();
+      cl->received += n;
+      if (n == 0)
+	{
+	  /* End of file is what is awaited when reading all.  */
+	  client_end (cl, mode == MODE_READ && size == 0);
+	  return;
+	}
+      if (size && cl->received >= size)
+	{
+	  client_end (cl, 1);
+	  return;
+	}
+    }
+}
+
+static int
+compare_ull (const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void
+report_times (const char *what, unsigned long long *t, unsigned long n)
+{
+  if (n == 0)
+    return;
+  qsort (t, n, sizeof (*t), compare_ull);
+  printf ("%s usec p50 %llu p90 %llu p99 %llu max %llu\n", what,
+	  t[n / 2], t[n * 9 / 10], t[n * 99 / 100], t[n - 1]);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct addrinfo hints, *ai;
+  struct client *cl;
+  struct pollfd *pfd;
+  unsigned long long begin, end;
+  unsigned long i;
+  int err, opt;
+
+  set_program_name (argv[0]);
+
+  while ((opt = getopt (argc, argv, "c:n:s:t:")) != -1)
+    switch (opt)
+      {
+      case 'c':
+	clients = strtoul (optarg, NULL, 10);
+	break;
+
+      case 'n':
+	count = strtoul (optarg, NULL, 10);
+	break;
+
+      case 's':
+	size = strtoul (optarg, NULL, 10);
+	break;
+
+      case 't':
+	timeout = atoi (optarg);
+	break;
+
+      default:
+	usage ();
+      }
+
+  if (argc - optind != 3 || count == 0 || clients == 0)
+    usage ();
+  if (!strcmp (argv[optind], "echo"))
+    mode = MODE_ECHO;
+  else if (!strcmp (argv[optind], "read"))
+    mode = MODE_READ;
+  else if (!strcmp (argv[optind], "write"))
+    mode = MODE_WRITE;
+  else
+    usage ();
+  if (mode != MODE_READ && size == 0)
+    usage ();
+  if (clients > count)
+    clients = count;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_socktype = SOCK_STREAM;
+  err = getaddrinfo (argv[optind + 1], argv[optind + 2], &hints, &ai);
+  if (err)
+    {
+      fprintf (stderr, "%s: %s: %s\n", program_name, argv[optind + 1],
+	       gai_strerror (err));
+      exit (EXIT_FAILURE);
+    }
+  memcpy (&target, ai->ai_addr, ai->ai_addrlen);
+  targetlen = ai->ai_addrlen;
+  freeaddrinfo (ai);
+
+  payload = malloc (sizeof (buf));
+  cl = calloc (clients, sizeof (*cl));
+  pfd = calloc (clients, sizeof (*pfd));
+  ttfb = malloc (count * sizeof (*ttfb));
+  duration = malloc (count * sizeof (*duration));
+  if (!payload || !cl || !pfd || !ttfb || !duration)
+    {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+  memset (payload, 'x', sizeof (buf));
+
+  begin = now_usec ();
+  for (i = 0; i < clients; i++)
+    client_start (&cl[i]);
+
+  while (completed + failed < count)
+    {
+      unsigned long long now = now_usec ();
+
+      for (i = 0; i < clients; i++)
+	{
+	  if (cl[i].fd >= 0 && now - cl[i].start > timeout * 1000000ULL)
+	    client_end (&cl[i], 0);
+	  pfd[i].fd = cl[i].fd;
+	  pfd[i].events = client_events (&cl[i]);
+	  pfd[i].revents = 0;
+	}
+      if (poll (pfd, clients, 100) < 0 && errno != EINTR)
+	{
+	  perror ("poll");
+	  exit (EXIT_FAILURE);
+	}
+      for (i = 0; i < clients; i++)
+	if (pfd[i].revents && cl[i].fd == pfd[i].fd)
+	  client_event (&cl[i]);
+    }
+  end = now_usec ();
+
+  printf ("%lu connections, %lu clients, %zu bytes each: completed %lu,"
+	  " failed %lu in %.3f s\n", count, clients, size, completed, failed,
+	  (end - begin) / 1e6);
+  printf ("rate %.0f conn/s, throughput %.1f MB/s\n",
+	  completed * 1e6 / (end - begin ? end - begin : 1),
+	  bytes / (double) (end - begin ? end - begin : 1));
+  report_times ("first byte", ttfb, nttfb);
+  report_times ("connection", duration, completed);
+
+  return failed ? 2 : EXIT_SUCCESS;
+}
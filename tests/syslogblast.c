@@ -0,0 +1,400 @@
+/* syslogblast - load generator for syslogd.
+  Copyright (C) 2024 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'. */
+
+/* Syslogblast sends numbered messages to a syslog daemon, either to a
+ * unix datagram socket or to a UDP port, at a given rate and size.
+ * Every message carries its send time.  When the log file written by
+ * the daemon is named, syslogblast follows it while sending, and
+ * reports how many messages arrived, the sustained rate of arrival,
+ * and the latency from sending to appearance in the file.  Datagrams
+ * dropped by the kernel for want of receive buffer space are reported
+ * as well, where the system tells so.
+ *
+ * Invocation:
+ *
+ *   syslogblast [-n count] [-r rate] [-s size] [-f file] [-w secs]
+ *               unix SOCKET
+ *   syslogblast [options] udp HOST PORT
+ *
+ * A rate of zero, the default, sends as fast as possible.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <progname.h>
+
+#define TAG	"syslogblast"
+
+static unsigned long count = 10000;	/* Messages to send.  */
+static unsigned long rate;		/* Messages per second, or 0.  */
+static size_t size = 100;		/* Length of each message.  */
+static const char *logfile;		/* File written by the daemon.  */
+static int linger = 5;			/* Seconds to wait for stragglers.  */
+
+/* Progress in the log file.  */
+static int logfd = -1;
+static char logbuf[8192];
+static size_t loglen;
+static unsigned char *seen;		/* One flag for every message.  */
+static unsigned long received, duplicates;
+static unsigned long long *latency;	/* Microseconds, in arrival order.  */
+static unsigned long long last_arrival;
+
+static unsigned long long
+now_usec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "Usage: %s [-n count] [-r rate] [-s size] [-f file]"
+	   " [-w secs] unix SOCKET\n"
+	   "       %s [options] udp HOST PORT\n",
+	   program_name, program_name);
+  exit (EXIT_FAILURE);
+}
+
+/* Read whatever the daemon appended to the log file, and account for
+   the messages found in it.  */
+static void
+scan_log (void)
+{
+  ssize_t n;
+  char *p, *eol;
+
+  if (logfd < 0)
+    return;
+
+  while ((n = read (logfd, logbuf + loglen,
+		    sizeof (logbuf) - 1 - loglen)) > 0)
+    {
+      unsigned long long t = now_usec ();
+
+      loglen += n;
+      logbuf[loglen] = '\0';
+
+      for (p = logbuf; (eol = strchr (p, '\n')); p = eol + 1)
+	{
+	  unsigned long seq;
+	  unsigned long long sent;
+	  char *q;
+
+	  *eol = '\0';
+	  q = strstr (p, TAG ": ");
+	  if (q == NULL
+	      || sscanf (q + sizeof (TAG ": ") - 1, "%lu %llu",
+			 &seq, &sent) != 2 || seq >= count)
+	    continue;
+	  if (seen[seq])
+	    {
+	      duplicates++;
+	      continue;
+	    }
+	  seen[seq] = 1;
+	  latency[received++] = t - sent;
+	  last_arrival = t;
+	}
+
+      /* Keep any partial line for the next round.  */
+      loglen -= p - logbuf;
+      memmove (logbuf, p, loglen);
+      if (loglen == sizeof (logbuf) - 1)
+	loglen = 0;		/* Overlong line, not ours.  */
+    }
+}
+
+/* Return the number of datagrams the kernel dropped for lack of
+   receive buffer space, summed over IPv4 and IPv6, or -1 if this
+   is not known.  Linux tells in /proc.  */
+static long
+rcvbuf_errors (void)
+{
+  char line[1024];
+  long total = -1, v;
+  FILE *fp;
+
+  fp = fopen ("/proc/net/snmp", "r");
+  if (fp)
+    {
+      int field = -1;
+
+      while (fgets (line, sizeof (line), fp))
+	{
+	  char *tok;
+	  int i;
+
+	  if (strncmp (line, "Udp: ", 5))
+	    continue;
+	  for (i = 0, tok = strtok (line + 5, " \n"); tok;
+	       i++, tok = strtok (NULL, " \n"))
+	    if (field < 0 && !strcmp (tok, "RcvbufErrors"))
+	      field = i;
+	    else if (field >= 0 && i == field)
+	      total = atol (tok);
+	}
+      fclose (fp);
+    }
+
+  fp = fopen ("/proc/net/snmp6", "r");
+  if (fp)
+    {
+      while (fgets (line, sizeof (line), fp))
+	if (sscanf (line, "Udp6RcvbufErrors %ld", &v) == 1)
+	  total = (total < 0 ? 0 : total) + v;
+      fclose (fp);
+    }
+
+  return total;
+}
+
+static int
+open_target (int argc, char *argv[], struct sockaddr_storage *ss,
+	     socklen_t *sslen)
+{
+  int fd;
+
+  if (argc == 2 && !strcmp (argv[0], "unix"))
+    {
+      struct sockaddr_un *sunx = (struct sockaddr_un *) ss;
+
+      if (strlen (argv[1]) >= sizeof (sunx->sun_path))
+	{
+	  fprintf (stderr, "%s: socket name too long\n", program_name);
+	  exit (EXIT_FAILURE);
+	}
+      memset (sunx, 0, sizeof (*sunx));
+      sunx->sun_family = AF_UNIX;
+      strcpy (sunx->sun_path, argv[1]);
+      *sslen = sizeof (*sunx);
+      fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+    }
+  else if (argc == 3 && !strcmp (argv[0], "udp"))
+    {
+      struct addrinfo hints, *ai;
+      int err;
+
+      memset (&hints, 0, sizeof (hints));
+      hints.ai_socktype = SOCK_DGRAM;
+      err = getaddrinfo (argv[1], argv[2], &hints, &ai);
+      if (err)
+	{
+	  fprintf (stderr, "%s: %s: %s\n", program_name, argv[1],
+		   gai_strerror (err));
+	  exit (EXIT_FAILURE);
+	}
+      memcpy (ss, ai->ai_addr, ai->ai_addrlen);
+      *sslen = ai->ai_addrlen;
+      fd = socket (ai->ai_family, SOCK_DGRAM, 0);
+      freeaddrinfo (ai);
+    }
+  else
+    usage ();
+
+  if (fd < 0)
+    {
+      perror ("socket");
+      exit (EXIT_FAILURE);
+    }
+  return fd;
+}
+
+static int
+compare_ull (const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct sockaddr_storage ss;
+  socklen_t sslen;
+  unsigned long seq, waits, blocked = 0, failed = 0;
+  unsigned long long start, end, waited;
+  long drops_before, drops_after;
+  char *msg;
+  int fd, opt;
+
+  set_program_name (argv[0]);
+
+  while ((opt = getopt (argc, argv, "f:n:r:s:w:")) != -1)
+    switch (opt)
+      {
+      case 'f':
+	logfile = optarg;
+	break;
+
+      case 'n':
+	count = strtoul (optarg, NULL, 10);
+	break;
+
+      case 'r':
+	rate = strtoul (optarg, NULL, 10);
+	break;
+
+      case 's':
+	size = strtoul (optarg, NULL, 10);
+	break;
+
+      case 'w':
+	linger = atoi (optarg);
+	break;
+
+      default:
+	usage ();
+      }
+
+  if (count == 0)
+    usage ();
+  fd = open_target (argc - optind, argv + optind, &ss, &sslen);
+
+  if (size < 64)
+    size = 64;			/* Room for priority, tag and numbers.  */
+  msg = malloc (size + 1);
+  seen = calloc (count, 1);
+  latency = malloc (count * sizeof (*latency));
+  if (msg == NULL || seen == NULL || latency == NULL)
+    {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+
+  if (logfile)
+    {
+      logfd = open (logfile, O_RDONLY);
+      if (logfd < 0)
+	{
+	  perror (logfile);
+	  exit (EXIT_FAILURE);
+	}
+      lseek (logfd, 0, SEEK_END);
+    }
+
+  drops_before = rcvbuf_errors ();
+  start = now_usec ();
+
+  for (seq = 0; seq < count; seq++)
+    {
+      int len;
+
+      /* Keep to the rate, following the log file meanwhile.  */
+      if (rate)
+	{
+	  unsigned long long due = start + seq * 1000000ULL / rate;
+
+	  while (now_usec () < due)
+	    {
+	      scan_log ();
+	      if (due - now_usec () > 200)
+		usleep (100);
+	    }
+	}
+      else if (seq % 64 == 0)
+	scan_log ();
+
+      len = snprintf (msg, size + 1, "<13>" TAG ": %lu %llu ", seq,
+		      now_usec ());
+      memset (msg + len, 'x', size - len);
+
+      for (waits = 0; sendto (fd, msg, size, MSG_DONTWAIT,
+			      (struct sockaddr *) &ss, sslen) < 0; waits++)
+	{
+	  if (errno != EAGAIN && errno != ENOBUFS && errno != EINTR)
+	    {
+	      failed++;
+	      break;
+	    }
+
+	  /* The daemon does not keep up.  Unix sockets do not tell
+	     when the peer has room again, so poll(2) is of no use.  */
+	  scan_log ();
+	  usleep (50);
+	}
+      if (waits)
+	blocked++;
+    }
+  end = now_usec ();
+
+  /* Wait for the remaining messages, as long as some do arrive.  */
+  for (waited = now_usec (); logfd >= 0 && received < count
+       && now_usec () - waited < linger * 1000000ULL;)
+    {
+      unsigned long before = received;
+
+      scan_log ();
+      if (received != before)
+	waited = now_usec ();
+      else
+	usleep (10000);
+    }
+
+  drops_after = rcvbuf_errors ();
+
+  printf ("sent %lu messages of %zu bytes in %.3f s (%.0f msg/s)\n",
+	  count - failed, size, (end - start) / 1e6,
+	  (count - failed) * 1e6 / (end - start ? end - start : 1));
+  printf ("messages delayed by a full socket %lu, send errors %lu\n",
+	  blocked, failed);
+  if (drops_before >= 0 && drops_after >= 0)
+    printf ("udp receive buffer errors %ld\n", drops_after - drops_before);
+
+  if (logfd >= 0)
+    {
+      printf ("received %lu, missing %lu, duplicated %lu\n",
+	      received, count - received, duplicates);
+      if (received > 0)
+	{
+	  unsigned long long sum = 0;
+	  unsigned long i;
+
+	  printf ("sustained %.0f msg/s\n",
+		  received * 1e6 / (last_arrival - start
+				    ? last_arrival - start : 1));
+
+	  for (i = 0; i < received; i++)
+	    sum += latency[i];
+	  qsort (latency, received, sizeof (*latency), compare_ull);
+	  printf ("latency usec min %llu avg %llu p50 %llu p99 %llu"
+		  " max %llu\n", latency[0], sum / received,
+		  latency[received / 2], latency[received * 99 / 100],
+		  latency[received - 1]);
+	}
+    }
+
+  return received < count && logfd >= 0 ? 2 : EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+#!/bin/sh
+
+# Copyright (C) 2024 Free Software Foundation, Inc.
+#
+# This file is part of GNU Inetutils.
+#
+# GNU Inetutils is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or (at
+# your option) any later version.
+#
+# GNU Inetutils is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see `http://www.gnu.org/licenses/'.
+
+# Ingestion benchmark of the SYSLOG daemon.  Not part of `make check',
+# since the figures need a human to judge them.  Start it from the
+# build directory of `tests/' after `make check'.
+
+# Prerequisites:
+#
+#  * Shell: SVR4 Bourne shell, or newer.
+#
+#  * mktemp(1).
+
+# Is usage explanation in demand?
+#
+if test "$1" = "-h" || test "$1" = "--help" || test "$1" = "--usage"; then
+    cat <<HERE
+Benchmark of syslogd ingestion, using syslogblast.
+
+Messages are sent over a unix socket, UDP over IPv4, and UDP over
+IPv6, in turn.  For each, the rate at which they reach the log file,
+the latency from sending to the file, and the drops are reported.
+
+The following environment variables are used:
+
+COUNT		Messages per run (default 100000).
+RATE		Messages per second, or 0 for no limit (default 0).
+SIZE		Length of each message (default 100).
+OPTIONS		Further options to syslogd, like --inet-threads=4.
+NOCLEAN		No clean up of testing directory, if set.
+PORT		UDP port (default 5514).
+TARGET		Receiving IPv4 address.
+TARGET6		Receiving IPv6 address.
+
+HERE
+    exit 0
+fi
+
+# Step into `tests/', should the invokation
+# have been made outside of it.
+#
+[ -d src ] && [ -f tests/syslogd-bench.sh ] && cd tests/
+
+. ./tools.sh
+
+$need_mktemp || exit_no_mktemp
+
+SYSLOGD=${SYSLOGD:-../src/syslogd$EXEEXT}
+BLAST=${BLAST:-./syslogblast$EXEEXT}
+
+if [ ! -x $SYSLOGD ] || [ ! -x $BLAST ]; then
+    echo "Missing executable '$SYSLOGD' or '$BLAST'.  Skipping." >&2
+    exit 77
+fi
+
+: ${COUNT:=100000}
+: ${RATE:=0}
+: ${SIZE:=100}
+: ${PORT:=5514}
+: ${TARGET:=127.0.0.1}
+: ${TARGET6:=::1}
+
+IU_TESTDIR="`$MKTEMP -d "$PWD/iu_bench.XXXXXX" 2>/dev/null`" ||
+    {
+	echo 'Failed at creating test directory.  Aborting.' >&2
+	exit 77
+    }
+
+CONF="$IU_TESTDIR"/syslog.conf
+CONFD="$IU_TESTDIR"/syslog.d
+PID="$IU_TESTDIR"/syslogd.pid
+OUT="$IU_TESTDIR"/messages
+SOCKET="$IU_TESTDIR"/log
+
+clean_testdir () {
+    if test -f "$PID" && kill -0 "`cat "$PID"`" >/dev/null 2>&1; then
+	kill "`cat "$PID"`" || kill -9 "`cat "$PID"`"
+    fi
+    test -n "${NOCLEAN+no}" || rm -r -f "$IU_TESTDIR"
+}
+
+trap clean_testdir EXIT HUP INT QUIT TERM
+
+# Route the benchmark messages alone, without syncing.
+echo "user.*	-$OUT" > "$CONF"
+mkdir -p "$CONFD"
+touch "$OUT"
+
+# Disable kernel messages.
+if [ -c /dev/klog ] || [ -c /dev/kmsg ]; then
+    OPTIONS="--no-klog $OPTIONS"
+fi
+
+eval $SYSLOGD --rcfile="'$CONF'" --rcdir="'$CONFD'" \
+    --pidfile="'$PID'" --socket="'$SOCKET'" \
+    --ipany --inet -B$PORT $OPTIONS
+
+sleep 1
+if [ ! -r "$PID" ]; then
+    echo "The service daemon never started.  Failing." >&2
+    exit 1
+fi
+
+EXITCODE=0
+
+run () {
+    echo "== $*"
+    # Lost messages are a result, not a failure.
+    $BLAST -n $COUNT -r $RATE -s $SIZE -f "$OUT" "$@"
+    rc=$?
+    test $rc -eq 0 || test $rc -eq 2 || EXITCODE=1
+}
+
+run unix "$SOCKET"
+run udp $TARGET $PORT
+run udp $TARGET6 $PORT
+
+exit $EXITCODE
@@ -376,7 +376,7 @@ if $do_inet_socket; then
 fi
 ## Bring in additional options from command line.
 ## Disable kernel messages otherwise.
-if [ -c /dev/klog ]; then
+if [ -c /dev/klog ] || [ -c /dev/kmsg ]; then
     : OPTIONS=${OPTIONS:=--no-klog}
 fi
 IU_OPTIONS="$IU_OPTIONS $OPTIONS"
@@ -573,6 +573,63 @@ if $do_inet_socket; then
     fi # TEST_IPV6 && TARGET6
 fi # do_inet_socket
 
+# Destinations kept by syslogd itself: a memory ring read back by
+# logread, and a file rotated at one kilobyte.  A reload must keep the
+# descriptor of an unchanged entry, which on systems with /proc shows
+# as the same descriptor number, since a file opened anew is opened
+# before the old descriptor is closed.
+#
+LOGREAD=${LOGREAD:-../src/logread$EXEEXT}
+OUT_RING="$IU_TESTDIR"/ring
+OUT_ROTATE="$IU_TESTDIR"/rotate.log
+TAG3="syslogd-dest-test"
+
+# Print the descriptors by which syslogd writes to $OUT_USER.
+user_fd () {
+    ls -l /proc/`cat "$PID"`/fd 2>/dev/null |
+	$SED -n "s,.* \([0-9][0-9]*\) -> $OUT_USER\$,\1,p"
+}
+
+if $do_unix_socket; then
+    fd_before=`user_fd`
+
+    echo "user.*	$OUT_ROTATE rotate=1k keep=2" >> "$CONF"
+    test -x "$LOGREAD" && echo "user.*	%$OUT_RING size=16k" >> "$CONF"
+    kill -HUP `cat "$PID"`
+    sleep 2
+
+    if test -n "$fd_before"; then
+	TESTCASES=`expr $TESTCASES + 1`
+	if test "`user_fd`" = "$fd_before"; then
+	    SUCCESSES=`expr $SUCCESSES + 1`
+	else
+	    echo >&2 '** The file "user.log" was opened anew on reload.'
+	fi
+    fi
+
+    for n in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+	$LOGGER -h "$SOCKET" -p user.info -t "$TAG3" \
+	    "Message $n to fill the files. (pid $$)"
+    done
+    sleep 1
+
+    TESTCASES=`expr $TESTCASES + 1`
+    if $GREP "$TAG3.*Message 1 " "$OUT_ROTATE.1" >/dev/null 2>&1 &&
+	$GREP "$TAG3.*Message 20 " "$OUT_ROTATE" >/dev/null 2>&1; then
+	SUCCESSES=`expr $SUCCESSES + 1`
+    else
+	echo >&2 '** The file "rotate.log" was not rotated.'
+    fi
+
+    if test -x "$LOGREAD"; then
+	TESTCASES=`expr $TESTCASES + 2`
+	test `$LOGREAD "$OUT_RING" | $GREP -c "$TAG3"` -eq 20 &&
+	    SUCCESSES=`expr $SUCCESSES + 1`
+	$LOGREAD -n 1 "$OUT_RING" | $GREP "$TAG3.*Message 20 " >/dev/null 2>&1 &&
+	    SUCCESSES=`expr $SUCCESSES + 1`
+    fi
+fi # do_unix_socket
+
 # Remove previous SYSLOG daemon.
 test -r "$PID" && kill -0 "`cat "$PID"`" >/dev/null 2>&1 &&
     kill "`cat "$PID"`"